@@ -0,0 +1,247 @@
+#ifndef ALMOSTGL_H
+#define ALMOSTGL_H
+
+#include <vector>
+#include "mesh.h"
+#include "param.h"
+#include "matrix.h"
+#include "threadpool.h"
+#include "vertexstage.h"
+#include "fragmentstage.h"
+#include "profiler.h"
+
+//height in scanlines of each screen tile. culled triangles
+//are binned into the tiles they overlap and each tile is
+//rasterized by a single thread, which then owns its slice
+//of the color and depth buffers.
+#define TILE_HEIGHT 16
+
+//size in pixels of the square tiles of the hierarchical z-buffer.
+//each one keeps the farthest depth stored in it, so that triangles
+//(or pieces of them) behind it can be thrown away before being
+//rasterized. it must divide TILE_HEIGHT, so no hi-z tile is ever
+//shared by two threads
+#define HIZ_TILE 8
+static_assert(TILE_HEIGHT % HIZ_TILE == 0, "hi-z tiles can't cross screen tiles");
+
+//clipping a triangle against the 6 frustum planes plus
+//the w > 0 one adds at most one vertex per plane
+#define MAX_CLIP_VERTICES (3 + 7)
+#define MAX_CLIP_TRIANGLES (MAX_CLIP_VERTICES - 2)
+
+//wall clock time, in milliseconds, spent by each
+//stage of the pipeline in the last call to render().
+//the streaming pipeline fuses clipping, projection and
+//culling (and binning), and reports them all as clipping.
+//shading is the per-pixel lighting pass, zero for the
+//shading models computed in the vertex stage
+struct StageTimes
+{
+  double vertex, clipping, projection, culling, rasterization, shading;
+
+  double total() const { return vertex + clipping + projection + culling + rasterization + shading; }
+};
+
+//what the pipeline did in the last call to render()
+struct FrameCounters
+{
+  long long vertices, triangles_visible, triangles_clipped, triangles_culled;
+  long long fragments_tested, fragments_written;
+
+  //level of detail of the mesh that was drawn
+  int lod;
+
+  //pixels written at least once. only counted while
+  //profiling, as it takes a pass over the depth buffer
+  long long pixels_covered;
+
+  double overdraw() const { return pixels_covered ? (double)fragments_written / pixels_covered : 0.0; }
+};
+
+//depth tests done by a rasterizer and how many of them passed
+struct FragmentCounts
+{
+  long long tested, written;
+};
+
+//triangles of one job of the streaming pipeline. they're
+//clipped into tris, then divided and culled in place
+struct TriangleBatch
+{
+  std::vector<float> tris, poly;
+  int n_floats, n_clipped, n_culled;
+};
+
+class AlmostGL
+{
+private:
+  const Mesh& mesh;
+  ThreadPool pool;
+
+  //SoA copy of the mesh read by the vertex
+  //stage and the SIMD kernel it runs
+  VertexStreams streams;
+  VertexStage::Kernel kernel;
+
+  //shininess of each material, indexed by streams.material
+  std::vector<float> shininess;
+
+  //level of detail drawn this frame and its index buffer
+  //(3 vertices per triangle). n_triangles counts its triangles
+  int lod;
+  const uint32_t* indices;
+  void select_level(const GlobalParameters& param, const mat4& model2world, const vec3& eye);
+
+  //triangles of the BVH nodes inside the view frustum (and not
+  //facing away) and the vertices they use. node_vertices holds, for
+  //each node (of all levels), the range of vertices the triangles
+  //of its subtree use
+  std::vector<IndexRange> visible, visible_vertices, node_vertices;
+  std::vector<uint32_t> visible_nodes;
+  int n_visible;
+  void bvh_culling(const GlobalParameters& param, const mat4& model2world,
+                   const mat4& mvp, const vec3& eye);
+
+  //vertex buffers
+  int n_vertices, n_triangles, vertex_sz;
+  float *vbuffer, *clipped, *culled, *projected;
+  int clipped_last, projected_last, culled_last;
+  int clip_capacity;
+
+  //the two polygons the clipper ping-pongs between
+  std::vector<float> clip_poly;
+
+  //streaming pipeline batches, a few per thread. batches take
+  //STREAM_BATCH triangles each out of the visible ones, whose
+  //ranges start at these positions
+  std::vector<TriangleBatch> batches;
+  std::vector<int> visible_start;
+
+  //jobs of the vertex stage, ranges of at most VERTEX_BATCH vertices
+  std::vector<IndexRange> vertex_jobs;
+
+  //triangle bins. each bin points to triangles inside the
+  //culled buffer (or the streaming batches) in submission order,
+  //so that depth ties are resolved exactly as in the serial path
+  int n_tiles;
+  std::vector< std::vector<const float*> > bins;
+
+  StageTimes times;
+  FrameCounters counters;
+  std::vector<FragmentCounts> tile_counts;
+  Profiler* profiler;
+
+  //pixel buffers. frames are written to color, which is
+  //our own color_storage unless someone gave us a target
+  int buffer_height, buffer_width;
+  GLubyte *color, *color_storage; float *depth;
+
+  //G-buffer for per-pixel shading: octahedral normal and
+  //material index of the nearest fragment (see fragmentstage.h)
+  uint32_t *gnormal; uint16_t *gmaterial;
+
+  //hierarchical z-buffer. hiz holds the farthest depth of each
+  //tile, hiz_dirty tells it must be recomputed because some pixel
+  //inside the tile was written since (we only do it when asked)
+  int hiz_width, hiz_height;
+  float *hiz; unsigned char *hiz_dirty;
+  float hiz_farthest(int tx, int ty);
+  bool hiz_occluded(float z_near, int x0, int y0, int x1, int y1);
+
+  //parameters the vertex stage last ran with. the choice of level,
+  //the BVH walk and the vertex stage depend only on some of them,
+  //so while those stay the same their output is reused
+  GlobalParameters vertex_param;
+  bool vertices_valid;
+  bool same_vertices(const GlobalParameters& param) const;
+
+  void vertex_processing(const GlobalParameters& param, const mat4& model2world,
+                          const mat4& vp, const vec3& eye, const vec4& light,
+                          const vec3& model_color);
+  void clipping();
+  void grow_clip_buffers(int n_floats);
+  void perspective_division();
+  void culling(const GlobalParameters& param);
+  void binning(const mat4& viewport, const float* tris, int n_floats);
+  void clear_buffers();
+  void raster_bins(const mat4& viewport);
+  void rasterization(const GlobalParameters& param, const mat4& viewport);
+  void streaming(const GlobalParameters& param, const mat4& viewport,
+                 double& front_ms, double& raster_ms);
+  void shading(const GlobalParameters& param, const mat4& vp, const vec3& eye,
+               const vec4& light, const vec3& model_color);
+
+  //work of the clipping, projection and culling stages on a range
+  //of triangles, shared by both pipelines. they return how many
+  //floats were written to out, which may be the same as in
+  int clip_triangle(int t_id, float* out, float* poly_buffer, int& n_clipped) const;
+  int divide(const float* in, int n_floats, float* out) const;
+  int cull(const GlobalParameters& param, const float* in, int n_floats, float* out) const;
+  template<bool CCW>
+  int cull_triangles(const float* in, int n_floats, float* out) const;
+
+  //the rasterizers are instantiated for each combination of the
+  //render state their loops depend on (rasterizer, per-pixel shading
+  //and hi-z), so that the loops have no branches on it. wireframes
+  //and points have rasterizers of their own. pick_kernels() chooses
+  //the one for the frame before it starts
+  typedef void (AlmostGL::*RasterKernel)(const mat4& viewport, const float* tri,
+                                         int y_min, int y_max, FragmentCounts& counts);
+  RasterKernel raster_kernel;
+  void pick_kernels(const GlobalParameters& param);
+
+  template<int RASTERIZER, bool DEFERRED, bool HIZ>
+  void rasterize_triangle(const mat4& viewport, const float* tri,
+                          int y_min, int y_max, FragmentCounts& counts);
+
+  //rasterizers. all of them only write the rows in [y_min, y_max]
+  template<bool DEFERRED>
+  void rasterize_scanline(const mat4& viewport, const float* tri,
+                          int y_min, int y_max, FragmentCounts& counts);
+  template<bool DEFERRED, bool HIZ>
+  void rasterize_halfspace(const mat4& viewport, const float* tri,
+                           int y_min, int y_max, FragmentCounts& counts);
+
+  //edges of the triangle, one pixel wide (GL_LINE), and its
+  //vertices, one pixel each (GL_POINT)
+  template<bool DEFERRED>
+  void rasterize_lines(const mat4& viewport, const float* tri,
+                       int y_min, int y_max, FragmentCounts& counts);
+  template<bool DEFERRED>
+  void rasterize_points(const mat4& viewport, const float* tri,
+                        int y_min, int y_max, FragmentCounts& counts);
+
+  //depth test and write of the fragment at (x,y), whose attributes
+  //are those of the packed vertices a and b interpolated at t
+  template<bool DEFERRED>
+  void write_fragment(int x, int y, const float* a, const float* b, float t,
+                      uint16_t material, FragmentCounts& counts);
+
+public:
+  AlmostGL(const Mesh& mesh, int width, int height, int n_threads = 0);
+  ~AlmostGL();
+
+  void resize(int width, int height);
+  void render(const GlobalParameters& param);
+
+  //makes the next frames go straight into target, 4*width*height
+  //bytes nobody else touches while they render, instead of our own
+  //color buffer (null goes back to it, and so does resize()). it
+  //is only ever written, so write-combined memory is fine
+  void set_color_target(GLubyte* target);
+
+  const GLubyte* color_buffer() const { return color; }
+  int width() const { return buffer_width; }
+  int height() const { return buffer_height; }
+  const StageTimes& stage_times() const { return times; }
+  const FrameCounters& frame_counters() const { return counters; }
+
+  //stages, jobs and counters get recorded in the profiler, if any
+  void set_profiler(Profiler* p) { profiler = p; }
+
+  //switching kernels runs the vertex stage again on the next frame
+  VertexStage::Kernel vertex_kernel() const { return kernel; }
+  void set_vertex_kernel(VertexStage::Kernel k) { kernel = k; vertices_valid = false; }
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <cstdint>
+
+//node of a bounding volume hierarchy over the triangles of a mesh.
+//nodes are stored in depth-first order: the left child of an interior
+//node is the node right after it and skip is the first node past its
+//subtree (so leaves are the nodes whose skip is the next node). the
+//triangles of a subtree are a range of the index buffer, from the
+//first triangle of its root up to the first one of the skip node.
+//32 bytes, so that two nodes fit in a cache line
+struct BVHNode
+{
+  float min[3];
+  uint32_t first;
+  float max[3];
+  uint32_t skip;
+};
+
+//the normals of the triangles of a node (as given by their winding,
+//counter-clockwise) are all within spread of axis, and sin_spread
+//holds sin(spread). a cone as wide as a half space or more doesn't
+//tell anything about the node, and has sin_spread > 1
+struct NormalCone
+{
+  float axis[3];
+  float sin_spread;
+};
+
+//[first, first+count) of the triangles or vertices of a mesh
+struct IndexRange
+{
+  uint32_t first, count;
+};
+
+namespace BVH
+{
+  //builds the hierarchy over n_triangles triangles, given by 3 vertex
+  //ids each into pos (3 floats per vertex), and sorts indices so that
+  //every node covers a range of them. split planes are chosen with the
+  //surface area heuristic, over centroids binned along each axis.
+  //cones gets the normal cone of every node
+  void build(const float* pos, uint32_t* indices, int n_triangles,
+              std::vector<BVHNode>& nodes, std::vector<NormalCone>& cones);
+
+  //eye and front face orientation in model space for cull(), given
+  //model (model to world, column-major), the eye in world space and
+  //whether front faces wind counter-clockwise on screen. front is
+  //+1 when they wind counter-clockwise in model space too, and -1
+  //when they don't (cw front faces, or a mirroring model matrix)
+  void to_model_space(const float* model, const float* eye, bool front_ccw,
+                      float* model_eye, float& front);
+
+  //walks the hierarchy and fills visible with the triangles of the
+  //subtrees that may be seen, in index buffer order and with ranges
+  //next to each other merged. taken, if given, gets the nodes whose
+  //subtree was taken as a whole. the tests are optional:
+  // - mvp (model to clip space, column-major): drops the nodes whose
+  //   box is outside the view frustum
+  // - cones, eye and front (see to_model_space): drops the nodes whose
+  //   triangles all face away from the eye
+  void cull(const BVHNode* nodes, const NormalCone* cones, int n_nodes, int n_triangles,
+            const float* mvp, const float* eye, float front,
+            std::vector<IndexRange>& visible, std::vector<uint32_t>* taken = nullptr);
+}
+
+#endif
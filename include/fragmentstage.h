@@ -0,0 +1,65 @@
+#ifndef FRAGMENTSTAGE_H
+#define FRAGMENTSTAGE_H
+
+#include <cmath>
+#include <cstdint>
+#include "vertexstage.h"
+
+//G-buffer written by the rasterizers when shading per pixel. it keeps
+//only what the nearest fragment of each pixel needs to be lit later:
+//depth (the regular depth buffer), normal and material index
+struct GBuffer
+{
+  int width, height;
+  const float* depth;
+  const uint32_t* normal;
+  const uint16_t* material;
+};
+
+//everything the fragment stage needs besides the G-buffer.
+//inv_vp maps normalized device coordinates back to world
+//space and is stored column-major, like mat4
+struct FragmentUniforms
+{
+  float inv_vp[16];
+  float eye[3], light[3];
+  float model_color[3];
+
+  //shininess of each material
+  const float* shininess;
+};
+
+namespace FragmentStage
+{
+  //normals are stored in 32 bits using the octahedral mapping:
+  //the unit sphere is projected onto the octahedron |x|+|y|+|z| = 1,
+  //whose lower half is folded over the upper one, and the resulting
+  //(x,y) in [-1,1]² are quantized to 16 bits each
+  inline uint32_t encode_normal(float x, float y, float z)
+  {
+    float l1 = fabsf(x) + fabsf(y) + fabsf(z);
+    if(l1 == 0.0f) return 0;
+    x /= l1; y /= l1;
+    if(z < 0.0f)
+    {
+      float fx = (1.0f - fabsf(y)) * (x < 0.0f ? -1.0f : 1.0f);
+      float fy = (1.0f - fabsf(x)) * (y < 0.0f ? -1.0f : 1.0f);
+      x = fx; y = fy;
+    }
+
+    int16_t qx = (int16_t)lrintf(x * 32767.0f);
+    int16_t qy = (int16_t)lrintf(y * 32767.0f);
+    return (uint32_t)(uint16_t)qx | ((uint32_t)(uint16_t)qy << 16);
+  }
+
+  //lights the pixels of rows [first_row, last_row) with per-pixel
+  //Blinn-Phong and writes them as RGBA to color. pixels no fragment
+  //was written to (depth 2.0) are left black, like the clear color
+  void shade(VertexStage::Kernel k,
+              const GBuffer& g,
+              const FragmentUniforms& u,
+              int first_row, int last_row,
+              unsigned char* color);
+}
+
+#endif
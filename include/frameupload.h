@@ -0,0 +1,66 @@
+#ifndef FRAMEUPLOAD_H
+#define FRAMEUPLOAD_H
+
+#include <nanogui/opengl.h>
+#include "renderthread.h"
+
+//Takes the frames of a RenderThread to a texture without ever
+//stalling the thread drawing the window. When the driver has
+//persistent buffer mappings (GL 4.4 or ARB_buffer_storage), the
+//three frames of the render thread live in a single pixel buffer,
+//mapped once for good, and AlmostGL rasterizes straight into it:
+//the upload to the texture is a copy inside the GPU, which runs
+//while the next frame is being rendered. A fence tells when the GPU
+//is done with the frame, and until then it isn't given back to the
+//render thread. Otherwise frames are copied to a buffer the driver
+//can orphan, which still avoids copying from client memory.
+class FrameUpload
+{
+private:
+  RenderThread& renderer;
+
+  GLuint texture;
+  int texture_width, texture_height;
+
+  //size of the window, and of the frame in the texture
+  int window_width, window_height;
+  int frame_width, frame_height;
+
+  //three slots of slot_size bytes, one per frame of the render
+  //thread, and the buffer copies go through when they can't be used
+  bool persistent;
+  GLuint pbo, stream;
+  GLubyte* mapped;
+  size_t slot_size;
+
+  //latest frame uploaded, and the fence after its upload
+  //(zero once we know the GPU finished reading it)
+  const RenderedFrame* shown;
+  uint64_t shown_number;
+  GLsync fence;
+
+  void grow(size_t size);
+  void upload(const RenderedFrame& frame);
+
+public:
+  FrameUpload(RenderThread& renderer);
+  ~FrameUpload();
+
+  FrameUpload(const FrameUpload&) = delete;
+  FrameUpload& operator=(const FrameUpload&) = delete;
+
+  //makes room for frames of this size and uploads the latest
+  //one, if there is a new one and the previous is done with.
+  //returns the frame in the texture, null if it's not known
+  //anymore (before the first one, or after the buffer grew)
+  const RenderedFrame* update(int width, int height);
+
+  //whatever was uploaded last, with linear filtering. frames are
+  //in the corner of the texture at (0, 0), and may be smaller
+  GLuint color_texture() const { return texture; }
+  bool has_frame() const { return frame_width > 0; }
+  int width() const { return frame_width; }
+  int height() const { return frame_height; }
+};
+
+#endif
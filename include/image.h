@@ -0,0 +1,21 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <string>
+
+//writers for the RGBA8 color buffers produced by AlmostGL.
+//row 0 is the top of the image and alpha is dropped. both
+//formats are written by hand, so nothing else is needed
+namespace Image
+{
+  bool write_ppm(const std::string& path, const unsigned char* rgba, int width, int height);
+
+  //the PNG is not compressed (deflate "stored" blocks), trading
+  //file size for not depending on zlib
+  bool write_png(const std::string& path, const unsigned char* rgba, int width, int height);
+
+  //picks the format from the extension, PPM if unknown
+  bool write(const std::string& path, const unsigned char* rgba, int width, int height);
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <vector>
+#include <cstdint>
+
+//levels are simplified down to about half the triangles of the
+//previous one, until they would get below this many triangles
+#define LOD_MIN_TRIANGLES 256
+#define LOD_MAX_LEVELS 8
+
+//error, in pixels, the renderers accept from a level of detail
+#define LOD_PIXEL_ERROR 1.0f
+
+namespace LOD
+{
+  //builds coarser versions of the triangles of indices (3 vertex ids each
+  //into pos, 3 floats per vertex) by quadric error edge collapses. each
+  //collapse moves a vertex onto one of its neighbors, so the levels are
+  //just index buffers over the same vertices. levels gets them from finer
+  //to coarser, not counting the full resolution one, and errors how far
+  //(RMS distance to the original surface, in model space) each one goes.
+  //vertices on borders, which include seams between vertices with different
+  //normals or materials, never move, and a vertex only moves onto one with
+  //the same material, so material boundaries stay where they are
+  void build_chain(const float* pos, const uint32_t* material, int n_vertices,
+                   const uint32_t* indices, int n_triangles,
+                   std::vector< std::vector<uint32_t> >& levels,
+                   std::vector<float>& errors);
+
+  //picks the coarsest level whose error, scaled by model (model to world,
+  //column-major) and projected at the distance from the eye to the bounding
+  //sphere (center, radius, in model space), covers at most max_pixels of a
+  //width x height viewport with the given fields of view (degrees)
+  int select(const float* errors, int n_levels, const float* model,
+             const float* center, float radius, const float* eye,
+             float fovx, float fovy, int width, int height, float max_pixels);
+}
+
+#endif
@@ -3,20 +3,34 @@
 
 #include <cmath>
 
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE__))
+#define MATRIX_SSE
+#include <immintrin.h>
+#endif
+
 #define PI 3.14159265f
 
+//Everything is defined here, so that it inlines wherever it is
+//used: the pipeline does these operations per triangle and, in the
+//scanline rasterizer, per pixel. vec4 and mat4 (stored by columns)
+//go through SSE registers, with fused multiply-adds when the target
+//has FMA. without it, results are the same as the plain loops'
+
 class vec2
 {
 private:
   float e[2];
 
 public:
-  vec2();
-  vec2(float x, float y);
+  constexpr vec2() : e{0.0f, 0.0f} {}
+  constexpr vec2(float x, float y) : e{x, y} {}
 
-  float operator()(int i) const;
-  float& operator()(int i);
-  vec2 operator-(const vec2& rhs) const;
+  constexpr float operator()(int i) const { return e[i]; }
+  float& operator()(int i) { return e[i]; }
+  constexpr vec2 operator-(const vec2& rhs) const
+  {
+    return vec2(e[0]-rhs.e[0], e[1]-rhs.e[1]);
+  }
 };
 
 class vec3
@@ -25,58 +39,89 @@ private:
   float e[3];
 
 public:
-  vec3();
-  vec3(float x, float y, float z);
-
-  float operator()(int i) const;
-  float& operator()(int i);
-
-  vec3 operator+(const vec3& rhs) const;
-  vec3 operator-() const;
-  vec3 operator-(const vec3& rhs) const;
-  vec3 operator*(float k) const;
-  vec3 cross(const vec3& rhs) const;
-  float dot(const vec3& rhs) const;
-  vec3 unit() const;
+  constexpr vec3() : e{0.0f, 0.0f, 0.0f} {}
+  constexpr vec3(float x, float y, float z) : e{x, y, z} {}
+
+  constexpr float operator()(int i) const { return e[i]; }
+  float& operator()(int i) { return e[i]; }
+
+  constexpr vec3 operator+(const vec3& rhs) const
+  {
+    return vec3(e[0]+rhs.e[0], e[1]+rhs.e[1], e[2]+rhs.e[2]);
+  }
+  constexpr vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+  constexpr vec3 operator-(const vec3& rhs) const
+  {
+    return vec3(e[0]-rhs.e[0], e[1]-rhs.e[1], e[2]-rhs.e[2]);
+  }
+  constexpr vec3 operator*(float k) const { return vec3(e[0]*k, e[1]*k, e[2]*k); }
+  constexpr vec3 cross(const vec3& rhs) const
+  {
+    return vec3(e[1]*rhs.e[2]-e[2]*rhs.e[1],
+                e[2]*rhs.e[0]-e[0]*rhs.e[2],
+                e[0]*rhs.e[1]-e[1]*rhs.e[0]);
+  }
+  constexpr float dot(const vec3& rhs) const
+  {
+    return e[0]*rhs.e[0]+e[1]*rhs.e[1]+e[2]*rhs.e[2];
+  }
+  vec3 unit() const { return (*this) * (1.0f / sqrtf(dot(*this))); }
 };
 
-class vec4
+class alignas(16) vec4
 {
 private:
   float e[4];
 
 public:
-  vec4();
-  vec4(const vec3& v, float w);
-  vec4(float x, float y, float z, float w);
+  constexpr vec4() : e{0.0f, 0.0f, 0.0f, 0.0f} {}
+  constexpr vec4(const vec3& v, float w) : e{v(0), v(1), v(2), w} {}
+  constexpr vec4(float x, float y, float z, float w) : e{x, y, z, w} {}
 
-  float operator()(int i) const;
-  float& operator()(int i);
+  constexpr float operator()(int i) const { return e[i]; }
+  float& operator()(int i) { return e[i]; }
+  const float* data() const { return e; }
 
   vec4 operator+(const vec4& rhs) const;
   vec4 operator-() const;
   vec4 operator-(const vec4& rhs) const;
+  vec4 operator*(float k) const;
   float dot(const vec4& rhs) const;
-  vec4 cross(const vec4& rhs) const;
+  vec4 cross(const vec4& rhs) const;   //of xyz, w = 0
   vec4 unit() const;
+
+#ifdef MATRIX_SSE
+  explicit vec4(__m128 v) { _mm_storeu_ps(e, v); }
+  __m128 sse() const { return _mm_loadu_ps(e); }
+#endif
 };
 
-class mat4
+class alignas(16) mat4
 {
 private:
   float e[16];
 
-public:
-  mat4();
-  mat4(const vec4& c1, const vec4& c2, const vec4& c3, const vec4& c4);
+  //this * rhs, rhs given by its 4 floats
+  vec4 times(const float* rhs) const;
 
-  float& operator()(int i, int j);
-  float operator()(int i, int j) const;
+public:
+  constexpr mat4() : e{0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+                       0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f} {}
+  constexpr mat4(const vec4& c1, const vec4& c2, const vec4& c3, const vec4& c4)
+    : e{c1(0), c1(1), c1(2), c1(3), c2(0), c2(1), c2(2), c2(3),
+        c3(0), c3(1), c3(2), c3(3), c4(0), c4(1), c4(2), c4(3)} {}
+
+  float& operator()(int i, int j) { return e[i+4*j]; }
+  constexpr float operator()(int i, int j) const { return e[i+4*j]; }
   float* data() { return e; }
 
   //--------- Operators ---------
   mat4 operator*(const mat4& rhs) const;
-  vec4 operator*(const vec4& rhs) const;
+  vec4 operator*(const vec4& rhs) const { return times(rhs.data()); }
+
+  //inverse by Gauss-Jordan elimination. the
+  //matrix is assumed to be invertible
+  mat4 inverse() const;
 
   //--------- Matrix constructors ---------
   static mat4 viewport(int width, int height)
@@ -207,4 +252,135 @@ public:
 
 };
 
+//---------------------------------
+//-------------- vec4 -------------
+//---------------------------------
+#ifdef MATRIX_SSE
+//a*b + c, in one rounding when the target has FMA
+inline __m128 matrix_madd(__m128 a, __m128 b, __m128 c)
+{
+#ifdef __FMA__
+  return _mm_fmadd_ps(a, b, c);
+#else
+  return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+inline vec4 vec4::operator+(const vec4& rhs) const { return vec4(_mm_add_ps(sse(), rhs.sse())); }
+inline vec4 vec4::operator-() const { return vec4(_mm_xor_ps(sse(), _mm_set1_ps(-0.0f))); }
+inline vec4 vec4::operator-(const vec4& rhs) const { return vec4(_mm_sub_ps(sse(), rhs.sse())); }
+inline vec4 vec4::operator*(float k) const { return vec4(_mm_mul_ps(sse(), _mm_set1_ps(k))); }
+
+inline float vec4::dot(const vec4& rhs) const
+{
+  __m128 p = _mm_mul_ps(sse(), rhs.sse());
+  p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+  p = _mm_add_ss(p, _mm_shuffle_ps(p, p, 1));
+  return _mm_cvtss_f32(p);
+}
+
+inline vec4 vec4::cross(const vec4& rhs) const
+{
+  //yzx * zxy - zxy * yzx, which leaves w = 0
+  __m128 a = sse(), b = rhs.sse();
+  __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+  __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+  __m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+  return vec4(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+inline vec4 vec4::unit() const
+{
+  return vec4(_mm_div_ps(sse(), _mm_set1_ps(sqrtf(dot(*this)))));
+}
+#else
+inline vec4 vec4::operator+(const vec4& rhs) const
+{
+  return vec4(e[0]+rhs.e[0], e[1]+rhs.e[1], e[2]+rhs.e[2], e[3]+rhs.e[3]);
+}
+inline vec4 vec4::operator-() const { return vec4(-e[0], -e[1], -e[2], -e[3]); }
+inline vec4 vec4::operator-(const vec4& rhs) const
+{
+  return vec4(e[0]-rhs.e[0], e[1]-rhs.e[1], e[2]-rhs.e[2], e[3]-rhs.e[3]);
+}
+inline vec4 vec4::operator*(float k) const { return vec4(e[0]*k, e[1]*k, e[2]*k, e[3]*k); }
+
+inline float vec4::dot(const vec4& rhs) const
+{
+  return e[0]*rhs.e[0] + e[1]*rhs.e[1] + e[2]*rhs.e[2] + e[3]*rhs.e[3];
+}
+
+inline vec4 vec4::cross(const vec4& rhs) const
+{
+  return vec4(e[1]*rhs.e[2]-e[2]*rhs.e[1],
+              e[2]*rhs.e[0]-e[0]*rhs.e[2],
+              e[0]*rhs.e[1]-e[1]*rhs.e[0], 0.0f);
+}
+
+inline vec4 vec4::unit() const { return (*this) * (1.0f / sqrtf(dot(*this))); }
+#endif
+
+//---------------------------------
+//-------------- mat4 -------------
+//---------------------------------
+inline vec4 mat4::times(const float* rhs) const
+{
+  //linear combination of the columns, accumulated in the
+  //same order as the dot products of the rows would be
+#ifdef MATRIX_SSE
+  __m128 acc = _mm_mul_ps(_mm_loadu_ps(e), _mm_set1_ps(rhs[0]));
+  acc = matrix_madd(_mm_loadu_ps(e+4), _mm_set1_ps(rhs[1]), acc);
+  acc = matrix_madd(_mm_loadu_ps(e+8), _mm_set1_ps(rhs[2]), acc);
+  acc = matrix_madd(_mm_loadu_ps(e+12), _mm_set1_ps(rhs[3]), acc);
+  return vec4(acc);
+#else
+  vec4 out;
+  for(int i = 0; i < 4; ++i)
+    out(i) = e[i]*rhs[0] + e[i+4]*rhs[1] + e[i+8]*rhs[2] + e[i+12]*rhs[3];
+  return out;
+#endif
+}
+
+inline mat4 mat4::operator*(const mat4& rhs) const
+{
+  //column j of the product is this times column j of rhs
+  return mat4(times(rhs.e), times(rhs.e+4), times(rhs.e+8), times(rhs.e+12));
+}
+
+inline mat4 mat4::inverse() const
+{
+  //reduce [A | I] to [I | inv(A)], picking the largest
+  //pivot of each column to keep the error small
+  mat4 a = *this, inv;
+  for(int i = 0; i < 4; ++i) inv(i,i) = 1.0f;
+
+  for(int c = 0; c < 4; ++c)
+  {
+    int pivot = c;
+    for(int r = c+1; r < 4; ++r)
+      if(fabsf(a(r,c)) > fabsf(a(pivot,c))) pivot = r;
+
+    for(int j = 0; j < 4; ++j)
+    {
+      float aux = a(c,j); a(c,j) = a(pivot,j); a(pivot,j) = aux;
+      aux = inv(c,j); inv(c,j) = inv(pivot,j); inv(pivot,j) = aux;
+    }
+
+    float k = 1.0f / a(c,c);
+    for(int j = 0; j < 4; ++j) { a(c,j) *= k; inv(c,j) *= k; }
+
+    for(int r = 0; r < 4; ++r)
+    {
+      if(r == c) continue;
+      float f = a(r,c);
+      for(int j = 0; j < 4; ++j)
+      {
+        a(r,j) -= f * a(c,j);
+        inv(r,j) -= f * inv(c,j);
+      }
+    }
+  }
+  return inv;
+}
+
 #endif
@@ -3,8 +3,12 @@
 
 #include <string>
 #include <vector>
-#include <nanogui/glutil.h>
+#include <cstdint>
+#include <Eigen/Core>
 #include "primitives.h"
+#include "bvh.h"
+#include "lod.h"
+#include "reorder.h"
 
 //the elements of our packed data
 struct Elem
@@ -14,25 +18,140 @@ struct Elem
   float shininess;
 };
 
+//views over attribute data owned by the mesh, which may
+//live either in memory or in a memory-mapped cache file
+typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> IndexMatrix;
+typedef Eigen::Map<Eigen::MatrixXf> MatrixView;
+typedef Eigen::Map<IndexMatrix> IndexView;
+
+//a level of detail of the mesh. level 0 is the mesh itself and the
+//others simplified versions of it over the same vertices (see lod.h),
+//each with its own BVH, whose ranges count from its first triangle
+struct MeshLOD
+{
+  const uint32_t* indices;
+  int n_triangles;
+  const BVHNode* nodes;
+  const NormalCone* cones;
+  int n_nodes;
+
+  //model space error of the simplification
+  float error;
+
+  //where its triangles and nodes start among those of all levels
+  uint32_t first_triangle, first_node;
+};
+
 class Mesh
 {
 private:
 
   std::vector<Material> mats;
 
+  //backing storage of the views below when the mesh
+  //was parsed from a text file. vertex data is packed
+  //as [pos 3n][normal 3n], material indices go apart
+  std::vector<float> vertex_storage;
+  std::vector<uint32_t> material_storage;
+  std::vector<uint32_t> index_storage;
+  std::vector<BVHNode> bvh_storage;
+  std::vector<NormalCone> cone_storage;
+
+  //backing storage when the mesh was loaded from a cache
+  void *mapping;
+  size_t mapping_size;
+
+  //size of each level of detail, as the cache stores them.
+  //reordered tells whether its triangles went through reorder.h
+  struct LevelSize
+  {
+    uint32_t n_triangles, n_nodes;
+    float error;
+    uint32_t reordered;
+  };
+
+  //whether meshes parsed from now on get their triangles and
+  //vertices reordered for the caches, and caches that don't
+  //match are ignored
+  bool reorder;
+
+  //levels of detail, finest first, and the bounding
+  //sphere of the mesh (in model space) to choose them
+  std::vector<MeshLOD> lods;
+  std::vector<float> lod_errors;
+  float center[3], radius;
+
+  //points the public views to a vertex block, a material
+  //block and an index block laid out as described above.
+  //indices, nodes and cones hold those of every level,
+  //one after the other, with sizes as given by levels
+  void bind_views(float* vertices, uint32_t* materials, uint32_t* indices, int n_vertices,
+                  const BVHNode* nodes, const NormalCone* cones,
+                  const LevelSize* levels, int n_levels);
+  void release();
+
+  //merges identical vertices (same position, normal and
+  //material) of the per-corner data read from the file and
+  //builds mIndices so that each triangle refers to them.
+  //triangles are sorted by the BVH built over them, and
+  //reordered within it if asked to. then builds the coarser
+  //levels of detail and their BVHs
+  void index_vertices(const Eigen::MatrixXf& pos, const Eigen::MatrixXf& normal,
+                      const std::vector<uint32_t>& material);
+
 public:
-  Eigen::MatrixXf mPos, mNormal, mAmb, mDiff, mSpec, mShininess;
+  //one column per unique vertex. vertices refer to the
+  //material table by index, instead of carrying a copy
+  MatrixView mPos, mNormal;
+  IndexView mMaterial;
+
+  //one column per triangle, holding the indices
+  //of its three vertices in the matrices above.
+  //they're in the order of the leaves of the BVH.
+  //this is level 0, the other levels follow it
+  IndexView mIndices;
+
   std::vector<Triangle> tris;
 
 
-  Mesh() {}
-  Mesh(const std::string& path)
-  {
-    load_file(path);
-  }
+  Mesh();
+  Mesh(const std::string& path);
+  ~Mesh();
+
+  //views point into the mesh itself, so no copies
+  Mesh(const Mesh&) = delete;
+  Mesh& operator=(const Mesh&) = delete;
 
+  //loads the binary cache next to path if it is up to date,
+  //otherwise parses the text file and writes the cache
   void load_file(const std::string& path);
+
+  //multithreaded parser of the text format. it falls back
+  //to the (much slower) fscanf based one if anything in the
+  //file looks unexpected
+  void load_text(const std::string& path, int n_threads = 0);
+  void load_text_scanf(const std::string& path);
+  bool load_cache(const std::string& path);
+  bool write_cache(const std::string& path) const;
+  static std::string cache_path(const std::string& path);
+
   void transform_to_center(glm::mat4& M);
+
+  //the reordering is on by default. it only changes the order
+  //of triangles and vertices, never what gets drawn
+  void set_reorder(bool on) { reorder = on; }
+
+  const std::vector<Material>& materials() const { return mats; }
+  const std::vector<MeshLOD>& levels() const { return lods; }
+
+  //triangles of all the levels together
+  int total_triangles() const;
+
+  //coarsest level whose error, seen from eye (world space) with
+  //the model placed by model (column-major), covers at most
+  //max_pixels of the viewport. see LOD::select
+  int select_level(const float* model, const float* eye, float fovx, float fovy,
+                   int width, int height, float max_pixels) const;
 };
 
 #endif
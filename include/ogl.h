@@ -9,6 +9,7 @@
 #include <glm/gtx/string_cast.hpp>
 #include "../include/mesh.h"
 #include "../include/param.h"
+#include "../include/profiler.h"
 
 class OGL : public nanogui::GLCanvas
 {
@@ -16,17 +17,32 @@ private:
   nanogui::GLShader shader;
   Mesh model;
 
+  //material table of the model, see phong.vs
+  GLuint material_texture;
+
+  //triangles of the BVH clusters inside the view frustum
+  std::vector<IndexRange> visible;
+
   //rigorously this should be a const
   //reference, but had problems with
   //Eigen::Map and this will be hotfix for it
   GlobalParameters& param;
 
+  //GPU time of the draw call, through timer queries. a query
+  //is read back one frame later, so we never wait for the GPU
+  GLuint queries[2];
+  bool query_pending[2];
+  int query_id;
+  Profiler* profiler;
+
 public:
   OGL(GlobalParameters& param,
       const char* path,
       Widget *parent);
 
-  float framerate;
+  float framerate, gpu_time;
+
+  void set_profiler(Profiler* p) { profiler = p; }
 
   void drawGL() override;
 };
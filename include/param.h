@@ -1,8 +1,15 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+//the headless renderer only needs the GL types and enums,
+//so it must not pull nanogui (and, with it, GLFW and GLEW)
+#ifdef ALMOSTGL_HEADLESS
+#include <GL/gl.h>
+#include <Eigen/Core>
+#else
 #include <nanogui/opengl.h>
 #include <nanogui/glutil.h>
+#endif
 #include <glm/glm.hpp>
 
 struct Camera
@@ -27,6 +34,45 @@ struct GlobalParameters
   GLenum front_face;
   GLenum draw_mode;
   int shading;
+
+  //skip the parts of the model the BVH
+  //tells are outside the view frustum
+  bool frustum_culling;
+
+  //skip the clusters of the BVH (its leaves)
+  //whose triangles all face away from the eye
+  bool cluster_culling;
+
+  //draw a coarser level of detail of the model when
+  //its error would be at most a pixel on the screen
+  bool lod;
+
+  //AlmostGL parameters
+  bool multithreading;
+  int rasterizer;
+  bool hiz;
+  bool streaming;
 };
 
+//field by field, so that renderers can tell what changed
+//between two frames and redo only the work depending on it
+inline bool operator==(const Camera& a, const Camera& b)
+{
+  return a.eye == b.eye && a.look_dir == b.look_dir && a.up == b.up && a.right == b.right &&
+         a.near == b.near && a.far == b.far && a.step == b.step &&
+         a.FoVy == b.FoVy && a.FoVx == b.FoVx && a.lock_view == b.lock_view;
+}
+inline bool operator!=(const Camera& a, const Camera& b) { return !(a == b); }
+
+inline bool operator==(const GlobalParameters& a, const GlobalParameters& b)
+{
+  return a.cam == b.cam && a.light == b.light && a.model_color == b.model_color &&
+         a.model2world == b.model2world && a.front_face == b.front_face &&
+         a.draw_mode == b.draw_mode && a.shading == b.shading &&
+         a.frustum_culling == b.frustum_culling && a.cluster_culling == b.cluster_culling &&
+         a.lod == b.lod && a.multithreading == b.multithreading &&
+         a.rasterizer == b.rasterizer && a.hiz == b.hiz && a.streaming == b.streaming;
+}
+inline bool operator!=(const GlobalParameters& a, const GlobalParameters& b) { return !(a == b); }
+
 #endif
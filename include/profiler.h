@@ -0,0 +1,93 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+//Lightweight instrumentation shared by both pipelines. Timed
+//intervals and counter values go into a fixed size ring buffer
+//(the oldest ones are overwritten), from which we build the live
+//breakdown shown in the GUI and Chrome trace files
+//(chrome://tracing or ui.perfetto.dev).
+//
+//Recording is thread safe and lock free. Reading (summary, export)
+//must not overlap with recording, which in practice means calling
+//it between frames. Names are stored as pointers, so they must be
+//string literals or otherwise outlive the profiler.
+class Profiler
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  //track of the intervals measured on the GPU, which
+  //don't belong to any of our threads
+  static const int GPU_TRACK = 1000;
+
+  struct Event
+  {
+    const char* name;
+    bool is_counter;
+    int track;
+    uint32_t frame;
+    double start_us;    //since the profiler was created
+    double value;       //duration in us, or the counter value
+  };
+
+  //name and per frame average over some frames, for display
+  struct Entry
+  {
+    std::string name;
+    bool is_counter;
+    double value;       //ms for intervals
+  };
+
+  Profiler(int capacity = 1 << 16);
+
+  void begin_frame() { ++frame; }
+  uint32_t current_frame() const { return frame; }
+
+  void record(const char* name, clock::time_point start, clock::time_point end,
+              int track = -1);
+  void counter(const char* name, double value);
+
+  //averages over the last n_frames frames, in order of first appearance
+  std::vector<Entry> summary(int n_frames) const;
+  bool export_chrome_trace(const std::string& path) const;
+
+private:
+  std::vector<Event> ring;
+  std::atomic<uint64_t> next;
+  std::atomic<uint32_t> frame;
+  clock::time_point origin;
+
+  Event& slot() { return ring[next++ % ring.size()]; }
+  static int thread_track();
+};
+
+//records the time between its construction and destruction.
+//does nothing if the profiler is null, so instrumented code
+//doesn't need to care whether someone is listening
+class ScopedTimer
+{
+public:
+  ScopedTimer(Profiler* profiler, const char* name)
+    : profiler(profiler), name(name)
+  {
+    if(profiler) start = Profiler::clock::now();
+  }
+
+  ~ScopedTimer()
+  {
+    if(profiler) profiler->record(name, start, Profiler::clock::now());
+  }
+
+private:
+  Profiler* profiler;
+  const char* name;
+  Profiler::clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef RENDERTHREAD_H
+#define RENDERTHREAD_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include "almostgl.h"
+#include "profiler.h"
+
+//a color buffer AlmostGL finished, with what it took to render it
+struct RenderedFrame
+{
+  //the pixels. they live in the memory handed over with
+  //RenderThread::set_frame_memory (slot tells which of the three)
+  //or, when there is none or it is too small, in storage (slot -1)
+  const GLubyte* color;
+  int slot;
+  std::vector<GLubyte> storage;
+  int width, height;
+
+  //frames are numbered from 1 as they come out
+  uint64_t number;
+
+  //wall clock time of the render, and the profiler breakdown
+  //(averaged over the last frames) as it was right after it
+  double ms;
+  std::vector<Profiler::Entry> breakdown;
+};
+
+//Runs AlmostGL on a thread of its own, so that a slow frame never
+//holds back the thread handling the window. The GUI hands it copies
+//of the parameters, of which only the latest is ever rendered, and
+//takes the latest finished frame whenever it draws. Frames are triple
+//buffered: the render thread writes one, the GUI reads another and
+//the third holds the newest finished frame nobody took yet, so
+//neither side ever waits for the other.
+class RenderThread
+{
+private:
+  AlmostGL almostgl;
+
+  //AlmostGL records here. profilers can't be read while
+  //someone records in them, so only this thread reads it
+  Profiler profiler;
+  int profile_frames;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable wake;
+
+  //latest parameters and size handed over, if not rendered yet
+  GlobalParameters pending;
+  int pending_width, pending_height;
+  bool has_pending, quit;
+
+  //last parameters and size handed over, pending or not. asking
+  //for the same frame again is a no-op, until the frames are lost
+  GlobalParameters submitted;
+  int submitted_width, submitted_height;
+  bool has_submitted;
+
+  //the three frames, and whether ready holds one the GUI didn't take
+  RenderedFrame frames[3];
+  int back, ready, front;
+  bool fresh;
+  uint64_t n_frames;
+
+  //memory frames are rendered into, if someone handed it over, and
+  //whether the thread is rendering (into it or not) at the moment
+  GLubyte* memory[3];
+  size_t memory_size;
+  bool rendering;
+  std::condition_variable idle;
+
+  //trace to be written between two frames, if any
+  std::string trace_path;
+
+  std::function<void()> on_frame;
+
+  void run();
+
+public:
+  //profile_frames is how many frames the breakdown averages
+  RenderThread(const Mesh& mesh, int width, int height,
+               int profile_frames = 30, int n_threads = 0);
+  ~RenderThread();
+
+  RenderThread(const RenderThread&) = delete;
+  RenderThread& operator=(const RenderThread&) = delete;
+
+  //asks for a frame with these parameters at this size. if the
+  //thread is busy, it renders the latest ones it got when done.
+  //nothing happens if they are the ones of the last frame asked
+  //for, so the GUI may submit at every redraw and the thread
+  //still sleeps while nothing changes
+  void submit(const GlobalParameters& param, int width, int height);
+
+  //latest finished frame (null until the first one is done). it
+  //stays valid and untouched until the next call
+  const RenderedFrame* latest();
+
+  //makes AlmostGL render the frames straight into memory[i], as
+  //long as they fit in memory_size bytes, instead of buffers of
+  //their own (null memory goes back to those). meant for memory the
+  //GPU reads from, like mapped pixel buffers. it waits for the frame
+  //being rendered, if any, and drops all finished ones, so the old
+  //memory can be freed as soon as it returns
+  void set_frame_memory(GLubyte* const memory[3], size_t memory_size);
+
+  //called by the render thread every time it finishes a frame,
+  //for the GUI to wake up and draw it
+  void set_frame_callback(const std::function<void()>& f);
+
+  //writes the trace of the last frames, as soon as the current
+  //one (if any) is done
+  void export_trace(const std::string& path);
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <vector>
+#include <cstdint>
+#include "bvh.h"
+
+//size of the post-transform vertex cache the
+//triangle order is optimized for (LRU, in vertices)
+#define REORDER_CACHE_SIZE 32
+
+//Load time reordering of the triangles and vertices of a mesh,
+//for the caches of the GPU and the early depth tests of both
+//renderers. Triangles must stay sorted by the BVH built over them
+//(see bvh.h), so orders are only changed within what it allows:
+//subtrees may be swapped, and triangles move within their leaf.
+namespace Reorder
+{
+  //swaps the children of the interior nodes of the hierarchy (and
+  //the triangles of their subtrees) so that, going down from the root,
+  //the subtree whose triangles face more away from the center of the
+  //node is drawn first. those tend to occlude the others from most
+  //points of view, so more of the later fragments fail the depth test
+  //(Sander et al., Fast Triangle Reordering for Vertex Locality and
+  //Reduced Overdraw)
+  void overdraw(const float* pos, uint32_t* indices, int n_triangles,
+                std::vector<BVHNode>& nodes, std::vector<NormalCone>& cones);
+
+  //reorders the triangles inside each leaf, greedily taking the one
+  //whose vertices are most likely to be in the vertex cache (Forsyth,
+  //Linear-Speed Vertex Cache Optimisation). the simulated cache goes
+  //on from one leaf to the next, as the GPU's would
+  void vertex_cache(uint32_t* indices, int n_triangles, int n_vertices,
+                    const BVHNode* nodes, int n_nodes);
+
+  //numbers vertices in the order the triangles first use them, so
+  //that vertex fetches walk memory forward. remap gets the new id of
+  //each old one; n_triangles is how many of the triangles in indices
+  //decide the order, and all n_indices are renumbered
+  void vertex_fetch(uint32_t* indices, int n_indices, int n_triangles, int n_vertices,
+                    std::vector<uint32_t>& remap);
+
+  //average cache miss ratio: vertices transformed per triangle with a
+  //FIFO post-transform cache of cache_size vertices. 3 is the worst,
+  //and around 0.5 the best a closed triangle mesh can do
+  float acmr(const uint32_t* indices, int n_triangles, int n_vertices, int cache_size);
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+#include <chrono>
+
+//render sizes change in steps of this fraction of the window,
+//as every change of size reallocates the buffers of AlmostGL
+#define RESOLUTION_STEP 0.0625f
+
+//how long after the camera last moved it is considered at rest
+#define RESOLUTION_REST_MS 300
+
+//Picks the resolution AlmostGL renders at, which the blit to the
+//window then scales up. While the camera moves, both sides of the
+//frame are scaled to bring the render time to a target: most of it
+//goes to the raster stages, whose cost grows with the number of
+//pixels, so the side is scaled with the square root of target/time.
+//At rest, frames are rendered at the size of the window.
+class ResolutionScale
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+private:
+  bool enabled;
+  double target_ms;
+  float min_scale;
+
+  //scale the last frames point at, and the one
+  //frames are rendered at (a multiple of the step)
+  float estimate, current;
+
+  clock::time_point last_motion;
+
+public:
+  ResolutionScale(double target_ms = 33.3, float min_scale = 0.25f);
+
+  void set_enabled(bool on) { enabled = on; }
+  void set_target(double ms) { target_ms = ms; }
+  double target() const { return target_ms; }
+
+  //a frame width pixels wide, for a window window_width
+  //pixels wide, took ms to render
+  void frame_done(int width, int window_width, double ms);
+
+  //the camera moved, so frames are rendered at the lower
+  //resolution until it rests for a while
+  void motion();
+  bool moving() const;
+
+  //size to render at for a window of this size
+  void render_size(int window_width, int window_height, int& width, int& height) const;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+//a fixed set of worker threads that sleep until some
+//parallel_for() hands them a batch of jobs. the calling
+//thread also takes jobs, so a pool of size 1 has no
+//workers at all and runs everything serially.
+class ThreadPool
+{
+private:
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable wake, done;
+
+  //current batch of jobs. generation is bumped every time
+  //a new batch is dispatched, so sleeping workers know
+  //whether they were woken up for something new
+  const std::function<void(int)> *job;
+  int n_jobs, pending, generation;
+  std::atomic<int> next_job;
+  bool quit;
+
+  void run_jobs();
+  void worker_loop();
+
+public:
+  //n_threads = 0 means one thread per hardware core
+  ThreadPool(int n_threads = 0);
+  ~ThreadPool();
+
+  int size() const { return (int)workers.size() + 1; }
+
+  //calls fn(i) for every i in [0, n). jobs are handed out
+  //dynamically, so there is no guarantee about which thread
+  //runs each i, only that all of them finished on return.
+  void parallel_for(int n, const std::function<void(int)>& fn);
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef VERTEXSTAGE_H
+#define VERTEXSTAGE_H
+
+#include <vector>
+#include <string>
+
+//structure-of-arrays copy of the mesh attributes read
+//by the vertex stage, so that 4 or 8 consecutive vertices
+//can be loaded straight into SIMD registers
+struct VertexStreams
+{
+  std::vector<float> px, py, pz;
+  std::vector<float> nx, ny, nz;
+
+  //material index of each vertex, as a float so that it
+  //can be loaded and stored like the other attributes
+  std::vector<float> material;
+
+  int size() const { return (int)px.size(); }
+};
+
+//everything the vertex stage needs besides the vertices.
+//matrices are stored column-major, like mat4
+struct VertexUniforms
+{
+  float model[16], vp[16];
+  float eye[3], light[4];
+  float model_color[3];
+  int shading;
+};
+
+namespace VertexStage
+{
+  enum Kernel { SCALAR = 0, SSE = 1, AVX2 = 2 };
+
+  //best kernel supported by the CPU we're running on
+  Kernel detect();
+  std::string name(Kernel k);
+
+  //transforms and lights vertices [first, last) and writes
+  //them to out with vertex_sz floats per vertex in the layout
+  //expected by the rest of the pipeline: XYZW RGB M, where
+  //M is the material index. per-pixel shading (shading = 2)
+  //isn't lit here, and writes the normal in place of RGB
+  void process(Kernel k,
+                const VertexStreams& in,
+                const VertexUniforms& u,
+                int first, int last,
+                float* out, int vertex_sz);
+}
+
+#endif
@@ -6,10 +6,16 @@ in vec2 uv_frag;
 // fragment final color
 out vec4 color;
 
-// the actual color buffer
+// the actual color buffer, and the size of the frame
+// in it (it may be smaller than both it and the window)
 uniform sampler2D frame;
+uniform vec2 frame_size;
 
 void main()
 {
-  color = texture(frame, uv_frag);
+  // scale the frame up to the window. texels outside
+  // of it are never sampled, so nothing bleeds in at
+  // the edges. at full size, this hits texel centers
+  vec2 texel = clamp(uv_frag * frame_size, vec2(0.5f), frame_size - vec2(0.5f));
+  color = texture(frame, texel / vec2(textureSize(frame, 0)));
 }
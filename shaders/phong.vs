@@ -2,8 +2,7 @@
 
 // from host
 in vec3 pos, normal;
-in vec3 amb, diff, spec;
-in float shininess;
+in float material;
 
 // to fragment shader: linear interpolated (lerp) data
 out vec3 lerp_amb, lerp_diff, lerp_spec;
@@ -17,9 +16,14 @@ uniform mat4 model, view, proj;
 uniform vec3 eye, light;
 uniform vec3 model_color;
 
+// material table, one column per material. rows hold
+// ambient color + shininess, diffuse and specular colors
+uniform sampler2D materials;
+
 void main()
 {
   mat4 mvp = proj * view * model;
+  float shininess = texelFetch(materials, ivec2(int(material), 0), 0).a;
   gl_Position = mvp * vec4(pos, 1.0);
 
   //Blinn-Phong illumination model with Gouraud shading
@@ -0,0 +1,1567 @@
+#include "../include/almostgl.h"
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+//number of vertices each job of the vertex
+//processing stage takes care of
+#define VERTEX_BATCH 4096
+
+//number of triangles each job of the streaming pipeline takes from
+//the index buffer. clipped, they take about 24KB (up to 10x that in
+//the worst case), so the whole batch stays in L2 while it's worked on
+#define STREAM_BATCH 256
+
+#define ROUND(x) ((int)(x + 0.5f))
+
+//slack of the hierarchical z tests, which compare depth bounds
+//computed differently (and so rounded differently) than the
+//depths of the fragments
+#define HIZ_EPS 1e-5f
+
+AlmostGL::AlmostGL(const Mesh& mesh, int width, int height, int n_threads)
+  : mesh(mesh), pool(n_threads), profiler(nullptr), color(nullptr), color_storage(nullptr),
+    depth(nullptr), gnormal(nullptr), gmaterial(nullptr), hiz(nullptr), hiz_dirty(nullptr),
+    vertices_valid(false), raster_kernel(nullptr)
+{
+  //we need 8 floats per vertex (4 -> XYZW, 3 -> RGB, 1 -> 1.0)
+  //Normals won't be forwarded out of vertex processing
+  //stage, so we don't need to store them in the vertex
+  //buffer.
+  //The last attribute holds the material index until the
+  //perspective division, which moves it to the place of w
+  //(always 1 after dividing) and stores there the 1/w value
+  //we need to compute a perspectively correct interpolation
+  //of the fragments
+  vertex_sz = 4 + 4;
+  n_vertices = mesh.mPos.cols();
+  lod = 0;
+  indices = mesh.mIndices.data();
+  n_triangles = mesh.mIndices.cols();
+
+  //vertex stage input, transposed so that each
+  //attribute component is contiguous in memory
+  streams.px.resize(n_vertices); streams.py.resize(n_vertices); streams.pz.resize(n_vertices);
+  streams.nx.resize(n_vertices); streams.ny.resize(n_vertices); streams.nz.resize(n_vertices);
+  for(int v_id = 0; v_id < n_vertices; ++v_id)
+  {
+    streams.px[v_id] = mesh.mPos(0, v_id);
+    streams.py[v_id] = mesh.mPos(1, v_id);
+    streams.pz[v_id] = mesh.mPos(2, v_id);
+    streams.nx[v_id] = mesh.mNormal(0, v_id);
+    streams.ny[v_id] = mesh.mNormal(1, v_id);
+    streams.nz[v_id] = mesh.mNormal(2, v_id);
+  }
+  kernel = VertexStage::detect();
+
+  //shininess is the only material property the shading models use
+  //(colors come from model_color, as in the OpenGL canvas). vertices
+  //carry the index of their material in the mesh table, which travels
+  //down the pipeline and ends up in the G-buffer
+  const std::vector<Material>& mats = mesh.materials();
+  for(size_t i = 0; i < mats.size(); ++i) shininess.push_back(mats[i].shininess);
+  if(shininess.empty()) shininess.push_back(1.0f);
+
+  streams.material.resize(n_vertices);
+  for(int v_id = 0; v_id < n_vertices; ++v_id)
+    streams.material[v_id] = (float)mesh.mMaterial(0, v_id);
+  clipped_last = projected_last = culled_last = 0;
+
+  //vertices used by each node of the BVH of each level. leaves go
+  //through their triangles and interior nodes merge the ranges of their
+  //children, which come after them. the mesh numbers vertices in the
+  //order the sorted triangles use them, so these ranges are fairly
+  //tight (less so for the coarser levels, which use them sparsely)
+  const std::vector<MeshLOD>& levels = mesh.levels();
+  if(!levels.empty()) node_vertices.resize(levels.back().first_node + levels.back().n_nodes);
+  for(size_t l = 0; l < levels.size(); ++l)
+  {
+    const BVHNode* nodes = levels[l].nodes;
+    int n_nodes = levels[l].n_nodes;
+    IndexRange* ranges = &node_vertices[levels[l].first_node];
+    for(int i = n_nodes-1; i >= 0; --i)
+    {
+      uint32_t lo = UINT32_MAX, hi = 0;
+      if(nodes[i].skip == (uint32_t)i+1)
+      {
+        uint32_t end = (int)nodes[i].skip < n_nodes ? nodes[nodes[i].skip].first : levels[l].n_triangles;
+        for(uint32_t k = 3*nodes[i].first; k < 3*end; ++k)
+        {
+          lo = std::min(lo, levels[l].indices[k]);
+          hi = std::max(hi, levels[l].indices[k] + 1);
+        }
+      }
+      else
+      {
+        const IndexRange &a = ranges[i+1], &b = ranges[nodes[i+1].skip];
+        lo = std::min(a.first, b.first);
+        hi = std::max(a.first + a.count, b.first + b.count);
+      }
+      ranges[i].first = lo;
+      ranges[i].count = hi - lo;
+    }
+  }
+
+  //preallocate the buffer where we'll store the transformed vertices.
+  //vbuffer holds each unique vertex once and works as a post-transform
+  //cache: triangles are assembled from it through the index buffer, so
+  //shared vertices are transformed and lit a single time
+  vbuffer = new float[n_vertices*vertex_sz];
+  //the clipped, projected and culled buffers hold whole frames and
+  //are only needed by the buffered pipeline, so they're allocated the
+  //first time it runs. clipping may split a triangle in several
+  //others, in which case these three grow (see grow_clip_buffers)
+  clipped = projected = culled = nullptr;
+  clip_capacity = 0;
+  clip_poly.resize(2*MAX_CLIP_VERTICES*vertex_sz);
+
+  resize(width, height);
+}
+
+AlmostGL::~AlmostGL()
+{
+  delete[] vbuffer; delete[] clipped;
+  delete[] projected; delete[] culled;
+  delete[] color_storage; delete[] depth;
+  delete[] gnormal; delete[] gmaterial;
+  delete[] hiz; delete[] hiz_dirty;
+}
+
+void AlmostGL::resize(int width, int height)
+{
+  //the level of detail depends on the size of the screen
+  buffer_height = height; buffer_width = width;
+  vertices_valid = false;
+  int n_pixels = buffer_width * buffer_height;
+
+  //TODO: this is EXTREMELY slow! the best workaround would be
+  //to use std::vector which is able to do some smart resizing,
+  //so it doesn't need to copy data around in the case where
+  //we can just extend or shrink memory
+  delete[] color_storage;
+  color = color_storage = new GLubyte[4*n_pixels];
+  for(int i = 0; i < n_pixels*4; i += 4) color[i] = 0;
+  for(int i = 1; i < n_pixels*4; i += 4) color[i] = 0;
+  for(int i = 2; i < n_pixels*4; i += 4) color[i] = 30;
+  for(int i = 3; i < n_pixels*4; i += 4) color[i] = 255;
+
+  delete[] depth;
+  depth = new float[n_pixels];
+
+  delete[] gnormal; delete[] gmaterial;
+  gnormal = new uint32_t[n_pixels];
+  gmaterial = new uint16_t[n_pixels];
+
+  n_tiles = (buffer_height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  bins.resize(n_tiles);
+  tile_counts.resize(n_tiles);
+
+  hiz_width = (buffer_width + HIZ_TILE - 1) / HIZ_TILE;
+  hiz_height = (buffer_height + HIZ_TILE - 1) / HIZ_TILE;
+  delete[] hiz; delete[] hiz_dirty;
+  hiz = new float[hiz_width*hiz_height];
+  hiz_dirty = new unsigned char[hiz_width*hiz_height];
+}
+
+void AlmostGL::set_color_target(GLubyte* target)
+{
+  color = target ? target : color_storage;
+}
+
+void AlmostGL::render(const GlobalParameters& param)
+{
+  //convert params to use internal library
+  //TODO: we could precompute most of these calls
+  vec3 eye = vec3(param.cam.eye[0], param.cam.eye[1], param.cam.eye[2]);
+  vec3 up = vec3(param.cam.up[0], param.cam.up[1], param.cam.up[2]);
+  vec3 look_dir = vec3(param.cam.look_dir[0],
+                        param.cam.look_dir[1],
+                        param.cam.look_dir[2]);
+  vec3 model_color = vec3(param.model_color(0),
+                          param.model_color(1),
+                          param.model_color(2));
+  vec4 light = vec4(param.light(0),
+                    param.light(1),
+                    param.light(2),
+                    1.0f);
+
+  mat4 model2world;
+  for(int i = 0; i < 4; ++i)
+    for(int j = 0; j < 4; ++j)
+      model2world(i,j) = param.model2world[j][i];
+
+  //-------------------------------------------------------
+  //------------------ GRAPHICAL PIPELINE -----------------
+  //-------------------------------------------------------
+  //important matrices.
+  //proj and viewport could be precomputed!
+  mat4 view = mat4::view(eye, eye+look_dir, up);
+  mat4 proj = mat4::perspective(param.cam.FoVy, param.cam.FoVx,
+                                param.cam.near, param.cam.far);
+  mat4 viewport = mat4::viewport(buffer_width, buffer_height);
+  mat4 vp = proj * view;
+
+  //the rasterizer loops are specialized for the state of the frame
+  pick_kernels(param);
+
+  //time each stage with a wall clock: the stages run on all
+  //threads, so CPU time would add up the time of all of them
+  typedef std::chrono::steady_clock clock;
+  auto ms = [](clock::time_point a, clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+  };
+
+  //choosing the level and walking its BVH are timed as part of
+  //the vertex stage, as they decide which vertices it goes through
+  clock::time_point t0 = clock::now();
+  if(!vertices_valid || !same_vertices(param))
+  {
+    select_level(param, model2world, eye);
+    bvh_culling(param, model2world, vp * model2world, eye);
+    vertex_processing(param, model2world, vp, eye, light, model_color);
+    vertex_param = param;
+    vertices_valid = true;
+  }
+  clock::time_point t1 = clock::now();
+
+  if(param.streaming)
+  {
+    //clipping, division and culling are fused and timed together as
+    //clipping. the stages record themselves, once per group of batches
+    if(profiler) profiler->record("vertex", t0, t1);
+    streaming(param, viewport, times.clipping, times.rasterization);
+    times.vertex = ms(t0, t1);
+    times.projection = times.culling = 0.0;
+  }
+  else
+  {
+    clipping();
+    clock::time_point t2 = clock::now();
+    perspective_division();
+    clock::time_point t3 = clock::now();
+    culling(param);
+    clock::time_point t4 = clock::now();
+    rasterization(param, viewport);
+    clock::time_point t5 = clock::now();
+
+    times.vertex = ms(t0, t1);
+    times.clipping = ms(t1, t2);
+    times.projection = ms(t2, t3);
+    times.culling = ms(t3, t4);
+    times.rasterization = ms(t4, t5);
+
+    if(profiler)
+    {
+      profiler->record("vertex", t0, t1);
+      profiler->record("clipping", t1, t2);
+      profiler->record("projection", t2, t3);
+      profiler->record("culling", t3, t4);
+      profiler->record("rasterization", t4, t5);
+    }
+  }
+
+  //per-pixel lighting runs once the G-buffer holds the nearest
+  //fragment of every pixel, so each pixel is shaded only once
+  times.shading = 0.0;
+  if(param.shading == 2)
+  {
+    clock::time_point t6 = clock::now();
+    shading(param, vp, eye, light, model_color);
+    clock::time_point t7 = clock::now();
+
+    times.shading = ms(t6, t7);
+    if(profiler) profiler->record("shading", t6, t7);
+  }
+
+  counters.vertices = 0;
+  for(size_t r = 0; r < visible_vertices.size(); ++r) counters.vertices += visible_vertices[r].count;
+  counters.triangles_visible = n_visible;
+  counters.lod = lod;
+  counters.fragments_tested = counters.fragments_written = 0;
+  for(int t = 0; t < n_tiles; ++t)
+  {
+    counters.fragments_tested += tile_counts[t].tested;
+    counters.fragments_written += tile_counts[t].written;
+  }
+
+  counters.pixels_covered = 0;
+  if(profiler)
+  {
+    for(int i = 0; i < buffer_width*buffer_height; ++i)
+      counters.pixels_covered += depth[i] < 2.0f;
+
+    profiler->counter("lod", counters.lod);
+    profiler->counter("vertices", counters.vertices);
+    profiler->counter("triangles in frustum", counters.triangles_visible);
+    profiler->counter("triangles clipped", counters.triangles_clipped);
+    profiler->counter("triangles culled", counters.triangles_culled);
+    profiler->counter("fragments tested", counters.fragments_tested);
+    profiler->counter("fragments written", counters.fragments_written);
+    profiler->counter("overdraw", counters.overdraw());
+  }
+}
+
+bool AlmostGL::same_vertices(const GlobalParameters& param) const
+{
+  //the front face decides which clusters face away. the draw
+  //mode, the rasterizer and the pipeline only matter later on
+  const GlobalParameters& p = vertex_param;
+  return param.cam == p.cam && param.light == p.light &&
+         param.model_color == p.model_color && param.model2world == p.model2world &&
+         param.shading == p.shading && param.lod == p.lod &&
+         param.frustum_culling == p.frustum_culling &&
+         param.cluster_culling == p.cluster_culling &&
+         (param.front_face == p.front_face || !param.cluster_culling);
+}
+
+void AlmostGL::select_level(const GlobalParameters& param, const mat4& model2world, const vec3& eye)
+{
+  lod = 0;
+  if(param.lod)
+  {
+    float model[16], world_eye[3] = { eye(0), eye(1), eye(2) };
+    for(int i = 0; i < 4; ++i)
+      for(int j = 0; j < 4; ++j)
+        model[i+4*j] = model2world(i,j);
+    lod = mesh.select_level(model, world_eye, param.cam.FoVx, param.cam.FoVy,
+                            buffer_width, buffer_height, LOD_PIXEL_ERROR);
+  }
+
+  if(mesh.levels().empty()) return;
+  const MeshLOD& level = mesh.levels()[lod];
+  indices = level.indices;
+  n_triangles = level.n_triangles;
+}
+
+void AlmostGL::bvh_culling(const GlobalParameters& param, const mat4& model2world,
+                           const mat4& mvp, const vec3& eye)
+{
+  //coarser levels use only some of the vertices,
+  //which the root of their BVH knows about
+  const MeshLOD* level = mesh.levels().empty() ? nullptr : &mesh.levels()[lod];
+  visible_vertices.clear();
+  if((!param.frustum_culling && !param.cluster_culling) || !level || level->n_nodes == 0)
+  {
+    IndexRange triangles = { 0, (uint32_t)n_triangles }, vertices = { 0, (uint32_t)n_vertices };
+    if(level && level->n_nodes > 0) vertices = node_vertices[level->first_node];
+    visible.assign(1, triangles);
+    visible_vertices.assign(1, vertices);
+  }
+  else
+  {
+    float m[16], model[16], world_eye[3] = { eye(0), eye(1), eye(2) };
+    for(int i = 0; i < 4; ++i)
+      for(int j = 0; j < 4; ++j)
+      {
+        m[i+4*j] = mvp(i,j);
+        model[i+4*j] = model2world(i,j);
+      }
+
+    //clusters facing away are rejected here, way before the cull
+    //stage would have found each of their triangles to be backfacing
+    float model_eye[3], front;
+    BVH::to_model_space(model, world_eye, param.front_face == GL_CCW, model_eye, front);
+    BVH::cull(level->nodes, param.cluster_culling ? level->cones : nullptr,
+              level->n_nodes, n_triangles, param.frustum_culling ? m : nullptr,
+              model_eye, front, visible, &visible_nodes);
+
+    //vertex ranges of the nodes taken overlap where nodes share
+    //vertices, so they're sorted and merged
+    for(size_t i = 0; i < visible_nodes.size(); ++i)
+      visible_vertices.push_back(node_vertices[level->first_node + visible_nodes[i]]);
+    std::sort(visible_vertices.begin(), visible_vertices.end(),
+              [](const IndexRange& a, const IndexRange& b) { return a.first < b.first; });
+
+    size_t n = 0;
+    for(size_t i = 1; i < visible_vertices.size(); ++i)
+    {
+      IndexRange& last = visible_vertices[n];
+      const IndexRange& cur = visible_vertices[i];
+      if(cur.first <= last.first + last.count)
+        last.count = std::max(last.first + last.count, cur.first + cur.count) - last.first;
+      else visible_vertices[++n] = cur;
+    }
+    if(!visible_vertices.empty()) visible_vertices.resize(n+1);
+  }
+
+  visible_start.resize(visible.size());
+  n_visible = 0;
+  for(size_t r = 0; r < visible.size(); ++r)
+  {
+    visible_start[r] = n_visible;
+    n_visible += visible[r].count;
+  }
+}
+
+void AlmostGL::vertex_processing(const GlobalParameters& param, const mat4& model2world,
+                                  const mat4& vp, const vec3& eye, const vec4& light,
+                                  const vec3& model_color)
+{
+  //transform vertices using model view proj and compute
+  //their color using phong lighting model. notice that
+  //this is akin to what we do in vertex shader.
+  VertexUniforms u;
+  for(int i = 0; i < 4; ++i)
+    for(int j = 0; j < 4; ++j)
+    {
+      u.model[i+4*j] = model2world(i,j);
+      u.vp[i+4*j] = vp(i,j);
+    }
+  for(int i = 0; i < 3; ++i)
+  {
+    u.eye[i] = eye(i);
+    u.model_color[i] = model_color(i);
+  }
+  for(int i = 0; i < 4; ++i) u.light[i] = light(i);
+  u.shading = param.shading;
+
+  //vertices are independent from each other, so
+  //this stage splits trivially among threads. only
+  //the ones visible triangles may use are processed
+  if(param.multithreading)
+  {
+    vertex_jobs.clear();
+    for(size_t r = 0; r < visible_vertices.size(); ++r)
+    {
+      uint32_t end = visible_vertices[r].first + visible_vertices[r].count;
+      for(uint32_t v_id = visible_vertices[r].first; v_id < end; v_id += VERTEX_BATCH)
+      {
+        IndexRange job = { v_id, std::min<uint32_t>(VERTEX_BATCH, end - v_id) };
+        vertex_jobs.push_back(job);
+      }
+    }
+
+    pool.parallel_for(vertex_jobs.size(), [&](int b) {
+      ScopedTimer timer(profiler, "vertex batch");
+      VertexStage::process(kernel, streams, u, vertex_jobs[b].first,
+                            vertex_jobs[b].first + vertex_jobs[b].count,
+                            vbuffer, vertex_sz);
+    });
+  }
+  else
+  {
+    for(size_t r = 0; r < visible_vertices.size(); ++r)
+      VertexStage::process(kernel, streams, u, visible_vertices[r].first,
+                            visible_vertices[r].first + visible_vertices[r].count,
+                            vbuffer, vertex_sz);
+  }
+}
+
+void AlmostGL::grow_clip_buffers(int n_floats)
+{
+  //clipped keeps what was already written, the other two
+  //are only filled after clipping so they can just be replaced
+  int capacity = std::max(n_floats, 2*clip_capacity);
+  float* aux = new float[capacity];
+  if(clipped) memcpy(aux, clipped, clipped_last*sizeof(float));
+  delete[] clipped; clipped = aux;
+
+  delete[] projected; projected = new float[capacity];
+  delete[] culled; culled = new float[capacity];
+  clip_capacity = capacity;
+}
+
+namespace
+{
+  //one bit per clip plane. CLIP_W keeps w away from zero, which the
+  //other planes don't (a vertex with x = y = z = w = 0 is "inside")
+  enum { CLIP_LEFT = 1, CLIP_RIGHT = 2, CLIP_BOTTOM = 4,
+         CLIP_TOP = 8, CLIP_NEAR = 16, CLIP_FAR = 32, CLIP_W = 64 };
+  const float CLIP_W_EPS = 1e-5f;
+
+  //the clipper marks, in the material slot of the vertices it
+  //outputs, the vertices and edges the original triangle didn't
+  //have, so that GL_LINE and GL_POINT draw neither. the edge flag
+  //of a vertex is for the edge to the next one in the triangle.
+  //materials are below 2^16 and floats hold integers up to 2^24
+  //exactly, so the flags go above them. unclipped triangles are
+  //copied as they are, with no flags
+  enum { CLIP_MATERIAL = 0xFFFF, CLIP_NEW_VERTEX = 1 << 16, CLIP_NEW_EDGE = 1 << 17 };
+
+  inline uint16_t slot_material(float slot) { return (uint16_t)((int)(slot + 0.5f) & CLIP_MATERIAL); }
+  inline int slot_flags(float slot) { return (int)(slot + 0.5f) & ~CLIP_MATERIAL; }
+  inline float with_flags(float slot, int flags) { return (float)(slot_material(slot) | flags); }
+
+  int outcode(const float* v)
+  {
+    float x = v[0], y = v[1], z = v[2], w = v[3];
+    return (x < -w ? CLIP_LEFT : 0) | (x > w ? CLIP_RIGHT : 0) |
+            (y < -w ? CLIP_BOTTOM : 0) | (y > w ? CLIP_TOP : 0) |
+            (z < -w ? CLIP_NEAR : 0) | (z > w ? CLIP_FAR : 0) |
+            (w < CLIP_W_EPS ? CLIP_W : 0);
+  }
+
+  //signed distance to the plane, positive inside
+  float plane_distance(const float* v, int plane)
+  {
+    switch(plane)
+    {
+      case CLIP_LEFT: return v[3] + v[0];
+      case CLIP_RIGHT: return v[3] - v[0];
+      case CLIP_BOTTOM: return v[3] + v[1];
+      case CLIP_TOP: return v[3] - v[1];
+      case CLIP_NEAR: return v[3] + v[2];
+      case CLIP_FAR: return v[3] - v[2];
+      default: return v[3] - CLIP_W_EPS;
+    }
+  }
+
+  //Sutherland-Hodgman step: clips polygon in (n vertices) against
+  //a single plane, writing the result to out and returning its size.
+  //every attribute is interpolated linearly, as we're still in clip
+  //space, but the material slot, which takes the material of the
+  //vertex inside along with the flags of the new vertex
+  int clip_polygon(const float* in, int n, float* out, int plane, int vertex_sz)
+  {
+    const int M = vertex_sz-1;
+    int n_out = 0;
+    for(int i = 0; i < n; ++i)
+    {
+      const float* a = &in[i*vertex_sz];
+      const float* b = &in[((i+1)%n)*vertex_sz];
+      float da = plane_distance(a, plane), db = plane_distance(b, plane);
+
+      if(da >= 0.0f)
+      {
+        memcpy(&out[n_out*vertex_sz], a, vertex_sz*sizeof(float));
+        ++n_out;
+      }
+
+      //edge crosses the plane: emit the intersection. the edge from
+      //it to the next vertex is part of this one if it goes inside,
+      //otherwise it runs along the plane
+      if((da >= 0.0f) != (db >= 0.0f))
+      {
+        float t = da / (da - db);
+        float* v = &out[n_out*vertex_sz];
+        for(int k = 0; k < M; ++k) v[k] = a[k] + t*(b[k] - a[k]);
+        if(da >= 0.0f) v[M] = with_flags(a[M], CLIP_NEW_VERTEX | CLIP_NEW_EDGE);
+        else v[M] = with_flags(b[M], CLIP_NEW_VERTEX | (slot_flags(a[M]) & CLIP_NEW_EDGE));
+        ++n_out;
+      }
+    }
+    return n_out;
+  }
+}
+
+int AlmostGL::clip_triangle(int t_id, float* out, float* poly_buffer, int& n_clipped) const
+{
+  //vertex v_id of triangle t_id starts at position
+  //vertex_sz * indices[3*t_id + v_id] in the vbuffer.
+  //XYZW are in +0, +1, +2, +3, RGB in +4,+5,+6
+  const float* v[3];
+  int code[3];
+  for(int v_id = 0; v_id < 3; ++v_id)
+  {
+    v[v_id] = &vbuffer[vertex_sz*indices[3*t_id + v_id]];
+    code[v_id] = outcode(v[v_id]);
+  }
+
+  //trivial reject: all vertices outside the same plane
+  if(code[0] & code[1] & code[2]) return 0;
+
+  //trivial accept: all vertices inside the frustum
+  if((code[0] | code[1] | code[2]) == 0)
+  {
+    for(int v_id = 0; v_id < 3; ++v_id)
+      memcpy(&out[v_id*vertex_sz], v[v_id], vertex_sz*sizeof(float));
+    return 3*vertex_sz;
+  }
+
+  ++n_clipped;
+
+  //clip against the planes crossed by the triangle only. each plane
+  //adds at most one vertex to the polygon
+  float* poly[2] = { &poly_buffer[0], &poly_buffer[MAX_CLIP_VERTICES*vertex_sz] };
+  int n = 3, cur = 0, crossed = code[0] | code[1] | code[2];
+  for(int v_id = 0; v_id < 3; ++v_id)
+    memcpy(&poly[cur][v_id*vertex_sz], v[v_id], vertex_sz*sizeof(float));
+
+  for(int plane = 1; plane <= CLIP_W && n >= 3; plane <<= 1)
+  {
+    if(!(crossed & plane)) continue;
+    n = clip_polygon(poly[cur], n, poly[1-cur], plane, vertex_sz);
+    cur = 1-cur;
+  }
+  if(n < 3) return 0;
+
+  //fan (0, i, i+1) keeps the winding of the original triangle. its
+  //edge (i, i+1) is one of the polygon, and the other two are only
+  //for the first and last triangles: the rest are diagonals
+  int written = 0, M = vertex_sz-1;
+  for(int i = 1; i < n-1; ++i)
+  {
+    float* tri = &out[written];
+    memcpy(&tri[0], &poly[cur][0], vertex_sz*sizeof(float));
+    memcpy(&tri[vertex_sz], &poly[cur][i*vertex_sz], vertex_sz*sizeof(float));
+    memcpy(&tri[2*vertex_sz], &poly[cur][(i+1)*vertex_sz], vertex_sz*sizeof(float));
+    if(i > 1) tri[M] = with_flags(tri[M], slot_flags(tri[M]) | CLIP_NEW_EDGE);
+    if(i < n-2)
+    {
+      float& slot = tri[2*vertex_sz+M];
+      slot = with_flags(slot, slot_flags(slot) | CLIP_NEW_EDGE);
+    }
+    written += 3*vertex_sz;
+  }
+  return written;
+}
+
+void AlmostGL::clipping()
+{
+  //primitive clipping
+  //Loop over the triangles fetching their vertices from vbuffer and
+  //compute an outcode for each of them, telling which frustum planes
+  //(-w <= x,y,z <= w) they are outside of. Triangles fully inside are
+  //copied as they are and triangles fully outside some plane are thrown
+  //away; only the few crossing the frustum boundary go through the
+  //Sutherland-Hodgman clipper, whose output polygon is fanned back
+  //into triangles.
+  //Notice that, at this moment, we're doing primitive assembly
+  //when we gather the three vertices of each triangle
+  //Only the triangles of the BVH nodes inside the frustum get here
+  clipped_last = 0;
+  if(clip_capacity < 3*n_visible*vertex_sz)
+    grow_clip_buffers(3*n_visible*vertex_sz);
+
+  int n_clipped = 0;
+  for(size_t r = 0; r < visible.size(); ++r)
+  {
+    int end = visible[r].first + visible[r].count;
+    for(int t_id = visible[r].first; t_id < end; ++t_id)
+    {
+      if(clipped_last + MAX_CLIP_TRIANGLES*3*vertex_sz > clip_capacity)
+        grow_clip_buffers(clipped_last + MAX_CLIP_TRIANGLES*3*vertex_sz);
+      clipped_last += clip_triangle(t_id, &clipped[clipped_last], &clip_poly[0], n_clipped);
+    }
+  }
+  counters.triangles_clipped = n_clipped;
+}
+
+int AlmostGL::divide(const float* in, int n_floats, float* out) const
+{
+  //out may be the same as in: each vertex is read before written
+  for(int v_id = 0; v_id < n_floats; v_id += vertex_sz)
+  {
+    float w = in[v_id+3], material = in[v_id+7];
+
+    out[v_id+0] = in[v_id+0]/w;
+    out[v_id+1] = in[v_id+1]/w;
+    out[v_id+2] = in[v_id+2]/w;
+    out[v_id+3] = material;
+    out[v_id+4] = in[v_id+4]/w;
+    out[v_id+5] = in[v_id+5]/w;
+    out[v_id+6] = in[v_id+6]/w;
+    out[v_id+7] = 1.0f/w;
+
+    //we'll still keep all the 8 floats for simplicity!
+  }
+  return n_floats;
+}
+
+void AlmostGL::perspective_division()
+{
+  projected_last = divide(clipped, clipped_last, projected);
+}
+
+int AlmostGL::cull(const GlobalParameters& param, const float* in, int n_floats, float* out) const
+{
+  if(param.front_face == GL_CW) return cull_triangles<false>(in, n_floats, out);
+  return cull_triangles<true>(in, n_floats, out);
+}
+
+template<bool CCW>
+int AlmostGL::cull_triangles(const float* in, int n_floats, float* out) const
+{
+  //out may be the same as in, as triangles are only moved backwards
+  int written = 0;
+  for(int p_id = 0; p_id < n_floats; p_id += 3*vertex_sz)
+  {
+    //Data layout per vertex inside _in_ is:
+    //... X1 Y1 Z1 W1 R1 G1 B1 X2 Y2 Z2 W2 R2 G2 B2 X3 Y3 Z3 W3 R3 G3 B3 ...
+    //
+    //TODO: we could guarantee optimization by using an incrementer instead of
+    //computing products vertex_sz*i, but maybe the compiler already does this
+    vec3 v0(in[p_id+vertex_sz*0+0], in[p_id+vertex_sz*0+1], 1.0f);
+    vec3 v1(in[p_id+vertex_sz*1+0], in[p_id+vertex_sz*1+1], 1.0f);
+    vec3 v2(in[p_id+vertex_sz*2+0], in[p_id+vertex_sz*2+1], 1.0f);
+
+    //compute cross product p = v0v1 X v0v2;
+    //if p is pointing outside the screen, v0v1v2 are defined
+    //in counter-clockwise order. then, reject or accept this
+    //triangle based on the front face (CCW)
+    vec3 c = (v1-v0).cross(v2-v0);
+
+    //cull back faces
+    if(CCW ? c(2) < 0 : c(2) > 0) continue;
+
+    //copy to final buffer
+    if(out+written != in+p_id)
+      memmove(&out[written], &in[p_id], 3*vertex_sz*sizeof(float));
+    written += 3*vertex_sz;
+  }
+  return written;
+}
+
+void AlmostGL::culling(const GlobalParameters& param)
+{
+  //triangle culling
+  //TODO: In OpenGL architecture, culling happens in the primitive
+  //assembly stage, which is the first part of rasterization
+  culled_last = cull(param, projected, projected_last, culled);
+  counters.triangles_culled = (projected_last - culled_last) / (3*vertex_sz);
+}
+
+void AlmostGL::binning(const mat4& viewport, const float* tris, int n_floats)
+{
+  for(int p_id = 0; p_id < n_floats; p_id += 3*vertex_sz)
+  {
+    //screen space y range of this triangle. this MUST be
+    //computed exactly like rasterize_scanline() does, otherwise
+    //we could miss the first or last scanline of some triangle.
+    //the half-space rasterizer samples pixel centers, which
+    //may start one row above the rounded y
+    int y_min = buffer_height, y_max = -1;
+    for(int v_id = 0; v_id < 3; ++v_id)
+    {
+      const float* v = &tris[p_id+v_id*vertex_sz];
+      int y = ROUND( (viewport*vec4(v[0], v[1], 1.0f, 1.0f))(1) );
+      y_min = std::min(y_min, y-1); y_max = std::max(y_max, y);
+    }
+
+    int first = std::max(0, y_min / TILE_HEIGHT);
+    int last = std::min(n_tiles-1, y_max / TILE_HEIGHT);
+    for(int t = first; t <= last; ++t) bins[t].push_back(&tris[p_id]);
+  }
+}
+
+void AlmostGL::clear_buffers()
+{
+  //clear color and depth buffers
+  memset((void*)color, 0, (4*buffer_width*buffer_height)*sizeof(GLubyte));
+  for(int i = 0; i < buffer_width*buffer_height; ++i) depth[i] = 2.0f;
+  for(int i = 0; i < hiz_width*hiz_height; ++i) hiz[i] = 2.0f;
+  memset(hiz_dirty, 0, hiz_width*hiz_height);
+
+  //fragment counts are kept per tile, so that threads don't share them
+  for(int t = 0; t < n_tiles; ++t) tile_counts[t].tested = tile_counts[t].written = 0;
+}
+
+void AlmostGL::raster_bins(const mat4& viewport)
+{
+  //each tile is owned by exactly one job, and no two tiles
+  //share a pixel, so threads never touch each other's data.
+  //bins are left empty for the next call to binning()
+  pool.parallel_for(n_tiles, [&](int t) {
+    ScopedTimer timer(profiler, "raster tile");
+    int y_min = t*TILE_HEIGHT;
+    int y_max = std::min(buffer_height, y_min+TILE_HEIGHT) - 1;
+
+    std::vector<const float*>& bin = bins[t];
+    for(size_t i = 0; i < bin.size(); ++i)
+      (this->*raster_kernel)(viewport, bin[i], y_min, y_max, tile_counts[t]);
+    bin.clear();
+  });
+}
+
+void AlmostGL::rasterization(const GlobalParameters& param, const mat4& viewport)
+{
+  clear_buffers();
+
+  if(!param.multithreading)
+  {
+    for(int p_id = 0; p_id < culled_last; p_id += 3*vertex_sz)
+      (this->*raster_kernel)(viewport, &culled[p_id], 0, buffer_height-1, tile_counts[0]);
+    return;
+  }
+
+  binning(viewport, culled, culled_last);
+  raster_bins(viewport);
+}
+
+void AlmostGL::streaming(const GlobalParameters& param, const mat4& viewport,
+                         double& front_ms, double& raster_ms)
+{
+  //fused pipeline. instead of running each stage over the whole mesh,
+  //triangles are pulled from the index buffer STREAM_BATCH at a time
+  //and clipped, divided and culled in place inside the batch, which
+  //is small enough to stay in cache all along. a group of batches (a
+  //few per thread) is then binned and rasterized before moving on.
+  //memory used past the vertex buffer depends on the group size only.
+  //triangles reach the rasterizer in submission order, so the image
+  //is the same as the one of the buffered pipeline
+  typedef std::chrono::steady_clock clock;
+  auto ms = [](clock::time_point a, clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+  };
+
+  int group = param.multithreading ? 4*pool.size() : 1;
+  if((int)batches.size() < group)
+  {
+    batches.resize(group);
+    for(int b = 0; b < group; ++b)
+    {
+      batches[b].tris.resize(STREAM_BATCH*MAX_CLIP_TRIANGLES*3*vertex_sz);
+      batches[b].poly.resize(2*MAX_CLIP_VERTICES*vertex_sz);
+    }
+  }
+
+  clear_buffers();
+  front_ms = raster_ms = 0.0;
+  long long n_clipped = 0, n_culled = 0;
+
+  int n_batches = (n_visible + STREAM_BATCH - 1) / STREAM_BATCH;
+  for(int first = 0; first < n_batches; first += group)
+  {
+    int n = std::min(group, n_batches - first);
+
+    clock::time_point t0 = clock::now();
+    auto front_end = [&](int b) {
+      TriangleBatch& batch = batches[b];
+      int begin = (first+b)*STREAM_BATCH;
+      int end = std::min(n_visible, begin+STREAM_BATCH);
+
+      //the batch takes triangles [begin, end) of the visible ones,
+      //which may span several ranges
+      int r = std::upper_bound(visible_start.begin(), visible_start.end(), begin) - visible_start.begin() - 1;
+      int n_floats = 0;
+      batch.n_clipped = 0;
+      for(int i = begin; i < end; ++i)
+      {
+        while(i >= visible_start[r] + (int)visible[r].count) ++r;
+        int t_id = visible[r].first + (i - visible_start[r]);
+        n_floats += clip_triangle(t_id, &batch.tris[n_floats], &batch.poly[0], batch.n_clipped);
+      }
+      divide(&batch.tris[0], n_floats, &batch.tris[0]);
+      batch.n_floats = cull(param, &batch.tris[0], n_floats, &batch.tris[0]);
+      batch.n_culled = (n_floats - batch.n_floats) / (3*vertex_sz);
+    };
+    if(param.multithreading) pool.parallel_for(n, front_end);
+    else front_end(0);
+
+    //binning is serial and walks the batches in order, which
+    //is what keeps triangles in submission order inside bins
+    for(int b = 0; b < n; ++b)
+    {
+      n_clipped += batches[b].n_clipped;
+      n_culled += batches[b].n_culled;
+      if(param.multithreading) binning(viewport, &batches[b].tris[0], batches[b].n_floats);
+    }
+    clock::time_point t1 = clock::now();
+
+    if(param.multithreading) raster_bins(viewport);
+    else
+    {
+      const TriangleBatch& batch = batches[0];
+      for(int p_id = 0; p_id < batch.n_floats; p_id += 3*vertex_sz)
+        (this->*raster_kernel)(viewport, &batch.tris[p_id], 0, buffer_height-1, tile_counts[0]);
+    }
+    clock::time_point t2 = clock::now();
+
+    front_ms += ms(t0, t1);
+    raster_ms += ms(t1, t2);
+    if(profiler)
+    {
+      profiler->record("clipping", t0, t1);
+      profiler->record("rasterization", t1, t2);
+    }
+  }
+
+  counters.triangles_clipped = n_clipped;
+  counters.triangles_culled = n_culled;
+}
+
+void AlmostGL::shading(const GlobalParameters& param, const mat4& vp, const vec3& eye,
+                       const vec4& light, const vec3& model_color)
+{
+  //positions are not in the G-buffer, the fragment stage gets
+  //them back from the depth buffer through the inverse of vp
+  FragmentUniforms u;
+  mat4 inv_vp = vp.inverse();
+  for(int i = 0; i < 4; ++i)
+    for(int j = 0; j < 4; ++j)
+      u.inv_vp[i+4*j] = inv_vp(i,j);
+  for(int i = 0; i < 3; ++i)
+  {
+    u.eye[i] = eye(i);
+    u.light[i] = light(i);
+    u.model_color[i] = model_color(i);
+  }
+  u.shininess = &shininess[0];
+
+  GBuffer g = { buffer_width, buffer_height, depth, gnormal, gmaterial };
+
+  //pixels are independent, so rows split among threads just like tiles
+  if(param.multithreading)
+  {
+    pool.parallel_for(n_tiles, [&](int t) {
+      ScopedTimer timer(profiler, "shading tile");
+      FragmentStage::shade(kernel, g, u, t*TILE_HEIGHT,
+                           std::min(buffer_height, (t+1)*TILE_HEIGHT), color);
+    });
+  }
+  else FragmentStage::shade(kernel, g, u, 0, buffer_height, color);
+}
+
+float AlmostGL::hiz_farthest(int tx, int ty)
+{
+  int t = ty*hiz_width + tx;
+  if(hiz_dirty[t])
+  {
+    int x0 = tx*HIZ_TILE, x1 = std::min(buffer_width, x0+HIZ_TILE);
+    int y0 = ty*HIZ_TILE, y1 = std::min(buffer_height, y0+HIZ_TILE);
+
+    //nothing is farther than the clear depth (2.0), so we can
+    //stop at the first pixel still holding it. this makes tiles
+    //that are being filled (the dirty ones, mostly) cheap
+    float farthest = depth[y0*buffer_width+x0];
+    for(int y = y0; y < y1 && farthest < 2.0f; ++y)
+      for(int x = x0; x < x1; ++x)
+        farthest = std::max(farthest, depth[y*buffer_width+x]);
+
+    hiz[t] = farthest;
+    hiz_dirty[t] = 0;
+  }
+  return hiz[t];
+}
+
+bool AlmostGL::hiz_occluded(float z_near, int x0, int y0, int x1, int y1)
+{
+  //a fragment passes the depth test only if it is strictly
+  //nearer than what is stored, so z_near must be nearer than
+  //the farthest depth of at least one tile
+  for(int ty = y0 / HIZ_TILE; ty <= y1 / HIZ_TILE; ++ty)
+    for(int tx = x0 / HIZ_TILE; tx <= x1 / HIZ_TILE; ++tx)
+      if(z_near < hiz_farthest(tx, ty)) return false;
+  return true;
+}
+
+void AlmostGL::pick_kernels(const GlobalParameters& param)
+{
+  bool deferred = param.shading == 2;
+
+  //edges and vertices have rasterizers of their own, whatever
+  //param.rasterizer says. they leave most of the depth buffer
+  //untouched, so hi-z tiles would never reject anything
+  if(param.draw_mode == GL_LINE)
+  {
+    raster_kernel = deferred ? &AlmostGL::rasterize_lines<true> : &AlmostGL::rasterize_lines<false>;
+    return;
+  }
+  if(param.draw_mode == GL_POINT)
+  {
+    raster_kernel = deferred ? &AlmostGL::rasterize_points<true> : &AlmostGL::rasterize_points<false>;
+    return;
+  }
+
+  int rasterizer = param.rasterizer == 1 ? 1 : 0;
+  #define KERNEL(r,d,h) &AlmostGL::rasterize_triangle<r,d,h>
+  static const RasterKernel kernels[2][2][2] = {
+    { { KERNEL(0,false,false), KERNEL(0,false,true) },
+      { KERNEL(0,true,false), KERNEL(0,true,true) } },
+    { { KERNEL(1,false,false), KERNEL(1,false,true) },
+      { KERNEL(1,true,false), KERNEL(1,true,true) } } };
+  #undef KERNEL
+
+  raster_kernel = kernels[rasterizer][deferred][param.hiz];
+}
+
+template<int RASTERIZER, bool DEFERRED, bool HIZ>
+void AlmostGL::rasterize_triangle(const mat4& viewport, const float* tri,
+                                  int y_min, int y_max, FragmentCounts& counts)
+{
+  if(HIZ)
+  {
+    //conservative screen space bounding box and nearest depth
+    //of the triangle. both rasterizers stay inside it
+    float x_lo = buffer_width, x_hi = -1.0f, y_lo = buffer_height, y_hi = -1.0f;
+    float z_near = 2.0f;
+    for(int v_id = 0; v_id < 3; ++v_id)
+    {
+      const float* v = &tri[v_id*vertex_sz];
+      vec4 pos = viewport*vec4(v[0], v[1], 1.0f, 1.0f);
+      x_lo = std::min(x_lo, pos(0)); x_hi = std::max(x_hi, pos(0));
+      y_lo = std::min(y_lo, pos(1)); y_hi = std::max(y_hi, pos(1));
+      z_near = std::min(z_near, v[2]);
+    }
+
+    int x0 = std::max(0, (int)floorf(x_lo) - 1), x1 = std::min(buffer_width-1, (int)ceilf(x_hi) + 1);
+    int y0 = std::max(y_min, (int)floorf(y_lo) - 1), y1 = std::min(y_max, (int)ceilf(y_hi) + 1);
+    if(x0 > x1 || y0 > y1) return;
+
+    //interpolated depths may land an ulp or so below the nearest
+    //vertex, HIZ_EPS keeps the test conservative
+    if(hiz_occluded(z_near - HIZ_EPS, x0, y0, x1, y1)) return;
+  }
+
+  if(RASTERIZER == 1) rasterize_halfspace<DEFERRED, HIZ>(viewport, tri, y_min, y_max, counts);
+  else rasterize_scanline<DEFERRED>(viewport, tri, y_min, y_max, counts);
+}
+
+#define PIXEL(i,j) (4*(i*buffer_width+j))
+#define SET_PIXEL(i,j,r,g,b) { color[PIXEL(i,j)+0] = r; \
+                               color[PIXEL(i,j)+1] = g; \
+                               color[PIXEL(i,j)+2] = b; \
+                               color[PIXEL(i,j)+3] = 255;}
+
+//writes depth and flags the hi-z tile containing the pixel
+#define SET_DEPTH(i,j,z) { depth[i*buffer_width+j] = z; \
+                           hiz_dirty[(i/HIZ_TILE)*hiz_width + j/HIZ_TILE] = 1; }
+
+template<bool DEFERRED>
+void AlmostGL::rasterize_scanline(const mat4& viewport, const float* tri,
+                                  int y_min, int y_max, FragmentCounts& counts)
+{
+  struct Vertex
+  {
+    float x, y;
+    vec3 color;
+    float z, w;
+
+    Vertex() {}
+
+    Vertex(const float* v_packed, const mat4& vp)
+    {
+      //we need x and y positions mapped to the viewport and
+      //with integer coordinates, otherwise we'll have displacements
+      //for start and end which are huge when because of 0 < dy < 1;
+      //these cases must be treated as straight, horizontal lines.
+      vec4 pos = vp*vec4(v_packed[0], v_packed[1], 1.0f, 1.0f);
+      x = ROUND(pos(0)); y = ROUND(pos(1));
+      color = vec3(v_packed[4], v_packed[5], v_packed[6]);
+      z = v_packed[2]; w = v_packed[7];
+    }
+
+    Vertex operator-(const Vertex& rhs)
+    {
+      Vertex out;
+      out.x = x - rhs.x;
+      out.y = y - rhs.y;
+      out.color = color - rhs.color;
+      out.z = z - rhs.z;
+      out.w = w - rhs.w; //TODO: not sure if I should do this
+      return out;
+    }
+
+    void operator+=(const Vertex& rhs)
+    {
+      x += rhs.x;
+      y += rhs.y;
+      color = color + rhs.color;
+      z += rhs.z;
+      w += rhs.w; //TODO: not sure if I should do this neither
+    }
+
+    Vertex operator/(float k)
+    {
+      Vertex out;
+      out.x = x / k;
+      out.y = y / k;
+      out.color = color * (1.0f/k);
+      out.z = z / k;
+      out.w = w / k;
+      return out;
+    }
+  };
+
+  //unpack vertex data into structs so we can
+  //easily interpolate/operate them.
+  //TODO: To better reflect OpenGL structure, viewport
+  //transformation should be applied after perspective
+  //division and before triangle culling, which should
+  //happen in primitive assembly
+  Vertex v0(&tri[0*vertex_sz], viewport);
+  Vertex v1(&tri[1*vertex_sz], viewport);
+  Vertex v2(&tri[2*vertex_sz], viewport);
+
+  //per-pixel shading writes to the G-buffer instead. the material
+  //is the one of the first vertex, like flat attributes in OpenGL
+  uint16_t material = slot_material(tri[3]);
+
+  //order vertices by y coordinate
+  #define SWAP(a,b) { Vertex aux = b; b = a; a = aux; }
+  if( v0.y > v1.y ) SWAP(v0, v1);
+  if( v0.y > v2.y ) SWAP(v0, v2);
+  if( v1.y > v2.y ) SWAP(v1, v2);
+
+  //these dVdy_ variables define how much we must
+  //increment v when increasing one unit in y, so
+  //we can use this to compute the start and end
+  //boundaries for rasterization. Notice that not
+  //only this defines the actual x coordinate of the
+  //fragment in the scanline, but all the other
+  //attributes. Also, notice that y is integer and
+  //thus if we make dy0 = (v1.y-v0.y) steps in y, for intance,
+  //incrementing v0 with dVdy0 at each step, by the end of
+  //the dy steps we'll have:
+  //
+  // v0 + dy0 * dVdy0 = v0 + dy0*(v1-v0)/dy0 = v0 + v1 - v0 = v1
+  //
+  //which is exactly what we want, a linear interpolation
+  //between v0 and v1 with dy0 steps
+  Vertex dV_dy0 = (v1-v0)/(v1.y-v0.y);
+  Vertex dV_dy1 = (v2-v0)/(v2.y-v0.y);
+  Vertex dV_dy2 = (v2-v1)/(v2.y-v1.y);
+  Vertex start, end;
+  Vertex dStart_dy, dEnd_dy;
+
+  //this will tell us whether we should change dStart_dy
+  //or dEnd_dy to the next active edge (dV_dy2) when we
+  //reach halfway the triangle
+  Vertex *next_active_edge;
+
+  //decide start/end edges. If v1 is to the left
+  //side of the edge connecting v0 and v2, then v0v1
+  //is the starting edge and v0v2 is the ending edge;
+  //if v1 is to the right, it is the contrary.
+  //the v0v1 edge will be substituted by the v1v2 edge
+  //when we reach the v1 vertex while scanlining, so we
+  //store which of the start/end edges we should replace
+  //with v1v2.
+  vec3 right_side = vec3(v1.x-v0.x, v1.y-v0.y, 0.0f).cross(vec3(v2.x-v0.x, v2.y-v0.y, 0.0f));
+  if( right_side(2) > 0.0f )
+  {
+    dEnd_dy = dV_dy0;
+    dStart_dy = dV_dy1;
+    next_active_edge = &dEnd_dy;
+  }
+  else
+  {
+    dEnd_dy = dV_dy1;
+    dStart_dy = dV_dy0;
+    next_active_edge = &dStart_dy;
+  }
+
+  //handle flat top triangles
+  if( v0.y == v1.y )
+  {
+    //switch active edge and update
+    //starting and ending points
+    if( v0.x < v1.x )
+    {
+      dEnd_dy = dV_dy2;
+      start = v0; end = v1;
+    }
+    else
+    {
+      dStart_dy = dV_dy2;
+      start = v1; end = v0;
+    }
+  }
+  else start = end = v0;
+
+  //loop over scanlines. we walk all of them, even the ones
+  //outside [y_min, y_max], because start and end are built
+  //incrementally and skipping steps would change the result
+  //(and tiles must produce the exact same pixels as a single
+  //full screen pass)
+  for(int y = v0.y; y <= v2.y; ++y)
+  {
+    if( y >= y_min && y <= y_max )
+    {
+      //rasterize scanline
+      int s = ROUND(start.x), e = ROUND(end.x);
+      Vertex dV_dx = (end - start)/(e - s);
+      Vertex f = start;
+
+      for(int x = s; x <= e; ++x)
+      {
+        //x = buffer_width can happen for vertices lying exactly
+        //on the right clipping plane; writing it would spill into
+        //the next scanline, which may belong to another tile
+        if(x < 0 || x >= buffer_width) { f += dV_dx; continue; }
+
+        // To better represent what the pipeline does, we should, in the
+        // following order:
+        //
+        // 1) perform early fragment tests at this point (which include
+        // depth buffering, scissor testing and stencil buffering, for
+        // for example), which decide whether this fragment will live
+        // or not. Notice that at this point, a fragment is the set of
+        // attributes interpolated by the rasterizer;
+        //
+        // 2) evaluate fragment shader to compute a pixel sample from the
+        // fragment's attributes;
+        //
+        // 3) perform per-sample operations like alpha
+        // blending using the sample computed in the previous stage;
+        //
+        // It is interesting to notice that, as of version 4.6, the OpenGL
+        // specification calls "per-fragment
+        // operations" both early fragment tests (which MAY be performed
+        // before or after fragment shader evaluation, but executing before
+        // allows us to discard fragments without evaluating them) and
+        // per-sample operations (like like alpha blending, dithering and
+        // sRGB conversions), which MUST be performed after fragment shader
+        // evaluation because we need a pixel sample.
+
+        // Here we mixed things in the same code for simplicity
+        ++counts.tested;
+        if( f.z < depth[y*buffer_width+x] )  // early fragment tests
+        {
+          SET_DEPTH(y, x, f.z);              // early fragment tests
+          ++counts.written;
+
+          if(DEFERRED)                       // G-buffer writing. the encoding
+          {                                  // keeps the direction only, so
+            gnormal[y*buffer_width+x] =      // no need to divide by w
+              FragmentStage::encode_normal(f.color(0), f.color(1), f.color(2));
+            gmaterial[y*buffer_width+x] = material;
+            f += dV_dx;
+            continue;
+          }
+
+          vec3 c = f.color * (1.0f / f.w);   // output of the rasterizer
+
+                                             // fragment shader comes here
+
+          int R = std::min(255, (int)(c(0)*255.0f)); // framebuffer writing
+          int G = std::min(255, (int)(c(1)*255.0f));
+          int B = std::min(255, (int)(c(2)*255.0f));
+
+          SET_PIXEL(y, x, R, G, B);
+        }
+
+        f += dV_dx;
+      }
+    }
+
+    //switch active edges if halfway through the triangle
+    //This MUST be done before incrementing, otherwise
+    //once we reached v1 we would pass through it and
+    //start coming back only in the next step, causing
+    //the big "leaking" triangles!
+    if( y == (int)v1.y ) *next_active_edge = dV_dy2;
+
+    //increment bounds
+    start += dStart_dy; end += dEnd_dy;
+  }
+}
+
+//half-space rasterization works on fixed point coordinates
+//with SUBPIXEL_BITS bits of sub-pixel precision, so that edge
+//functions are evaluated exactly and the fill rule holds
+//regardless of how the screen is split into tiles
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE >> 1)
+
+template<bool DEFERRED, bool HIZ>
+void AlmostGL::rasterize_halfspace(const mat4& viewport, const float* tri,
+                                   int y_min, int y_max, FragmentCounts& counts)
+{
+  typedef long long fixed;
+
+  //snap vertices to the sub-pixel grid
+  fixed X[3], Y[3];
+  const float* v[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    v[i] = &tri[i*vertex_sz];
+    vec4 pos = viewport*vec4(v[i][0], v[i][1], 1.0f, 1.0f);
+    X[i] = (fixed)floorf(pos(0) * SUBPIXEL_ONE + 0.5f);
+    Y[i] = (fixed)floorf(pos(1) * SUBPIXEL_ONE + 0.5f);
+  }
+
+  //twice the signed area. we want it positive (clockwise in
+  //screen space, where y points down), so swap two vertices
+  //if needed; culling already got rid of the faces we don't want
+  fixed area = (X[1]-X[0])*(Y[2]-Y[0]) - (Y[1]-Y[0])*(X[2]-X[0]);
+  if(area == 0) return;
+  if(area < 0)
+  {
+    std::swap(X[1], X[2]); std::swap(Y[1], Y[2]); std::swap(v[1], v[2]);
+    area = -area;
+  }
+
+  //bounding box in pixels, clamped to the screen and to this tile.
+  //quads are 2x2 aligned so start at even coordinates
+  int bx0 = (int)(std::min(X[0], std::min(X[1], X[2])) >> SUBPIXEL_BITS);
+  int bx1 = (int)(std::max(X[0], std::max(X[1], X[2])) >> SUBPIXEL_BITS);
+  int by0 = (int)(std::min(Y[0], std::min(Y[1], Y[2])) >> SUBPIXEL_BITS);
+  int by1 = (int)(std::max(Y[0], std::max(Y[1], Y[2])) >> SUBPIXEL_BITS);
+  bx0 = std::max(bx0, 0) & ~1; bx1 = std::min(bx1, buffer_width-1);
+  by0 = std::max(by0, y_min) & ~1; by1 = std::min(by1, y_max);
+  if(bx0 > bx1 || by0 > by1) return;
+
+  //edge function of edge i, the one opposite to vertex i:
+  //  E_i(p) = A_i*(p.x - X_a) + B_i*(p.y - Y_a)
+  //it is positive inside the triangle and equals twice the
+  //area of the sub-triangle (p, a, b), so E_i/area is exactly
+  //the barycentric coordinate of vertex i
+  fixed A[3], B[3], E_row[3];
+  bool top_left[3];
+  fixed px = ((fixed)bx0 << SUBPIXEL_BITS) + SUBPIXEL_HALF;
+  fixed py = ((fixed)by0 << SUBPIXEL_BITS) + SUBPIXEL_HALF;
+  for(int i = 0; i < 3; ++i)
+  {
+    int a = (i+1) % 3, b = (i+2) % 3;
+    A[i] = -(Y[b]-Y[a]);
+    B[i] = X[b]-X[a];
+    E_row[i] = A[i]*(px - X[a]) + B[i]*(py - Y[a]);
+
+    //top-left fill rule: pixels exactly on an edge belong to
+    //the triangle only if it is a top or a left edge, so that
+    //pixels on edges shared by two triangles are drawn once.
+    //we apply it by biasing the other edges by -1, which turns
+    //E >= 0 into E > 0 for them
+    top_left[i] = (Y[b]-Y[a] < 0) || (Y[b] == Y[a] && X[b]-X[a] > 0);
+    if(!top_left[i]) E_row[i] -= 1;
+  }
+
+  float inv_area = 1.0f / (float)area;
+
+  //per-pixel shading writes to the G-buffer instead. the material
+  //is the one of the first vertex, like flat attributes in OpenGL
+  uint16_t material = slot_material(tri[3]);
+
+  //steps of the edge functions when moving one pixel
+  fixed step_x[3], step_y[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    step_x[i] = A[i] * SUBPIXEL_ONE;
+    step_y[i] = B[i] * SUBPIXEL_ONE;
+  }
+
+  //depth is an affine function of the screen position, which gives
+  //us the nearest depth of the triangle inside any rectangle from
+  //its value at the rectangle corner and its slopes
+  float z_near = std::min(v[0][2], std::min(v[1][2], v[2][2]));
+  float dz_dx = 0.0f, dz_dy = 0.0f;
+  if(HIZ)
+    for(int i = 0; i < 3; ++i)
+    {
+      dz_dx += (float)step_x[i] * v[i][2] * inv_area;
+      dz_dy += (float)step_y[i] * v[i][2] * inv_area;
+    }
+
+  //walk the bounding box in blocks matching the hi-z tiles. a block is
+  //skipped if it is entirely outside some edge or if the triangle is
+  //behind everything already drawn there; the others are walked in 2x2
+  //quads. the four pixels of a quad are tested together and the quad is
+  //skipped altogether if none of them is covered
+  for(int by = by0; by <= by1; by = (by / HIZ_TILE + 1) * HIZ_TILE)
+  {
+    int bh = std::min(by1, (by / HIZ_TILE + 1) * HIZ_TILE - 1) - by;
+    for(int bx = bx0; bx <= bx1; bx = (bx / HIZ_TILE + 1) * HIZ_TILE)
+    {
+      int bw = std::min(bx1, (bx / HIZ_TILE + 1) * HIZ_TILE - 1) - bx;
+
+      //edge values at the block corner. E is linear, so its largest
+      //value inside the block is at one of the corners
+      fixed E_block[3];
+      bool outside = false;
+      for(int i = 0; i < 3; ++i)
+      {
+        E_block[i] = E_row[i] + (fixed)(bx - bx0)*step_x[i] + (fixed)(by - by0)*step_y[i];
+        fixed E_max = E_block[i] + std::max((fixed)0, bw*step_x[i]) + std::max((fixed)0, bh*step_y[i]);
+        outside = outside || E_max < 0;
+      }
+      if(outside) continue;
+
+      if(HIZ)
+      {
+        float z = 0.0f;
+        for(int i = 0; i < 3; ++i)
+          z += (float)(E_block[i] + (top_left[i] ? 0 : 1)) * inv_area * v[i][2];
+        z += std::min(0.0f, bw*dz_dx) + std::min(0.0f, bh*dz_dy);
+
+        if(std::max(z, z_near) - HIZ_EPS >= hiz_farthest(bx / HIZ_TILE, by / HIZ_TILE)) continue;
+      }
+
+      for(int y = by; y <= by+bh; y += 2)
+      {
+        fixed E_quad[3];
+        for(int i = 0; i < 3; ++i) E_quad[i] = E_block[i] + (fixed)(y - by)*step_y[i];
+
+        for(int x = bx; x <= bx+bw; x += 2)
+        {
+          //edge values for the pixels (x,y) (x+1,y) (x,y+1) (x+1,y+1)
+          fixed E[4][3];
+          bool inside[4];
+          for(int i = 0; i < 3; ++i)
+          {
+            E[0][i] = E_quad[i];
+            E[1][i] = E_quad[i] + step_x[i];
+            E[2][i] = E_quad[i] + step_y[i];
+            E[3][i] = E_quad[i] + step_x[i] + step_y[i];
+          }
+          for(int q = 0; q < 4; ++q)
+            inside[q] = (E[q][0] | E[q][1] | E[q][2]) >= 0;
+
+          if(inside[0] | inside[1] | inside[2] | inside[3])
+          {
+            for(int q = 0; q < 4; ++q)
+            {
+              int qx = x + (q & 1), qy = y + (q >> 1);
+              if(!inside[q] || qx > bx+bw || qy > by+bh) continue;
+
+              //undo the fill rule bias before computing barycentrics
+              float l[3];
+              for(int i = 0; i < 3; ++i)
+                l[i] = (float)(E[q][i] + (top_left[i] ? 0 : 1)) * inv_area;
+
+              float z = l[0]*v[0][2] + l[1]*v[1][2] + l[2]*v[2][2];
+              ++counts.tested;
+              if( z < depth[qy*buffer_width+qx] )
+              {
+                SET_DEPTH(qy, qx, z);
+                ++counts.written;
+
+                //the normal encoding keeps the direction
+                //only, so there's no need to divide by w
+                if(DEFERRED)
+                {
+                  gnormal[qy*buffer_width+qx] = FragmentStage::encode_normal(
+                      l[0]*v[0][4] + l[1]*v[1][4] + l[2]*v[2][4],
+                      l[0]*v[0][5] + l[1]*v[1][5] + l[2]*v[2][5],
+                      l[0]*v[0][6] + l[1]*v[1][6] + l[2]*v[2][6]);
+                  gmaterial[qy*buffer_width+qx] = material;
+                  continue;
+                }
+
+                //attributes were divided by w before rasterization, so
+                //a linear interpolation followed by a division by the
+                //interpolated 1/w is perspective correct
+                float w = l[0]*v[0][7] + l[1]*v[1][7] + l[2]*v[2][7];
+                float inv_w = 1.0f / w;
+                int R = std::min(255, (int)((l[0]*v[0][4] + l[1]*v[1][4] + l[2]*v[2][4]) * inv_w * 255.0f));
+                int G = std::min(255, (int)((l[0]*v[0][5] + l[1]*v[1][5] + l[2]*v[2][5]) * inv_w * 255.0f));
+                int B = std::min(255, (int)((l[0]*v[0][6] + l[1]*v[1][6] + l[2]*v[2][6]) * inv_w * 255.0f));
+
+                SET_PIXEL(qy, qx, R, G, B);
+              }
+            }
+          }
+
+          for(int i = 0; i < 3; ++i) E_quad[i] += 2*step_x[i];
+        }
+      }
+    }
+  }
+}
+
+template<bool DEFERRED>
+void AlmostGL::write_fragment(int x, int y, const float* a, const float* b, float t,
+                              uint16_t material, FragmentCounts& counts)
+{
+  //attributes were divided by w before rasterization, so a linear
+  //interpolation followed by a division by the interpolated 1/w
+  //is perspective correct (depth is linear in screen space)
+  float z = a[2] + t*(b[2]-a[2]);
+  ++counts.tested;
+  if( !(z < depth[y*buffer_width+x]) ) return;
+
+  SET_DEPTH(y, x, z);
+  ++counts.written;
+
+  float r = a[4] + t*(b[4]-a[4]);
+  float g = a[5] + t*(b[5]-a[5]);
+  float bl = a[6] + t*(b[6]-a[6]);
+
+  //the normal encoding keeps the direction
+  //only, so there's no need to divide by w
+  if(DEFERRED)
+  {
+    gnormal[y*buffer_width+x] = FragmentStage::encode_normal(r, g, bl);
+    gmaterial[y*buffer_width+x] = material;
+    return;
+  }
+
+  float inv_w = 1.0f / (a[7] + t*(b[7]-a[7]));
+  int R = std::min(255, (int)(r * inv_w * 255.0f));
+  int G = std::min(255, (int)(g * inv_w * 255.0f));
+  int B = std::min(255, (int)(bl * inv_w * 255.0f));
+  SET_PIXEL(y, x, R, G, B);
+}
+
+//floor(a/b) for b > 0
+static inline long long floor_div(long long a, long long b)
+{
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+template<bool DEFERRED>
+void AlmostGL::rasterize_lines(const mat4& viewport, const float* tri,
+                               int y_min, int y_max, FragmentCounts& counts)
+{
+  uint16_t material = slot_material(tri[3]);
+
+  //pixels containing each vertex
+  int X[3], Y[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    const float* v = &tri[i*vertex_sz];
+    vec4 pos = viewport*vec4(v[0], v[1], 1.0f, 1.0f);
+    X[i] = (int)floorf(pos(0)); Y[i] = (int)floorf(pos(1));
+  }
+
+  for(int e = 0; e < 3; ++e)
+  {
+    //clipping adds edges along the frustum planes and splits
+    //what's left of the triangle in several, neither of which
+    //is an edge of the model
+    if(slot_flags(tri[e*vertex_sz+3]) & CLIP_NEW_EDGE) continue;
+
+    //edges are always walked from their upper endpoint (the left one,
+    //if horizontal), so that an edge shared by two triangles produces
+    //the exact same fragments for both, and the second one fails
+    //the depth test instead of drawing it again
+    int i = e, j = (e+1) % 3;
+    if(Y[j] < Y[i] || (Y[j] == Y[i] && X[j] < X[i])) std::swap(i, j);
+    const float *a = &tri[i*vertex_sz], *b = &tri[j*vertex_sz];
+
+    //DDA along the major axis: pixel k of the n+1 is the endpoint
+    //plus k*(DX,DY)/n rounded, in integers, so that any range of
+    //steps can be computed without walking the ones before it
+    long long DX = X[j] - X[i], DY = Y[j] - Y[i];
+    long long n = std::max(std::abs(DX), DY);
+    if(n == 0)
+    {
+      if(Y[i] >= y_min && Y[i] <= y_max && X[i] >= 0 && X[i] < buffer_width)
+        write_fragment<DEFERRED>(X[i], Y[i], a, b, 0.0f, material, counts);
+      continue;
+    }
+
+    //rows go from Y[i] to Y[j] as k goes from 0 to n, y(k) = Y[i] +
+    //floor((2*k*DY + n) / 2n). only steps on the rows of this tile
+    long long k0 = 0, k1 = n;
+    if(DY == 0)
+    {
+      if(Y[i] < y_min || Y[i] > y_max) continue;
+    }
+    else
+    {
+      if(y_min > Y[i]) k0 = -floor_div(-(2*n*(y_min - Y[i]) - n), 2*DY);
+      if(y_max < Y[j]) k1 = floor_div(2*n*(y_max - Y[i] + 1) - n - 1, 2*DY);
+    }
+
+    float inv_n = 1.0f / n;
+    for(long long k = k0; k <= k1; ++k)
+    {
+      int x = X[i] + (int)floor_div(2*k*DX + n, 2*n);
+      int y = Y[i] + (int)floor_div(2*k*DY + n, 2*n);
+      if(x < 0 || x >= buffer_width) continue;
+      write_fragment<DEFERRED>(x, y, a, b, k*inv_n, material, counts);
+    }
+  }
+}
+
+template<bool DEFERRED>
+void AlmostGL::rasterize_points(const mat4& viewport, const float* tri,
+                                int y_min, int y_max, FragmentCounts& counts)
+{
+  //one pixel per vertex. vertices shared by several triangles
+  //land on the same pixel with the same depth, so only the
+  //first one passes the depth test. those made by clipping
+  //aren't vertices of the model
+  uint16_t material = slot_material(tri[3]);
+  for(int i = 0; i < 3; ++i)
+  {
+    const float* v = &tri[i*vertex_sz];
+    if(slot_flags(v[3]) & CLIP_NEW_VERTEX) continue;
+    vec4 pos = viewport*vec4(v[0], v[1], 1.0f, 1.0f);
+    int x = (int)floorf(pos(0)), y = (int)floorf(pos(1));
+    if(y < y_min || y > y_max || x < 0 || x >= buffer_width) continue;
+    write_fragment<DEFERRED>(x, y, v, v, 0.0f, material, counts);
+  }
+}
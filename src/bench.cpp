@@ -0,0 +1,591 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include "../include/mesh.h"
+#include "../include/param.h"
+#include "../include/almostgl.h"
+
+//Benchmark harness: renders a fixed camera path over a set of meshes
+//at several resolutions and reports percentiles of the wall clock time
+//of every pipeline stage as JSON. Everything that affects the frames is
+//fixed (path, parameters, frame count), so results of two builds can be
+//compared directly.
+
+namespace
+{
+  struct Resolution { int width, height; };
+
+  struct Options
+  {
+    std::vector<std::string> meshes;
+    std::vector<Resolution> resolutions;
+    std::vector<int> rasterizers;
+    std::vector<bool> pipelines;
+    int frames, warmup, threads, shading;
+    GLenum draw_mode;
+    bool order_report, math_report;
+    std::string output;
+  };
+
+  //stages as they show up in the report. "upload" is the copy of the color
+  //buffer out of AlmostGL; with no GPU around this is what remains of the
+  //glTexSubImage2D the interactive application does
+  const char* STAGES[] = { "vertex", "clipping", "projection", "culling",
+                           "rasterization", "shading", "upload", "total" };
+  const int N_STAGES = 8;
+
+  //camera path for frame i of n: the model spins once around its vertical
+  //axis while the camera dollies towards it and back, getting close enough
+  //for a good part of the model to be clipped by the near plane
+  void camera_path(int i, int n, const glm::mat4& centered, GlobalParameters& param)
+  {
+    float t = (float)i / n;
+    glm::vec3 center(0.0f, 0.0f, -5.5f);
+
+    param.model2world = glm::translate(glm::mat4(1.0f), center) *
+                        glm::rotate(glm::mat4(1.0f), glm::radians(360.0f*t), glm::vec3(0.0f, 1.0f, 0.0f)) *
+                        glm::translate(glm::mat4(1.0f), -center) * centered;
+    param.cam.eye = glm::vec3(0.0f, 0.0f, -3.5f * (0.5f - 0.5f*cosf(2.0f*3.14159265f*t)));
+  }
+
+  void default_parameters(GlobalParameters& param)
+  {
+    param.cam.eye = glm::vec3(0.0f, 0.0f, 0.0f);
+    param.cam.look_dir = glm::vec3(0.0f, 0.0f, -1.0f);
+    param.cam.up = glm::vec3(0.0f, 1.0f, 0.0f);
+    param.cam.right = glm::vec3(1.0f, 0.0f, 0.0f);
+    param.cam.near = 1.0f; param.cam.far = 10.0f;
+    param.cam.step = 0.1f;
+    param.cam.FoVy = 45.0f, param.cam.FoVx = 45.0f;
+    param.cam.lock_view = false;
+    param.light<<0.0f, 0.0f, 0.0f;
+    param.model_color<<0.0f, 1.0f, 0.0f;
+    param.front_face = GL_CCW;
+    param.draw_mode = GL_FILL;
+    param.shading = 1;
+    param.frustum_culling = true;
+    param.cluster_culling = true;
+    param.lod = true;
+    param.multithreading = true;
+    param.rasterizer = 0;
+    param.hiz = true;
+    param.streaming = true;
+  }
+
+  //nearest rank percentile of sorted samples
+  double percentile(const std::vector<double>& sorted, double p)
+  {
+    int rank = (int)ceil(p / 100.0 * sorted.size());
+    return sorted[std::max(0, std::min((int)sorted.size()-1, rank-1))];
+  }
+
+  void write_stats(FILE* out, std::vector<double> samples)
+  {
+    std::sort(samples.begin(), samples.end());
+    double mean = 0.0;
+    for(size_t i = 0; i < samples.size(); ++i) mean += samples[i];
+    mean /= samples.size();
+
+    fprintf(out, "{\"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, "
+                  "\"p99\": %.4f, \"max\": %.4f}",
+            mean, samples.front(), percentile(samples, 50), percentile(samples, 90),
+            percentile(samples, 99), samples.back());
+  }
+
+  const char* draw_names(GLenum mode)
+  {
+    if(mode == GL_LINE) return "wireframe";
+    if(mode == GL_POINT) return "points";
+    return "fill";
+  }
+
+  void usage(const char* name)
+  {
+    std::cout<<"usage: "<<name<<" [options] mesh.in [mesh.in ...]\n"
+              <<"  -o results.json         output file (stdout)\n"
+              <<"  -r 640x360,1920x1080    resolutions (640x360,1280x720,1920x1080)\n"
+              <<"  -f frames               measured frames per run (120)\n"
+              <<"  --warmup frames         frames rendered before measuring (5)\n"
+              <<"  --threads n             worker threads, 0 = all cores (0)\n"
+              <<"  --shading 0..3          shading model, 2 = per-pixel Phong (1)\n"
+              <<"  --draw fill|wireframe|points (fill)\n"
+              <<"  --rasterizer scanline|halfspace|both (both)\n"
+              <<"  --pipeline buffered|streaming|both (both)\n"
+              <<"  --order-report          instead of timing, report the vertex cache\n"
+              <<"                          miss ratio and overdraw along the path with\n"
+              <<"                          and without the load time reordering\n"
+              <<"  --math                  instead of timing frames, time the math library\n"
+              <<"                          on the pipeline's operations against the out of\n"
+              <<"                          line version it replaced (meshes are optional)\n";
+  }
+
+  //ACMR with two usual cache sizes, and overdraw (fragments written per
+  //pixel covered) over the camera path at the first resolution, for both
+  //orders. meshes are parsed from the text files, as their cache only
+  //holds one of the orders
+  void order_report(const Options& opt, FILE* out)
+  {
+    fprintf(out, "  \"vertex_order\": [");
+    bool first_run = true;
+    for(size_t m = 0; m < opt.meshes.size(); ++m)
+    for(int reorder = 0; reorder < 2; ++reorder)
+    {
+      Mesh mesh;
+      mesh.set_reorder(reorder);
+      mesh.load_text(opt.meshes[m]);
+      if(mesh.mIndices.cols() == 0)
+      {
+        std::cerr<<"Could not load "<<opt.meshes[m]<<", skipping it"<<std::endl;
+        break;
+      }
+
+      glm::mat4 centered(1.0f);
+      mesh.transform_to_center(centered);
+
+      const Resolution& res = opt.resolutions[0];
+      AlmostGL almostgl(mesh, res.width, res.height, opt.threads);
+      Profiler profiler;
+      almostgl.set_profiler(&profiler);
+
+      GlobalParameters param;
+      default_parameters(param);
+      param.shading = opt.shading;
+      param.draw_mode = opt.draw_mode;
+
+      long long written = 0, covered = 0;
+      for(int i = 0; i < opt.frames; ++i)
+      {
+        camera_path(i, opt.frames, centered, param);
+        profiler.begin_frame();
+        almostgl.render(param);
+        written += almostgl.frame_counters().fragments_written;
+        covered += almostgl.frame_counters().pixels_covered;
+      }
+
+      int n_vertices = mesh.mPos.cols(), n_triangles = mesh.mIndices.cols();
+      float acmr16 = Reorder::acmr(mesh.mIndices.data(), n_triangles, n_vertices, 16);
+      float acmr32 = Reorder::acmr(mesh.mIndices.data(), n_triangles, n_vertices, 32);
+      double overdraw = covered ? (double)written / covered : 0.0;
+
+      fprintf(out, "%s\n    {\"mesh\": \"%s\", \"reordered\": %s, \"acmr_16\": %.4f, "
+                   "\"acmr_32\": %.4f, \"overdraw\": %.4f}",
+              first_run ? "" : ",", opt.meshes[m].c_str(), reorder ? "true" : "false",
+              acmr16, acmr32, overdraw);
+      first_run = false;
+
+      std::cerr<<opt.meshes[m]<<(reorder ? " reordered" : " as parsed")<<": ACMR "
+                <<acmr16<<" (16), "<<acmr32<<" (32), overdraw "<<overdraw<<std::endl;
+    }
+    fprintf(out, "\n  ]\n");
+  }
+
+  //the math library as it was before it moved to the header, to
+  //measure the new one against: every operation out of line (as it
+  //was for anyone outside matrix.cpp), products as loops summing
+  //into a zeroed temporary and differences as negate-then-add
+  namespace reference
+  {
+    #define REFERENCE_CALL __attribute__((noinline))
+
+    struct vec3 { float e[3]; };
+    struct vec4 { float e[4]; };
+    struct mat4 { float e[16]; };
+
+    REFERENCE_CALL vec3 add(const vec3& a, const vec3& b)
+    {
+      vec3 out = {{ a.e[0]+b.e[0], a.e[1]+b.e[1], a.e[2]+b.e[2] }};
+      return out;
+    }
+    REFERENCE_CALL vec3 negate(const vec3& a)
+    {
+      vec3 out = {{ -a.e[0], -a.e[1], -a.e[2] }};
+      return out;
+    }
+    REFERENCE_CALL vec3 sub(const vec3& a, const vec3& b) { return add(a, negate(b)); }
+    REFERENCE_CALL vec3 scale(const vec3& a, float k)
+    {
+      vec3 out = {{ a.e[0]*k, a.e[1]*k, a.e[2]*k }};
+      return out;
+    }
+    REFERENCE_CALL vec3 cross(const vec3& a, const vec3& b)
+    {
+      vec3 out = {{ a.e[1]*b.e[2]-a.e[2]*b.e[1],
+                    a.e[2]*b.e[0]-a.e[0]*b.e[2],
+                    a.e[0]*b.e[1]-a.e[1]*b.e[0] }};
+      return out;
+    }
+    REFERENCE_CALL vec4 mul(const mat4& m, const vec4& v)
+    {
+      vec4 out = {{ 0.0f, 0.0f, 0.0f, 0.0f }};
+      for(int i = 0; i < 4; ++i)
+        for(int k = 0; k < 4; ++k)
+          out.e[i] += m.e[i+4*k] * v.e[k];
+      return out;
+    }
+    REFERENCE_CALL mat4 mul(const mat4& a, const mat4& b)
+    {
+      mat4 out;
+      for(int i = 0; i < 16; ++i) out.e[i] = 0.0f;
+      for(int i = 0; i < 4; ++i)
+        for(int j = 0; j < 4; ++j)
+          for(int k = 0; k < 4; ++k)
+            out.e[i+4*j] += a.e[i+4*k] * b.e[k+4*j];
+      return out;
+    }
+  }
+
+  //nanoseconds per iteration of f(i), i in [0, n), best of a few runs
+  template<typename F>
+  double time_ns(int n, F f)
+  {
+    double best = 1e30;
+    for(int run = 0; run < 5; ++run)
+    {
+      auto start = std::chrono::steady_clock::now();
+      for(int i = 0; i < n; ++i) f(i);
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      best = std::min(best, ns / n);
+    }
+    return best;
+  }
+
+  //the math library against the reference on what the pipeline does
+  //with it: vertices through the viewport transform (binning, triangle
+  //setup), the screen space cross product of culling, one step of the
+  //scanline rasterizer's interpolation and the matrix products of every
+  //frame's setup. inputs are points of the meshes given, if any
+  void math_report(const Options& opt, FILE* out)
+  {
+    std::vector<float> points;
+    for(size_t m = 0; m < opt.meshes.size(); ++m)
+    {
+      Mesh mesh;
+      mesh.load_file(opt.meshes[m]);
+      points.insert(points.end(), mesh.mPos.data(), mesh.mPos.data() + mesh.mPos.size());
+    }
+    if(points.size() < 9)
+    {
+      //no meshes: a fixed pseudo random cloud
+      points.resize(3 << 16);
+      unsigned seed = 12345;
+      for(size_t i = 0; i < points.size(); ++i)
+      {
+        seed = seed*1664525u + 1013904223u;
+        points[i] = (seed >> 8) / 16777216.0f * 2.0f - 1.0f;
+      }
+    }
+    int n_points = points.size() / 3;
+    int n = std::max(n_points, 1 << 16);
+    auto p = [&](int i) { return &points[3*(i % n_points)]; };
+
+    mat4 viewport = mat4::viewport(1920, 1080);
+    mat4 proj = mat4::perspective(45.0f, 45.0f, 1.0f, 10.0f);
+    reference::mat4 ref_viewport, ref_proj;
+    memcpy(ref_viewport.e, viewport.data(), sizeof(ref_viewport.e));
+    memcpy(ref_proj.e, proj.data(), sizeof(ref_proj.e));
+
+    //results go here, so that nothing is optimized away. whole
+    //products are summed, so that no part of them is left out
+    volatile float sink = 0.0f;
+
+    struct Result { const char* name; double reference, inlined; };
+    std::vector<Result> results;
+
+    Result r = { "viewport * vec4", 0.0, 0.0 };
+    r.reference = time_ns(n, [&](int i) {
+      const float* v = p(i);
+      reference::vec4 in = {{ v[0], v[1], 1.0f, 1.0f }};
+      sink = reference::mul(ref_viewport, in).e[1];
+    });
+    r.inlined = time_ns(n, [&](int i) {
+      const float* v = p(i);
+      sink = (viewport*vec4(v[0], v[1], 1.0f, 1.0f))(1);
+    });
+    results.push_back(r);
+
+    r.name = "culling cross product";
+    r.reference = time_ns(n, [&](int i) {
+      const float *a = p(i), *b = p(i+1), *c = p(i+2);
+      reference::vec3 v0 = {{ a[0], a[1], 1.0f }}, v1 = {{ b[0], b[1], 1.0f }}, v2 = {{ c[0], c[1], 1.0f }};
+      sink = reference::cross(reference::sub(v1, v0), reference::sub(v2, v0)).e[2];
+    });
+    r.inlined = time_ns(n, [&](int i) {
+      const float *a = p(i), *b = p(i+1), *c = p(i+2);
+      vec3 v0(a[0], a[1], 1.0f), v1(b[0], b[1], 1.0f), v2(c[0], c[1], 1.0f);
+      sink = (v1-v0).cross(v2-v0)(2);
+    });
+    results.push_back(r);
+
+    r.name = "scanline interpolation step";
+    r.reference = time_ns(n, [&](int i) {
+      const float *a = p(i), *b = p(i+1);
+      reference::vec3 c0 = {{ a[0], a[1], a[2] }}, c1 = {{ b[0], b[1], b[2] }};
+      reference::vec3 c = reference::add(c0, reference::scale(reference::sub(c1, c0), 0.25f));
+      sink = reference::scale(c, 0.5f).e[0];
+    });
+    r.inlined = time_ns(n, [&](int i) {
+      const float *a = p(i), *b = p(i+1);
+      vec3 c0(a[0], a[1], a[2]), c1(b[0], b[1], b[2]);
+      vec3 c = c0 + (c1-c0) * 0.25f;
+      sink = (c * 0.5f)(0);
+    });
+    results.push_back(r);
+
+    r.name = "mat4 * mat4";
+    r.reference = time_ns(n, [&](int i) {
+      reference::mat4 m = ref_proj;
+      m.e[12] = p(i)[0];
+      reference::mat4 vp = reference::mul(ref_viewport, m);
+      float sum = 0.0f;
+      for(int k = 0; k < 16; ++k) sum += vp.e[k];
+      sink = sum;
+    });
+    r.inlined = time_ns(n, [&](int i) {
+      mat4 m = proj;
+      m(0,3) = p(i)[0];
+      mat4 vp = viewport*m;
+      float sum = 0.0f;
+      for(int k = 0; k < 16; ++k) sum += vp.data()[k];
+      sink = sum;
+    });
+    results.push_back(r);
+
+    fprintf(out, "  \"math_ns\": [");
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+      fprintf(out, "%s\n    {\"operation\": \"%s\", \"reference\": %.3f, \"inline\": %.3f, "
+                   "\"speedup\": %.2f}",
+              i ? "," : "", results[i].name, results[i].reference, results[i].inlined,
+              results[i].reference / results[i].inlined);
+      std::cerr<<results[i].name<<": "<<results[i].reference<<" ns -> "
+                <<results[i].inlined<<" ns"<<std::endl;
+    }
+    fprintf(out, "\n  ]\n");
+  }
+
+  bool parse_resolutions(const char* list, std::vector<Resolution>& out)
+  {
+    out.clear();
+    for(const char* p = list; *p; )
+    {
+      Resolution r;
+      int used;
+      if(sscanf(p, "%dx%d%n", &r.width, &r.height, &used) != 2 ||
+          r.width <= 0 || r.height <= 0) return false;
+      out.push_back(r);
+      p += used;
+      if(*p == ',') ++p;
+    }
+    return !out.empty();
+  }
+}
+
+int main(int argc, char** args)
+{
+  Options opt;
+  opt.frames = 120; opt.warmup = 5; opt.threads = 0; opt.shading = 1;
+  opt.draw_mode = GL_FILL;
+  opt.order_report = opt.math_report = false;
+  parse_resolutions("640x360,1280x720,1920x1080", opt.resolutions);
+  opt.rasterizers.push_back(0); opt.rasterizers.push_back(1);
+  opt.pipelines.push_back(false); opt.pipelines.push_back(true);
+
+  for(int i = 1; i < argc; ++i)
+  {
+    std::string arg = args[i];
+    bool has_value = i+1 < argc;
+
+    if(arg == "--help") { usage(args[0]); return 0; }
+    else if(arg == "-o" && has_value) opt.output = args[++i];
+    else if(arg == "-f" && has_value) opt.frames = atoi(args[++i]);
+    else if(arg == "--warmup" && has_value) opt.warmup = atoi(args[++i]);
+    else if(arg == "--threads" && has_value) opt.threads = atoi(args[++i]);
+    else if(arg == "--shading" && has_value) opt.shading = atoi(args[++i]);
+    else if(arg == "--draw" && has_value)
+    {
+      std::string d = args[++i];
+      if(d == "fill") opt.draw_mode = GL_FILL;
+      else if(d == "wireframe") opt.draw_mode = GL_LINE;
+      else if(d == "points") opt.draw_mode = GL_POINT;
+      else
+      {
+        std::cout<<"Bad draw mode "<<d<<std::endl;
+        return 1;
+      }
+    }
+    else if(arg == "--order-report") opt.order_report = true;
+    else if(arg == "--math") opt.math_report = true;
+    else if(arg == "-r" && has_value)
+    {
+      if(!parse_resolutions(args[++i], opt.resolutions))
+      {
+        std::cout<<"Bad resolution list "<<args[i]<<std::endl;
+        return 1;
+      }
+    }
+    else if(arg == "--rasterizer" && has_value)
+    {
+      std::string r = args[++i];
+      opt.rasterizers.clear();
+      if(r == "scanline" || r == "both") opt.rasterizers.push_back(0);
+      if(r == "halfspace" || r == "both") opt.rasterizers.push_back(1);
+      if(opt.rasterizers.empty())
+      {
+        std::cout<<"Bad rasterizer "<<r<<std::endl;
+        return 1;
+      }
+    }
+    else if(arg == "--pipeline" && has_value)
+    {
+      std::string p = args[++i];
+      opt.pipelines.clear();
+      if(p == "buffered" || p == "both") opt.pipelines.push_back(false);
+      if(p == "streaming" || p == "both") opt.pipelines.push_back(true);
+      if(opt.pipelines.empty())
+      {
+        std::cout<<"Bad pipeline "<<p<<std::endl;
+        return 1;
+      }
+    }
+    else if(arg[0] == '-')
+    {
+      std::cout<<"Bad option "<<arg<<std::endl;
+      usage(args[0]);
+      return 1;
+    }
+    else opt.meshes.push_back(arg);
+  }
+
+  if((opt.meshes.empty() && !opt.math_report) || opt.frames <= 0 || opt.warmup < 0)
+  {
+    usage(args[0]);
+    return 1;
+  }
+
+  FILE* out = opt.output.empty() ? stdout : fopen(opt.output.c_str(), "w");
+  if(!out)
+  {
+    std::cout<<"Could not open "<<opt.output<<std::endl;
+    return 1;
+  }
+
+  //what we know about the build, so that numbers coming from
+  //a debug build are not compared against an optimized one
+  #ifdef __OPTIMIZE__
+  const char* optimized = "true";
+  #else
+  const char* optimized = "false";
+  #endif
+  fprintf(out, "{\n  \"build\": {\"compiler\": \"%s\", \"optimized\": %s, \"date\": \"%s %s\"},\n",
+          __VERSION__, optimized, __DATE__, __TIME__);
+  fprintf(out, "  \"frames\": %d, \"warmup\": %d,\n", opt.frames, opt.warmup);
+
+  if(opt.math_report)
+  {
+    math_report(opt, out);
+    fprintf(out, "}\n");
+    if(out != stdout) fclose(out);
+    return 0;
+  }
+
+  if(opt.order_report)
+  {
+    order_report(opt, out);
+    fprintf(out, "}\n");
+    if(out != stdout) fclose(out);
+    return 0;
+  }
+
+  fprintf(out, "  \"runs\": [");
+
+  const char* rasterizer_names[] = { "scanline", "halfspace" };
+  bool first_run = true;
+
+  for(size_t m = 0; m < opt.meshes.size(); ++m)
+  {
+    Mesh mesh;
+    mesh.load_file(opt.meshes[m]);
+    if(mesh.mIndices.cols() == 0)
+    {
+      std::cerr<<"Could not load "<<opt.meshes[m]<<", skipping it"<<std::endl;
+      continue;
+    }
+
+    glm::mat4 centered(1.0f);
+    mesh.transform_to_center(centered);
+
+    for(size_t r = 0; r < opt.resolutions.size(); ++r)
+    {
+      const Resolution& res = opt.resolutions[r];
+      AlmostGL almostgl(mesh, res.width, res.height, opt.threads);
+      std::vector<unsigned char> staging(4*res.width*res.height);
+
+      for(size_t k = 0; k < opt.rasterizers.size(); ++k)
+      for(size_t p = 0; p < opt.pipelines.size(); ++p)
+      {
+        GlobalParameters param;
+        default_parameters(param);
+        param.rasterizer = opt.rasterizers[k];
+        param.streaming = opt.pipelines[p];
+        param.shading = opt.shading;
+        param.draw_mode = opt.draw_mode;
+
+        std::vector<double> samples[N_STAGES];
+        for(int i = -opt.warmup; i < opt.frames; ++i)
+        {
+          //warmup frames (i < 0) all use the first camera of the path
+          camera_path(std::max(i, 0), opt.frames, centered, param);
+          almostgl.render(param);
+
+          auto start = std::chrono::steady_clock::now();
+          memcpy(staging.data(), almostgl.color_buffer(), staging.size());
+          double upload = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+          if(i < 0) continue;
+          const StageTimes& t = almostgl.stage_times();
+          double stage[N_STAGES] = { t.vertex, t.clipping, t.projection, t.culling,
+                                      t.rasterization, t.shading, upload, t.total() + upload };
+          for(int s = 0; s < N_STAGES; ++s) samples[s].push_back(stage[s]);
+        }
+
+        fprintf(out, "%s\n    {\"mesh\": \"%s\", \"vertices\": %d, \"triangles\": %d,\n",
+                first_run ? "" : ",", opt.meshes[m].c_str(),
+                (int)mesh.mPos.cols(), (int)mesh.mIndices.cols());
+        fprintf(out, "     \"width\": %d, \"height\": %d, \"rasterizer\": \"%s\", \"pipeline\": \"%s\",\n"
+                     "     \"shading\": %d, \"draw\": \"%s\", \"threads\": %d,\n",
+                res.width, res.height, rasterizer_names[param.rasterizer],
+                param.streaming ? "streaming" : "buffered", param.shading,
+                draw_names(param.draw_mode), opt.threads);
+        fprintf(out, "     \"stages_ms\": {");
+        for(int s = 0; s < N_STAGES; ++s)
+        {
+          fprintf(out, "%s\n       \"%s\": ", s ? "," : "", STAGES[s]);
+          write_stats(out, samples[s]);
+        }
+        fprintf(out, "\n     }}");
+        first_run = false;
+
+        //short human readable summary on the side
+        std::sort(samples[N_STAGES-1].begin(), samples[N_STAGES-1].end());
+        std::cerr<<opt.meshes[m]<<" "<<res.width<<"x"<<res.height<<" "
+                  <<rasterizer_names[param.rasterizer]<<" "
+                  <<(param.streaming ? "streaming" : "buffered")<<": p50 "
+                  <<percentile(samples[N_STAGES-1], 50)<<" ms, p99 "
+                  <<percentile(samples[N_STAGES-1], 99)<<" ms"<<std::endl;
+      }
+    }
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+  if(out != stdout) fclose(out);
+
+  return 0;
+}
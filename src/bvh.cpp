@@ -0,0 +1,363 @@
+#include "../include/bvh.h"
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+//number of bins the centroids are sorted into along each
+//axis when looking for the split with the lowest SAH cost
+#define BVH_BINS 16
+
+//nodes with this many triangles or less are leaves. the tree is
+//walked once per frame for culling, not per ray, so there's no
+//point in going down to a few triangles: a leaf a bit larger
+//than a streaming batch's worth of triangles per thread is fine
+#define BVH_LEAF_SIZE 64
+
+namespace
+{
+  struct Box
+  {
+    float min[3], max[3];
+
+    Box()
+    {
+      for(int k = 0; k < 3; ++k) { min[k] = FLT_MAX; max[k] = -FLT_MAX; }
+    }
+
+    void grow(const float* p)
+    {
+      for(int k = 0; k < 3; ++k)
+      {
+        min[k] = std::min(min[k], p[k]);
+        max[k] = std::max(max[k], p[k]);
+      }
+    }
+
+    void grow(const Box& b)
+    {
+      for(int k = 0; k < 3; ++k)
+      {
+        min[k] = std::min(min[k], b.min[k]);
+        max[k] = std::max(max[k], b.max[k]);
+      }
+    }
+
+    float area() const
+    {
+      float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+      if(dx < 0.0f) return 0.0f;
+      return 2.0f * (dx*dy + dy*dz + dz*dx);
+    }
+  };
+
+  struct Bin
+  {
+    Box box;
+    int count;
+  };
+
+  //part of the triangle list still to be turned into a subtree
+  struct Task
+  {
+    int first, count;
+  };
+
+  int bin_of(float c, float c_min, float scale)
+  {
+    int b = (int)((c - c_min) * scale);
+    return std::max(0, std::min(BVH_BINS-1, b));
+  }
+
+  const NormalCone NO_CONE = { {0.0f, 0.0f, 1.0f}, 2.0f };
+
+  //cone around the normalized sum of the normals of a leaf, wide
+  //enough to hold all of them. degenerate triangles have no normal,
+  //but they still show up in wireframe (as lines), so a leaf with
+  //one of them never gets culled
+  NormalCone leaf_cone(const float* pos, const uint32_t* indices, int first, int end)
+  {
+    std::vector<float> normals;
+    float sum[3] = {0.0f, 0.0f, 0.0f};
+    for(int t = first; t < end; ++t)
+    {
+      const float *a = &pos[3*indices[3*t]], *b = &pos[3*indices[3*t+1]], *c = &pos[3*indices[3*t+2]];
+      float u[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+      float v[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+      float n[3] = { u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2], u[0]*v[1] - u[1]*v[0] };
+      float l = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      if(l == 0.0f) return NO_CONE;
+      for(int k = 0; k < 3; ++k) { normals.push_back(n[k] / l); sum[k] += n[k] / l; }
+    }
+
+    float l = sqrtf(sum[0]*sum[0] + sum[1]*sum[1] + sum[2]*sum[2]);
+    if(l == 0.0f) return NO_CONE;
+
+    NormalCone cone;
+    float min_cos = 1.0f;
+    for(int k = 0; k < 3; ++k) cone.axis[k] = sum[k] / l;
+    for(size_t i = 0; i < normals.size(); i += 3)
+      min_cos = std::min(min_cos, cone.axis[0]*normals[i] + cone.axis[1]*normals[i+1] + cone.axis[2]*normals[i+2]);
+
+    cone.sin_spread = min_cos > 0.0f ? sqrtf(1.0f - min_cos*min_cos) : 2.0f;
+    return cone;
+  }
+
+  //cone holding the cones of both children of a node
+  NormalCone merge_cones(const NormalCone& a, const NormalCone& b)
+  {
+    if(a.sin_spread > 1.0f || b.sin_spread > 1.0f) return NO_CONE;
+
+    float sum[3] = { a.axis[0] + b.axis[0], a.axis[1] + b.axis[1], a.axis[2] + b.axis[2] };
+    float l = sqrtf(sum[0]*sum[0] + sum[1]*sum[1] + sum[2]*sum[2]);
+    if(l == 0.0f) return NO_CONE;
+
+    NormalCone cone;
+    for(int k = 0; k < 3; ++k) cone.axis[k] = sum[k] / l;
+
+    //the new spread is the largest angle from the axis to a child
+    //axis plus the spread of that child
+    float spread = 0.0f;
+    const NormalCone* child[2] = { &a, &b };
+    for(int i = 0; i < 2; ++i)
+    {
+      float c = cone.axis[0]*child[i]->axis[0] + cone.axis[1]*child[i]->axis[1] + cone.axis[2]*child[i]->axis[2];
+      spread = std::max(spread, acosf(std::max(-1.0f, std::min(1.0f, c))) + asinf(child[i]->sin_spread));
+    }
+
+    cone.sin_spread = spread < 0.5f*3.14159265f ? sinf(spread) : 2.0f;
+    return cone;
+  }
+}
+
+void BVH::build(const float* pos, uint32_t* indices, int n_triangles,
+                std::vector<BVHNode>& nodes, std::vector<NormalCone>& cones)
+{
+  nodes.clear(); cones.clear();
+  if(n_triangles == 0) return;
+
+  //bounds and centroid of every triangle
+  std::vector<Box> bounds(n_triangles);
+  std::vector<float> centroid(3*n_triangles);
+  std::vector<uint32_t> order(n_triangles);
+  for(int t = 0; t < n_triangles; ++t)
+  {
+    for(int v = 0; v < 3; ++v) bounds[t].grow(&pos[3*indices[3*t+v]]);
+    for(int k = 0; k < 3; ++k) centroid[3*t+k] = 0.5f * (bounds[t].min[k] + bounds[t].max[k]);
+    order[t] = t;
+  }
+
+  //subtrees are built depth first with an explicit stack (SAH may
+  //split very unevenly, so recursion could go pretty deep). the right
+  //half is pushed first, so the left child always comes right after
+  //its parent. skips are filled in once all the nodes are there
+  std::vector<bool> leaf;
+  std::vector<Task> stack(1);
+  stack[0].first = 0; stack[0].count = n_triangles;
+
+  while(!stack.empty())
+  {
+    Task task = stack.back();
+    stack.pop_back();
+    uint32_t* tris = &order[task.first];
+
+    Box box, centroids;
+    for(int i = 0; i < task.count; ++i)
+    {
+      box.grow(bounds[tris[i]]);
+      centroids.grow(&centroid[3*tris[i]]);
+    }
+
+    BVHNode node;
+    for(int k = 0; k < 3; ++k) { node.min[k] = box.min[k]; node.max[k] = box.max[k]; }
+    node.first = task.first;
+    node.skip = 0;
+    nodes.push_back(node);
+
+    bool is_leaf = task.count <= BVH_LEAF_SIZE;
+    leaf.push_back(is_leaf);
+    if(is_leaf) continue;
+
+    //SAH: the cost of a split is the number of triangles on each side
+    //weighted by the area of its box. the sweep from the right gets
+    //the right side of every split plane between two bins
+    float best_cost = FLT_MAX;
+    int best_axis = -1, best_split = 0;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+      float extent = centroids.max[axis] - centroids.min[axis];
+      if(extent <= 0.0f) continue;
+      float scale = BVH_BINS / extent;
+
+      Bin bins[BVH_BINS];
+      for(int b = 0; b < BVH_BINS; ++b) bins[b].count = 0;
+      for(int i = 0; i < task.count; ++i)
+      {
+        Bin& bin = bins[bin_of(centroid[3*tris[i]+axis], centroids.min[axis], scale)];
+        bin.box.grow(bounds[tris[i]]);
+        ++bin.count;
+      }
+
+      float right_area[BVH_BINS];
+      int right_count[BVH_BINS];
+      Box acc;
+      int count = 0;
+      for(int b = BVH_BINS-1; b > 0; --b)
+      {
+        acc.grow(bins[b].box); count += bins[b].count;
+        right_area[b] = acc.area(); right_count[b] = count;
+      }
+
+      acc = Box(); count = 0;
+      for(int b = 0; b < BVH_BINS-1; ++b)
+      {
+        acc.grow(bins[b].box); count += bins[b].count;
+        if(count == 0 || right_count[b+1] == 0) continue;
+
+        float cost = count*acc.area() + right_count[b+1]*right_area[b+1];
+        if(cost < best_cost)
+        {
+          best_cost = cost; best_axis = axis; best_split = b;
+        }
+      }
+    }
+
+    //all centroids in the same spot: any split is as good as another
+    int mid = task.count / 2;
+    if(best_axis >= 0)
+    {
+      float c_min = centroids.min[best_axis];
+      float scale = BVH_BINS / (centroids.max[best_axis] - c_min);
+      mid = std::partition(tris, tris + task.count, [&](uint32_t t) {
+        return bin_of(centroid[3*t+best_axis], c_min, scale) <= best_split;
+      }) - tris;
+    }
+
+    Task left = { task.first, mid }, right = { task.first + mid, task.count - mid };
+    stack.push_back(right);
+    stack.push_back(left);
+  }
+
+  //the right child of an interior node is where its left child skips
+  //to, and the node skips to wherever its right child does. both come
+  //after the node, so going backwards they're always ready
+  for(int i = (int)nodes.size()-1; i >= 0; --i)
+    nodes[i].skip = leaf[i] ? i+1 : nodes[nodes[i+1].skip].skip;
+
+  std::vector<uint32_t> unsorted(indices, indices + 3*n_triangles);
+  for(int t = 0; t < n_triangles; ++t)
+    for(int v = 0; v < 3; ++v) indices[3*t+v] = unsorted[3*order[t]+v];
+
+  //normal cones, bottom up like the skips
+  cones.resize(nodes.size());
+  for(int i = (int)nodes.size()-1; i >= 0; --i)
+  {
+    if(leaf[i])
+    {
+      int end = i+1 < (int)nodes.size() ? nodes[i+1].first : n_triangles;
+      cones[i] = leaf_cone(pos, indices, nodes[i].first, end);
+    }
+    else cones[i] = merge_cones(cones[i+1], cones[nodes[i+1].skip]);
+  }
+}
+
+void BVH::to_model_space(const float* model, const float* eye, bool front_ccw,
+                         float* model_eye, float& front)
+{
+  //model is affine: solve A x = eye - t for the 3x3 part A by Cramer's
+  //rule. a negative determinant means A mirrors, which turns the
+  //windings of the model around
+  const float* m = model;
+  float d[3] = { eye[0] - m[12], eye[1] - m[13], eye[2] - m[14] };
+  float det = m[0]*(m[5]*m[10] - m[9]*m[6]) - m[4]*(m[1]*m[10] - m[9]*m[2]) + m[8]*(m[1]*m[6] - m[5]*m[2]);
+
+  model_eye[0] = (d[0]*(m[5]*m[10] - m[9]*m[6]) - m[4]*(d[1]*m[10] - m[9]*d[2]) + m[8]*(d[1]*m[6] - m[5]*d[2])) / det;
+  model_eye[1] = (m[0]*(d[1]*m[10] - m[9]*d[2]) - d[0]*(m[1]*m[10] - m[9]*m[2]) + m[8]*(m[1]*d[2] - d[1]*m[2])) / det;
+  model_eye[2] = (m[0]*(m[5]*d[2] - d[1]*m[6]) - m[4]*(m[1]*d[2] - d[1]*m[2]) + d[0]*(m[1]*m[6] - m[5]*m[2])) / det;
+
+  front = (front_ccw == (det > 0.0f)) ? 1.0f : -1.0f;
+}
+
+void BVH::cull(const BVHNode* nodes, const NormalCone* cones, int n_nodes, int n_triangles,
+               const float* mvp, const float* eye, float front,
+               std::vector<IndexRange>& visible, std::vector<uint32_t>* taken)
+{
+  visible.clear();
+  if(taken) taken->clear();
+
+  //frustum planes in model space (Gribb & Hartmann): a point p is
+  //inside -w <= x <= w when (row3 + row0).p >= 0 and (row3 - row0).p
+  //>= 0, and the same goes for y and z. they're the planes the
+  //pipeline clips against, so a box outside of one of them only
+  //has triangles that clipping would have thrown away
+  float planes[6][4];
+  for(int p = 0; p < 6 && mvp; ++p)
+  {
+    float sign = (p % 2) ? -1.0f : 1.0f;
+    for(int c = 0; c < 4; ++c) planes[p][c] = mvp[3+4*c] + sign*mvp[p/2+4*c];
+  }
+
+  //nodes before inside_end are inside the frustum, as they're
+  //in the subtree of a node that was found to be inside it
+  uint32_t inside_end = mvp ? 0 : n_nodes;
+  for(int i = 0; i < n_nodes; )
+  {
+    const BVHNode& node = nodes[i];
+
+    //the corner of the box farthest along the plane normal tells
+    //whether the box is fully outside, the nearest one whether it's
+    //fully inside
+    bool outside = false, inside = true;
+    for(int p = 0; p < 6 && !outside && (uint32_t)i >= inside_end; ++p)
+    {
+      float far = planes[p][3], near = planes[p][3];
+      for(int k = 0; k < 3; ++k)
+      {
+        float a = planes[p][k]*node.min[k], b = planes[p][k]*node.max[k];
+        far += std::max(a, b); near += std::min(a, b);
+      }
+      outside = far < 0.0f;
+      inside = inside && near >= 0.0f;
+    }
+
+    if(outside) { i = node.skip; continue; }
+    if(inside) inside_end = std::max(inside_end, node.skip);
+
+    //backfacing: every point p of a triangle with normal n faces away
+    //when (p - eye).n > 0. over the bounding sphere of the box (center
+    //c, radius r) that holds if the angle between axis and c - eye, plus
+    //the one the sphere subtends, plus the spread stay under 90 degrees.
+    //this gives the test below, with d = |c - eye|
+    if(cones && cones[i].sin_spread <= 1.0f)
+    {
+      const NormalCone& cone = cones[i];
+      float to_center[3], r2 = 0.0f, d2 = 0.0f, along = 0.0f;
+      for(int k = 0; k < 3; ++k)
+      {
+        float half = 0.5f*(node.max[k] - node.min[k]);
+        to_center[k] = node.min[k] + half - eye[k];
+        r2 += half*half; d2 += to_center[k]*to_center[k];
+        along += front*cone.axis[k]*to_center[k];
+      }
+
+      float cos_spread = sqrtf(1.0f - cone.sin_spread*cone.sin_spread);
+      if(along > cone.sin_spread*sqrtf(d2) + cos_spread*sqrtf(r2)) { i = node.skip; continue; }
+    }
+
+    //interior nodes partially in the frustum are opened up, and
+    //so are the ones inside when their children may be backfacing
+    bool is_leaf = node.skip == (uint32_t)i+1;
+    if(!is_leaf && (!inside || cones)) { ++i; continue; }
+
+    uint32_t end = (int)node.skip < n_nodes ? nodes[node.skip].first : n_triangles;
+    if(!visible.empty() && visible.back().first + visible.back().count == node.first)
+      visible.back().count += end - node.first;
+    else
+    {
+      IndexRange r = { node.first, end - node.first };
+      visible.push_back(r);
+    }
+    if(taken) taken->push_back(i);
+
+    i = node.skip;
+  }
+}
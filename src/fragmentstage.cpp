@@ -0,0 +1,266 @@
+#include "../include/fragmentstage.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRAGMENTSTAGE_X86
+#include <immintrin.h>
+#endif
+
+//ambient term, same as the one of the Gouraud shading models
+#define AMBIENT 0.2f
+
+//element (i,j) of a column-major 4x4 matrix
+#define M(m,i,j) (m[(i)+4*(j)])
+
+namespace
+{
+  //world space position of pixel (x,y) with depth z. pixel
+  //centers are mapped back through the viewport transform
+  inline void unproject(const FragmentUniforms& u, const GBuffer& g,
+                        float x, float y, float z, float p[3])
+  {
+    float nx = 2.0f * (x + 0.5f) / g.width - 1.0f;
+    float ny = 1.0f - 2.0f * (y + 0.5f) / g.height;
+
+    float h[4];
+    for(int r = 0; r < 4; ++r)
+      h[r] = M(u.inv_vp,r,0)*nx + M(u.inv_vp,r,1)*ny + M(u.inv_vp,r,2)*z + M(u.inv_vp,r,3);
+    for(int r = 0; r < 3; ++r) p[r] = h[r] / h[3];
+  }
+
+  inline void normalize(float v[3])
+  {
+    float n2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+    float inv = n2 > 0.0f ? 1.0f / sqrtf(n2) : 0.0f;
+    for(int i = 0; i < 3; ++i) v[i] *= inv;
+  }
+
+  void shade_scalar(const GBuffer& g, const FragmentUniforms& u,
+                    int row, int first, int last, unsigned char* color)
+  {
+    for(int x = first; x < last; ++x)
+    {
+      int i = row*g.width + x;
+      unsigned char* o = &color[4*i];
+      if(g.depth[i] >= 2.0f)
+      {
+        o[0] = o[1] = o[2] = o[3] = 0;
+        continue;
+      }
+
+      //undo the octahedral mapping (see encode_normal)
+      float n[3];
+      n[0] = (int16_t)(g.normal[i] & 0xFFFF) / 32767.0f;
+      n[1] = (int16_t)(g.normal[i] >> 16) / 32767.0f;
+      n[2] = 1.0f - fabsf(n[0]) - fabsf(n[1]);
+      if(n[2] < 0.0f)
+      {
+        float t = -n[2];
+        n[0] += n[0] >= 0.0f ? -t : t;
+        n[1] += n[1] >= 0.0f ? -t : t;
+      }
+      normalize(n);
+
+      float p[3], l[3], e[3], h[3];
+      unproject(u, g, (float)x, (float)row, g.depth[i], p);
+      for(int k = 0; k < 3; ++k) { l[k] = u.light[k] - p[k]; e[k] = u.eye[k] - p[k]; }
+      normalize(l); normalize(e);
+      for(int k = 0; k < 3; ++k) h[k] = l[k] + e[k];
+      normalize(h);
+
+      float diff = std::max(0.0f, n[0]*l[0] + n[1]*l[1] + n[2]*l[2]);
+      float spec = std::max(0.0f, n[0]*h[0] + n[1]*h[1] + n[2]*h[2]);
+      spec = spec > 0.0f ? powf(spec, u.shininess[g.material[i]]) : 0.0f;
+
+      for(int k = 0; k < 3; ++k)
+        o[k] = (unsigned char)std::min(255, (int)((u.model_color[k] * (AMBIENT + diff) + spec) * 255.0f));
+      o[3] = 255;
+    }
+  }
+
+#ifdef FRAGMENTSTAGE_X86
+  //---------------------------------
+  //--------------- SSE -------------
+  //---------------------------------
+  //log2 and exp2 approximations (errors around 1e-5 and 1e-7),
+  //which is what pow() boils down to once vectorized
+
+  //x > 0. splits x into 2^e * m with m in [1,2)
+  //and approximates log2(m) with a polynomial
+  inline __m128 sse_log2(__m128 x)
+  {
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF))),
+                         _mm_set1_ps(1.0f));
+
+    //least squares fit of log2(m)/(m-1) over [1,2)
+    __m128 t = _mm_sub_ps(m, _mm_set1_ps(1.0f));
+    __m128 p = _mm_set1_ps(-0.0345952094f);
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.14643361f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.303389664f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.469301686f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.72044237f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.44268325f));
+    return _mm_add_ps(_mm_mul_ps(p, t), e);
+  }
+
+  //x <= 0. splits x into integer and fractional
+  //parts and approximates 2^f with a polynomial
+  inline __m128 sse_exp2(__m128 x)
+  {
+    x = _mm_max_ps(x, _mm_set1_ps(-100.0f));
+    __m128i xi = _mm_cvttps_epi32(x);
+    __m128 i = _mm_cvtepi32_ps(xi);
+    //truncation rounds towards zero, we want floor
+    __m128 fix = _mm_and_ps(_mm_cmpgt_ps(i, x), _mm_set1_ps(1.0f));
+    i = _mm_sub_ps(i, fix);
+    __m128 f = _mm_sub_ps(x, i);
+
+    //least squares fit of 2^f over [0,1)
+    __m128 p = _mm_set1_ps(0.00189510716f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00894621499f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0558632824f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.24014077f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.69315462f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.999999896f));
+
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(i), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+  }
+
+  inline __m128 sse_rsqrt(__m128 n2)
+  {
+    //zero length vectors stay zero
+    __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(n2));
+    return _mm_and_ps(inv, _mm_cmpgt_ps(n2, _mm_setzero_ps()));
+  }
+
+  inline __m128 sse_dot(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+  {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+  }
+
+  inline __m128 sse_abs(__m128 x)
+  {
+    return _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF)));
+  }
+
+  int shade_sse(const GBuffer& g, const FragmentUniforms& u,
+                int row, int first, int last, unsigned char* color)
+  {
+    const float* m = u.inv_vp;
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000));
+
+    //ndc y is the same for the whole row, x grows by 2/width per pixel
+    float ny = 1.0f - 2.0f * (row + 0.5f) / g.height;
+    float dx = 2.0f / g.width;
+
+    int x = first;
+    for(; x + 4 <= last; x += 4)
+    {
+      int i = row*g.width + x;
+      __m128 z = _mm_loadu_ps(&g.depth[i]);
+      __m128 covered = _mm_cmplt_ps(z, _mm_set1_ps(2.0f));
+      int cover = _mm_movemask_ps(covered);
+      if(cover == 0)
+      {
+        _mm_storeu_si128((__m128i*)&color[4*i], _mm_setzero_si128());
+        continue;
+      }
+
+      //octahedral decoding: sign extend the two 16 bit halves
+      __m128i packed = _mm_loadu_si128((const __m128i*)&g.normal[i]);
+      __m128 scale = _mm_set1_ps(1.0f / 32767.0f);
+      __m128 nx = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(packed, 16), 16)), scale);
+      __m128 ny_ = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(packed, 16)), scale);
+      __m128 nz = _mm_sub_ps(_mm_sub_ps(one, sse_abs(nx)), sse_abs(ny_));
+      __m128 t = _mm_max_ps(zero, _mm_sub_ps(zero, nz));
+      nx = _mm_sub_ps(nx, _mm_or_ps(t, _mm_and_ps(nx, sign)));
+      ny_ = _mm_sub_ps(ny_, _mm_or_ps(t, _mm_and_ps(ny_, sign)));
+      __m128 n_inv = sse_rsqrt(sse_dot(nx, ny_, nz, nx, ny_, nz));
+      nx = _mm_mul_ps(nx, n_inv); ny_ = _mm_mul_ps(ny_, n_inv); nz = _mm_mul_ps(nz, n_inv);
+
+      //back to world space
+      __m128 ndc_x = _mm_set_ps((x + 3.5f) * dx - 1.0f, (x + 2.5f) * dx - 1.0f,
+                                (x + 1.5f) * dx - 1.0f, (x + 0.5f) * dx - 1.0f);
+      __m128 h[4];
+      for(int r = 0; r < 4; ++r)
+        h[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(M(m,r,0)), ndc_x),
+                                     _mm_set1_ps(M(m,r,1)*ny + M(m,r,3))),
+                          _mm_mul_ps(_mm_set1_ps(M(m,r,2)), z));
+      __m128 w_inv = _mm_div_ps(one, h[3]);
+      __m128 px = _mm_mul_ps(h[0], w_inv), py = _mm_mul_ps(h[1], w_inv), pz = _mm_mul_ps(h[2], w_inv);
+
+      __m128 lx = _mm_sub_ps(_mm_set1_ps(u.light[0]), px);
+      __m128 ly = _mm_sub_ps(_mm_set1_ps(u.light[1]), py);
+      __m128 lz = _mm_sub_ps(_mm_set1_ps(u.light[2]), pz);
+      __m128 l_inv = sse_rsqrt(sse_dot(lx, ly, lz, lx, ly, lz));
+      lx = _mm_mul_ps(lx, l_inv); ly = _mm_mul_ps(ly, l_inv); lz = _mm_mul_ps(lz, l_inv);
+
+      __m128 ex = _mm_sub_ps(_mm_set1_ps(u.eye[0]), px);
+      __m128 ey = _mm_sub_ps(_mm_set1_ps(u.eye[1]), py);
+      __m128 ez = _mm_sub_ps(_mm_set1_ps(u.eye[2]), pz);
+      __m128 e_inv = sse_rsqrt(sse_dot(ex, ey, ez, ex, ey, ez));
+      ex = _mm_mul_ps(ex, e_inv); ey = _mm_mul_ps(ey, e_inv); ez = _mm_mul_ps(ez, e_inv);
+
+      __m128 hx = _mm_add_ps(lx, ex), hy = _mm_add_ps(ly, ey), hz = _mm_add_ps(lz, ez);
+      __m128 h_inv = sse_rsqrt(sse_dot(hx, hy, hz, hx, hy, hz));
+      hx = _mm_mul_ps(hx, h_inv); hy = _mm_mul_ps(hy, h_inv); hz = _mm_mul_ps(hz, h_inv);
+
+      __m128 diff = _mm_max_ps(zero, sse_dot(nx, ny_, nz, lx, ly, lz));
+      __m128 s = sse_dot(nx, ny_, nz, hx, hy, hz);
+
+      //spec = s^shininess, gathered from the material table. nothing
+      //was drawn on uncovered pixels, so their material is garbage
+      //and they take the first one instead
+      const uint16_t* mat = &g.material[i];
+      int m0 = cover & 1 ? mat[0] : 0, m1 = cover & 2 ? mat[1] : 0;
+      int m2 = cover & 4 ? mat[2] : 0, m3 = cover & 8 ? mat[3] : 0;
+      __m128 shininess = _mm_set_ps(u.shininess[m3], u.shininess[m2],
+                                    u.shininess[m1], u.shininess[m0]);
+      __m128 lit = _mm_cmpgt_ps(s, zero);
+      __m128 spec = sse_exp2(_mm_mul_ps(shininess, sse_log2(_mm_max_ps(s, _mm_set1_ps(1e-30f)))));
+      spec = _mm_and_ps(spec, lit);
+
+      //RGBA bytes, zero (the clear color) where nothing was drawn
+      __m128 k = _mm_add_ps(_mm_set1_ps(AMBIENT), diff);
+      __m128 limit = _mm_set1_ps(255.0f);
+      __m128 r = _mm_min_ps(limit, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(u.model_color[0]), k), spec), limit));
+      __m128 gg = _mm_min_ps(limit, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(u.model_color[1]), k), spec), limit));
+      __m128 b = _mm_min_ps(limit, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(u.model_color[2]), k), spec), limit));
+
+      __m128i rgba = _mm_or_si128(
+          _mm_or_si128(_mm_cvttps_epi32(r), _mm_slli_epi32(_mm_cvttps_epi32(gg), 8)),
+          _mm_or_si128(_mm_slli_epi32(_mm_cvttps_epi32(b), 16), _mm_set1_epi32((int)0xFF000000)));
+      rgba = _mm_and_si128(rgba, _mm_castps_si128(covered));
+      _mm_storeu_si128((__m128i*)&color[4*i], rgba);
+    }
+
+    return x;
+  }
+#endif
+}
+
+namespace FragmentStage
+{
+  void shade(VertexStage::Kernel k,
+              const GBuffer& g,
+              const FragmentUniforms& u,
+              int first_row, int last_row,
+              unsigned char* color)
+  {
+    //4 pixels at a time with SSE (also used when AVX2 is around,
+    //the gather from the material table takes most of the gain of
+    //wider registers), the scalar code finishes each row
+    for(int row = first_row; row < last_row; ++row)
+    {
+      int first = 0;
+#ifdef FRAGMENTSTAGE_X86
+      if(k != VertexStage::SCALAR) first = shade_sse(g, u, row, 0, g.width, color);
+#endif
+      shade_scalar(g, u, row, first, g.width, color);
+    }
+  }
+}
@@ -0,0 +1,162 @@
+#include "../include/frameupload.h"
+#include <cstring>
+#include <algorithm>
+
+FrameUpload::FrameUpload(RenderThread& renderer)
+  : renderer(renderer), texture_width(0), texture_height(0),
+    window_width(0), window_height(0), frame_width(0), frame_height(0),
+    pbo(0), stream(0), mapped(nullptr), slot_size(0),
+    shown(nullptr), shown_number(0), fence(0)
+{
+  glGenTextures(1, &texture);
+
+  //glBufferStorage is core since 4.4
+  GLint major = 0, minor = 0;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  glGetIntegerv(GL_MINOR_VERSION, &minor);
+  persistent = major > 4 || (major == 4 && minor >= 4);
+
+  GLint n_extensions = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &n_extensions);
+  for(int i = 0; i < n_extensions && !persistent; ++i)
+  {
+    const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+    persistent = name && strcmp(name, "GL_ARB_buffer_storage") == 0;
+  }
+}
+
+FrameUpload::~FrameUpload()
+{
+  //the render thread must be done with the mapping before it goes
+  if(mapped) renderer.set_frame_memory(nullptr, 0);
+  if(fence) glDeleteSync(fence);
+  glDeleteBuffers(1, &pbo);
+  glDeleteBuffers(1, &stream);
+  glDeleteTextures(1, &texture);
+}
+
+void FrameUpload::grow(size_t size)
+{
+  //windows are resized a bit at a time, and every growth
+  //waits for the frame being rendered, so leave some room
+  size = std::max(size, slot_size + slot_size/2);
+
+  //client storage: the CPU writes every pixel of every frame,
+  //so the buffer is better off in system memory
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  GLuint new_pbo;
+  glGenBuffers(1, &new_pbo);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, new_pbo);
+  glBufferStorage(GL_PIXEL_UNPACK_BUFFER, 3*size, nullptr, flags | GL_CLIENT_STORAGE_BIT);
+  GLubyte* new_mapped = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, 3*size, flags);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  if(!new_mapped)
+  {
+    glDeleteBuffers(1, &new_pbo);
+    persistent = false;
+    if(!mapped) return;
+    renderer.set_frame_memory(nullptr, 0);
+  }
+  else
+  {
+    GLubyte* slots[3] = { new_mapped, new_mapped + size, new_mapped + 2*size };
+    renderer.set_frame_memory(slots, size);
+  }
+
+  //nobody renders into the old buffer anymore, and the GPU holds
+  //on to it until the copies from it are done. the frames in it
+  //are gone, but the texture keeps the last one
+  glDeleteBuffers(1, &pbo);
+  pbo = new_mapped ? new_pbo : 0;
+  mapped = new_mapped;
+  slot_size = new_mapped ? size : 0;
+
+  if(fence) glDeleteSync(fence);
+  fence = 0;
+  shown = nullptr;
+  shown_number = 0;
+}
+
+const RenderedFrame* FrameUpload::update(int width, int height)
+{
+  window_width = width; window_height = height;
+  size_t size = 4*(size_t)width*height;
+  if(persistent && size > slot_size) grow(size);
+
+  //the frame shown can only go back to the render thread once
+  //the GPU copied it. if it didn't yet, we keep it for now
+  if(fence)
+  {
+    if(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+      return shown;
+    glDeleteSync(fence);
+    fence = 0;
+  }
+
+  const RenderedFrame* frame = renderer.latest();
+  if(frame && frame->number != shown_number)
+  {
+    upload(*frame);
+    shown_number = frame->number;
+  }
+  return shown = frame;
+}
+
+void FrameUpload::upload(const RenderedFrame& frame)
+{
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+
+  //frames may be smaller than the window, and then go to the
+  //corner of the texture, so it only changes when one doesn't fit
+  //(which frames rendered before a resize may not). the blit scales
+  //them up, filtering between texels
+  if(frame.width > texture_width || frame.height > texture_height)
+  {
+    int width = std::max(frame.width, window_width);
+    int height = std::max(frame.height, window_height);
+
+    glDeleteTextures(1, &texture);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+
+    //WARNING: IF WE DON'T SET THIS IT WON'T WORK!
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    texture_width = width; texture_height = height;
+  }
+  frame_width = frame.width; frame_height = frame.height;
+
+  //WARNING: be careful with RGB pixel data
+  //as OpenGL expects 4-byte aligned data
+  //https://www.khronos.org/opengl/wiki/Common_Mistakes#Texture_upload_and_pixel_reads
+  size_t size = 4*(size_t)frame.width*frame.height;
+  if(frame.slot >= 0)
+  {
+    //the pixels are already in the buffer, AlmostGL put them there
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width, frame.height,
+                    GL_RGBA, GL_UNSIGNED_BYTE, (const void*)(frame.slot*slot_size));
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+  else
+  {
+    //a fresh store every time, so the driver never waits
+    //for the copy of the previous frame to overwrite it
+    if(!stream) glGenBuffers(1, &stream);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    void* pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if(pixels)
+    {
+      memcpy(pixels, frame.color, size);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width, frame.height,
+                      GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
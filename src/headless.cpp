@@ -0,0 +1,261 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "../include/mesh.h"
+#include "../include/param.h"
+#include "../include/almostgl.h"
+#include "../include/image.h"
+
+//Headless renderer: runs the AlmostGL pipeline on a model with no
+//window, no GL context and no GPU, and writes the frames to disk.
+//Built as its own executable, which doesn't link nanogui, GLFW nor GLEW.
+
+namespace
+{
+  struct Options
+  {
+    std::string model, output, trace;
+    int width, height, frames, threads;
+    float orbit;
+  };
+
+  void usage(const char* name)
+  {
+    std::cout<<"usage: "<<name<<" model.in [options]\n"
+              <<"  -o out.png|out.ppm      output file; with several frames, a\n"
+              <<"                          frame number is added (out_0000.png)\n"
+              <<"  -w width -h height      resolution (960x540)\n"
+              <<"  -n frames               number of frames to render (1)\n"
+              <<"  -c camera.txt           read options from a file, one\n"
+              <<"                          \"option values\" per line\n"
+              <<"  --orbit degrees         rotate the model this much per frame\n"
+              <<"  --threads n             worker threads, 0 = all cores (0)\n"
+              <<"  --trace trace.json      write per stage timings as a Chrome trace\n"
+              <<"camera, light and pipeline (same names in camera files):\n"
+              <<"  --eye x y z  --look_dir x y z  --up x y z\n"
+              <<"  --near n  --far f  --fovy deg  --fovx deg\n"
+              <<"  --light x y z  --color r g b\n"
+              <<"  --shading 0..3  --wireframe  --points  --cw\n"
+              <<"  --rasterizer scanline|halfspace  --serial  --no-hiz  --buffered\n"
+              <<"  --no-frustum-culling  --no-cluster-culling  --no-lod\n";
+  }
+
+  //applies option args[i] (without dashes) with its values, returning
+  //how many arguments it consumed or -1 if it doesn't make sense
+  int apply(const std::vector<std::string>& args, size_t i,
+            Options& opt, GlobalParameters& param)
+  {
+    const std::string& key = args[i];
+    size_t left = args.size() - i - 1;
+
+    #define FLOATS(n) if(left < n) return -1; float f[3]; \
+                      for(int k = 0; k < n; ++k) f[k] = atof(args[i+1+k].c_str());
+    #define INT() if(left < 1) return -1; int v = atoi(args[i+1].c_str());
+
+    if(key == "o") { if(left < 1) return -1; opt.output = args[i+1]; return 2; }
+    if(key == "w") { INT(); opt.width = v; return 2; }
+    if(key == "h") { INT(); opt.height = v; return 2; }
+    if(key == "n") { INT(); opt.frames = v; return 2; }
+    if(key == "threads") { INT(); opt.threads = v; return 2; }
+    if(key == "trace") { if(left < 1) return -1; opt.trace = args[i+1]; return 2; }
+    if(key == "orbit") { FLOATS(1); opt.orbit = f[0]; return 2; }
+
+    if(key == "eye") { FLOATS(3); param.cam.eye = glm::vec3(f[0], f[1], f[2]); return 4; }
+    if(key == "look_dir") { FLOATS(3); param.cam.look_dir = glm::normalize(glm::vec3(f[0], f[1], f[2])); return 4; }
+    if(key == "up") { FLOATS(3); param.cam.up = glm::normalize(glm::vec3(f[0], f[1], f[2])); return 4; }
+    if(key == "near") { FLOATS(1); param.cam.near = f[0]; return 2; }
+    if(key == "far") { FLOATS(1); param.cam.far = f[0]; return 2; }
+    if(key == "fovy") { FLOATS(1); param.cam.FoVy = f[0]; return 2; }
+    if(key == "fovx") { FLOATS(1); param.cam.FoVx = f[0]; return 2; }
+    if(key == "light") { FLOATS(3); param.light<<f[0], f[1], f[2]; return 4; }
+    if(key == "color") { FLOATS(3); param.model_color<<f[0], f[1], f[2]; return 4; }
+
+    if(key == "shading") { INT(); param.shading = v; return 2; }
+    if(key == "wireframe") { param.draw_mode = GL_LINE; return 1; }
+    if(key == "points") { param.draw_mode = GL_POINT; return 1; }
+    if(key == "cw") { param.front_face = GL_CW; return 1; }
+    if(key == "serial") { param.multithreading = false; return 1; }
+    if(key == "no-hiz") { param.hiz = false; return 1; }
+    if(key == "buffered") { param.streaming = false; return 1; }
+    if(key == "no-frustum-culling") { param.frustum_culling = false; return 1; }
+    if(key == "no-cluster-culling") { param.cluster_culling = false; return 1; }
+    if(key == "no-lod") { param.lod = false; return 1; }
+    if(key == "rasterizer")
+    {
+      if(left < 1) return -1;
+      if(args[i+1] == "scanline") param.rasterizer = 0;
+      else if(args[i+1] == "halfspace") param.rasterizer = 1;
+      else return -1;
+      return 2;
+    }
+
+    #undef FLOATS
+    #undef INT
+    return -1;
+  }
+
+  bool apply_all(const std::vector<std::string>& args, Options& opt, GlobalParameters& param)
+  {
+    for(size_t i = 0; i < args.size(); )
+    {
+      int used = apply(args, i, opt, param);
+      if(used < 0)
+      {
+        std::cout<<"Bad option "<<args[i]<<std::endl;
+        return false;
+      }
+      i += used;
+    }
+    return true;
+  }
+
+  bool read_camera_file(const std::string& path, Options& opt, GlobalParameters& param)
+  {
+    std::ifstream file(path);
+    if(!file)
+    {
+      std::cout<<"Could not open "<<path<<std::endl;
+      return false;
+    }
+
+    std::string line;
+    while(std::getline(file, line))
+    {
+      line = line.substr(0, line.find('#'));
+      std::istringstream tokens(line);
+      std::vector<std::string> args;
+      for(std::string t; tokens >> t; ) args.push_back(t);
+      if(!args.empty() && !apply_all(args, opt, param)) return false;
+    }
+    return true;
+  }
+
+  std::string frame_path(const std::string& output, int frame, int n_frames)
+  {
+    if(n_frames == 1) return output;
+
+    char number[16];
+    sprintf(number, "_%04d", frame);
+    size_t dot = output.rfind('.');
+    if(dot == std::string::npos) return output + number;
+    return output.substr(0, dot) + number + output.substr(dot);
+  }
+}
+
+int main(int argc, char** args)
+{
+  if(argc < 2 || !strcmp(args[1], "--help"))
+  {
+    usage(args[0]);
+    return argc < 2 ? 1 : 0;
+  }
+
+  //same defaults as the interactive application
+  Options opt;
+  opt.model = args[1];
+  opt.output = "frame.png";
+  opt.width = 960; opt.height = 540;
+  opt.frames = 1; opt.threads = 0;
+  opt.orbit = 0.0f;
+
+  GlobalParameters param;
+  param.cam.eye = glm::vec3(0.0f, 0.0f, 0.0f);
+  param.cam.look_dir = glm::vec3(0.0f, 0.0f, -1.0f);
+  param.cam.up = glm::vec3(0.0f, 1.0f, 0.0f);
+  param.cam.near = 1.0f; param.cam.far = 10.0f;
+  param.cam.step = 0.1f;
+  param.cam.FoVy = 45.0f, param.cam.FoVx = 45.0f;
+  param.cam.lock_view = false;
+  param.light<<0.0f, 0.0f, 0.0f;
+  param.model_color<<0.0f, 1.0f, 0.0f;
+  param.front_face = GL_CCW;
+  param.draw_mode = GL_FILL;
+  param.shading = 0;
+  param.frustum_culling = true;
+  param.cluster_culling = true;
+  param.lod = true;
+  param.multithreading = true;
+  param.rasterizer = 0;
+  param.hiz = true;
+  param.streaming = true;
+
+  //options come from the command line, where "-c file" is
+  //replaced by the options written in that file
+  for(int i = 2; i < argc; ++i)
+  {
+    std::vector<std::string> cur;
+    if(!strcmp(args[i], "-c"))
+    {
+      if(i+1 == argc || !read_camera_file(args[++i], opt, param)) return 1;
+      continue;
+    }
+
+    cur.push_back(std::string(args[i]).substr(args[i][1] == '-' ? 2 : 1));
+    if(args[i][0] != '-')
+    {
+      std::cout<<"Bad option "<<args[i]<<std::endl;
+      return 1;
+    }
+    for(int j = i+1; j < argc && (args[j][0] != '-' || isdigit(args[j][1]) || args[j][1] == '.'); ++j)
+      cur.push_back(args[j]);
+    if(!apply_all(cur, opt, param)) return 1;
+    i += cur.size() - 1;
+  }
+  param.cam.right = glm::normalize(glm::cross(param.cam.look_dir, param.cam.up));
+
+  if(opt.width <= 0 || opt.height <= 0 || opt.frames <= 0)
+  {
+    std::cout<<"Invalid resolution or frame count"<<std::endl;
+    return 1;
+  }
+
+  Mesh mesh;
+  mesh.load_file(opt.model);
+  if(mesh.mIndices.cols() == 0)
+  {
+    std::cout<<"Could not load "<<opt.model<<std::endl;
+    return 1;
+  }
+
+  glm::mat4 centered(1.0f);
+  mesh.transform_to_center(centered);
+
+  Profiler profiler;
+  AlmostGL almostgl(mesh, opt.width, opt.height, opt.threads);
+  if(!opt.trace.empty()) almostgl.set_profiler(&profiler);
+
+  for(int frame = 0; frame < opt.frames; ++frame)
+  {
+    profiler.begin_frame();
+
+    //orbiting rotates the model around the vertical
+    //axis through the point it was centered at
+    glm::vec3 center(0.0f, 0.0f, -5.5f);
+    param.model2world = glm::translate(glm::mat4(1.0f), center) *
+                        glm::rotate(glm::mat4(1.0f), glm::radians(opt.orbit*frame), glm::vec3(0.0f, 1.0f, 0.0f)) *
+                        glm::translate(glm::mat4(1.0f), -center) * centered;
+
+    almostgl.render(param);
+
+    std::string path = frame_path(opt.output, frame, opt.frames);
+    if(!Image::write(path, almostgl.color_buffer(), almostgl.width(), almostgl.height()))
+    {
+      std::cout<<"Could not write "<<path<<std::endl;
+      return 1;
+    }
+  }
+
+  if(!opt.trace.empty() && !profiler.export_chrome_trace(opt.trace))
+  {
+    std::cout<<"Could not write "<<opt.trace<<std::endl;
+    return 1;
+  }
+
+  return 0;
+}
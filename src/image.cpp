@@ -0,0 +1,137 @@
+#include "../include/image.h"
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+namespace
+{
+  uint32_t crc32(const unsigned char* data, size_t n, uint32_t crc = 0)
+  {
+    static uint32_t table[256];
+    static bool initialized = false;
+    if(!initialized)
+    {
+      for(uint32_t i = 0; i < 256; ++i)
+      {
+        uint32_t c = i;
+        for(int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+      }
+      initialized = true;
+    }
+
+    crc = ~crc;
+    for(size_t i = 0; i < n; ++i) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  void put32(std::vector<unsigned char>& out, uint32_t v)
+  {
+    out.push_back(v >> 24); out.push_back(v >> 16);
+    out.push_back(v >> 8); out.push_back(v);
+  }
+
+  //chunk = length, type, data, crc of type+data
+  bool write_chunk(FILE* file, const char* type, const std::vector<unsigned char>& data)
+  {
+    std::vector<unsigned char> chunk;
+    put32(chunk, data.size());
+    chunk.insert(chunk.end(), type, type+4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    put32(chunk, crc32(&chunk[4], chunk.size()-4));
+    return fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+  }
+}
+
+bool Image::write_ppm(const std::string& path, const unsigned char* rgba, int width, int height)
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file) return false;
+
+  bool ok = fprintf(file, "P6\n%d %d\n255\n", width, height) > 0;
+
+  std::vector<unsigned char> row(3*width);
+  for(int y = 0; ok && y < height; ++y)
+  {
+    const unsigned char* src = &rgba[4*y*width];
+    for(int x = 0; x < width; ++x)
+    {
+      row[3*x+0] = src[4*x+0];
+      row[3*x+1] = src[4*x+1];
+      row[3*x+2] = src[4*x+2];
+    }
+    ok = fwrite(row.data(), 1, row.size(), file) == row.size();
+  }
+
+  return (fclose(file) == 0) && ok;
+}
+
+bool Image::write_png(const std::string& path, const unsigned char* rgba, int width, int height)
+{
+  //raw image data: each RGB row is preceded by its filter type (0, none)
+  std::vector<unsigned char> raw;
+  raw.reserve((3*width+1)*height);
+  for(int y = 0; y < height; ++y)
+  {
+    raw.push_back(0);
+    const unsigned char* src = &rgba[4*y*width];
+    for(int x = 0; x < width; ++x)
+    {
+      raw.push_back(src[4*x+0]);
+      raw.push_back(src[4*x+1]);
+      raw.push_back(src[4*x+2]);
+    }
+  }
+
+  //zlib stream made of stored deflate blocks of up to 65535 bytes,
+  //followed by the adler32 of the raw data
+  std::vector<unsigned char> idat;
+  idat.push_back(0x78); idat.push_back(0x01);
+
+  size_t pos = 0;
+  do
+  {
+    size_t n = std::min<size_t>(65535, raw.size() - pos);
+    bool last = pos + n == raw.size();
+    idat.push_back(last ? 1 : 0);
+    idat.push_back(n & 0xFF); idat.push_back(n >> 8);
+    idat.push_back(~n & 0xFF); idat.push_back((~n >> 8) & 0xFF);
+    idat.insert(idat.end(), raw.begin()+pos, raw.begin()+pos+n);
+    pos += n;
+  } while(pos < raw.size());
+
+  uint32_t a = 1, b = 0;
+  for(size_t i = 0; i < raw.size(); ++i)
+  {
+    a = (a + raw[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  put32(idat, (b << 16) | a);
+
+  //header: size, 8 bits per channel, RGB, default
+  //compression and filters, no interlacing
+  std::vector<unsigned char> ihdr;
+  put32(ihdr, width); put32(ihdr, height);
+  ihdr.push_back(8); ihdr.push_back(2);
+  ihdr.push_back(0); ihdr.push_back(0); ihdr.push_back(0);
+
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file) return false;
+
+  static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  bool ok = fwrite(signature, 1, 8, file) == 8;
+  ok = ok && write_chunk(file, "IHDR", ihdr);
+  ok = ok && write_chunk(file, "IDAT", idat);
+  ok = ok && write_chunk(file, "IEND", std::vector<unsigned char>());
+
+  return (fclose(file) == 0) && ok;
+}
+
+bool Image::write(const std::string& path, const unsigned char* rgba, int width, int height)
+{
+  size_t dot = path.rfind('.');
+  std::string ext = dot == std::string::npos ? "" : path.substr(dot+1);
+  if(ext == "png" || ext == "PNG") return write_png(path, rgba, width, height);
+  return write_ppm(path, rgba, width, height);
+}
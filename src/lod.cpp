@@ -0,0 +1,360 @@
+#include "../include/lod.h"
+#include <cmath>
+#include <queue>
+#include <algorithm>
+
+//Quadric error metric simplification (Garland & Heckbert). Every vertex
+//keeps the sum of the quadrics of the planes of the original triangles
+//around it, weighted by their area, so the quadric evaluated at a point
+//tells how far that point is from the surface the vertex stands for.
+//Collapses are half-edge ones: the vertex goes onto a neighbor instead of
+//a new optimal position, which keeps the vertex buffer as it is.
+
+namespace
+{
+  //symmetric 4x4 matrix: xx xy xz xw yy yz yw zz zw ww
+  struct Quadric
+  {
+    double q[10];
+
+    Quadric() { for(int i = 0; i < 10; ++i) q[i] = 0.0; }
+
+    void add_plane(double a, double b, double c, double d, double w)
+    {
+      q[0] += w*a*a; q[1] += w*a*b; q[2] += w*a*c; q[3] += w*a*d;
+      q[4] += w*b*b; q[5] += w*b*c; q[6] += w*b*d;
+      q[7] += w*c*c; q[8] += w*c*d;
+      q[9] += w*d*d;
+    }
+
+    void add(const Quadric& o) { for(int i = 0; i < 10; ++i) q[i] += o.q[i]; }
+
+    double eval(const float* p) const
+    {
+      double x = p[0], y = p[1], z = p[2];
+      return x*(q[0]*x + 2.0*(q[1]*y + q[2]*z + q[3])) +
+              y*(q[4]*y + 2.0*(q[5]*z + q[6])) +
+              z*(q[7]*z + 2.0*q[8]) + q[9];
+    }
+  };
+
+  //moving vertex from onto vertex to. stamp is the one from had when
+  //this was computed: anything around it changing makes it stale
+  struct Collapse
+  {
+    float cost;
+    uint32_t from, to, stamp;
+
+    //std::priority_queue pops the largest element
+    bool operator<(const Collapse& rhs) const { return cost > rhs.cost; }
+  };
+
+  class Simplifier
+  {
+  private:
+    const float* pos;
+    const uint32_t* material;
+
+    std::vector<uint32_t> tris;
+    std::vector<unsigned char> tri_alive;
+    int n_alive;
+
+    //triangles around each vertex. collapses only add to these,
+    //so they may hold triangles that died or don't use it anymore
+    std::vector< std::vector<uint32_t> > vertex_tris;
+
+    std::vector<Quadric> quadrics;
+    std::vector<double> weights;
+    std::vector<uint32_t> stamp;
+    std::vector<unsigned char> locked, removed;
+    std::priority_queue<Collapse> heap;
+    float max_error;
+
+    //scratch space of update(), which runs for every
+    //vertex around each collapse
+    std::vector<uint32_t> scratch_from, scratch_to, candidates;
+    std::vector< std::pair<double, uint32_t> > costs;
+
+    bool uses(uint32_t t, uint32_t v) const
+    {
+      return tris[3*t] == v || tris[3*t+1] == v || tris[3*t+2] == v;
+    }
+
+    void neighbors(uint32_t v, std::vector<uint32_t>& out) const
+    {
+      out.clear();
+      for(size_t i = 0; i < vertex_tris[v].size(); ++i)
+      {
+        uint32_t t = vertex_tris[v][i];
+        if(!tri_alive[t] || !uses(t, v)) continue;
+        for(int k = 0; k < 3; ++k)
+          if(tris[3*t+k] != v) out.push_back(tris[3*t+k]);
+      }
+      std::sort(out.begin(), out.end());
+      out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    static void normal(const float* a, const float* b, const float* c, float* n)
+    {
+      float u[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+      float v[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+      n[0] = u[1]*v[2] - u[2]*v[1];
+      n[1] = u[2]*v[0] - u[0]*v[2];
+      n[2] = u[0]*v[1] - u[1]*v[0];
+    }
+
+    //the collapse must keep the surface a manifold (the link condition:
+    //from and to only share the neighbors across the triangles of their
+    //edge) and must not flip any of the triangles that stay around
+    bool valid(uint32_t from, uint32_t to, std::vector<uint32_t>& n_from,
+               std::vector<uint32_t>& n_to) const
+    {
+      neighbors(from, n_from);
+      neighbors(to, n_to);
+      if(!std::binary_search(n_from.begin(), n_from.end(), to)) return false;
+
+      int shared = 0, edge_tris = 0;
+      for(size_t i = 0, j = 0; i < n_from.size() && j < n_to.size(); )
+      {
+        if(n_from[i] == n_to[j]) { ++shared; ++i; ++j; }
+        else if(n_from[i] < n_to[j]) ++i;
+        else ++j;
+      }
+
+      for(size_t i = 0; i < vertex_tris[from].size(); ++i)
+      {
+        uint32_t t = vertex_tris[from][i];
+        if(!tri_alive[t] || !uses(t, from)) continue;
+        if(uses(t, to)) { ++edge_tris; continue; }
+
+        const float* p[3];
+        const float* q[3];
+        for(int k = 0; k < 3; ++k)
+        {
+          uint32_t v = tris[3*t+k];
+          p[k] = &pos[3*v];
+          q[k] = v == from ? &pos[3*to] : p[k];
+        }
+        float before[3], after[3];
+        normal(p[0], p[1], p[2], before);
+        normal(q[0], q[1], q[2], after);
+        if(before[0]*after[0] + before[1]*after[1] + before[2]*after[2] <= 0.0f) return false;
+      }
+
+      return shared == edge_tris;
+    }
+
+    //finds the cheapest collapse of v and queues it. checking them all
+    //for validity would take most of the time, so by default only the
+    //cheapest one is queued, and it's checked when it comes out
+    void update(uint32_t v, bool validate = false)
+    {
+      ++stamp[v];
+      if(locked[v] || removed[v]) return;
+
+      neighbors(v, candidates);
+      costs.clear();
+      for(size_t i = 0; i < candidates.size(); ++i)
+      {
+        uint32_t to = candidates[i];
+        if(material[to] != material[v]) continue;
+
+        Quadric q = quadrics[v];
+        q.add(quadrics[to]);
+        double w = weights[v] + weights[to];
+        double cost = w > 0.0 ? std::max(0.0, q.eval(&pos[3*to]) / w) : 0.0;
+        costs.push_back(std::make_pair(cost, to));
+      }
+      std::sort(costs.begin(), costs.end());
+
+      for(size_t i = 0; i < costs.size(); ++i)
+        if(!validate || valid(v, costs[i].second, scratch_from, scratch_to))
+        {
+          Collapse best = { (float)costs[i].first, v, costs[i].second, stamp[v] };
+          heap.push(best);
+          return;
+        }
+    }
+
+    void collapse(uint32_t from, uint32_t to)
+    {
+      std::vector<uint32_t>& around = vertex_tris[from];
+      for(size_t i = 0; i < around.size(); ++i)
+      {
+        uint32_t t = around[i];
+        if(!tri_alive[t] || !uses(t, from)) continue;
+
+        if(uses(t, to))
+        {
+          tri_alive[t] = 0;
+          --n_alive;
+          continue;
+        }
+        for(int k = 0; k < 3; ++k)
+          if(tris[3*t+k] == from) tris[3*t+k] = to;
+        vertex_tris[to].push_back(t);
+      }
+      std::vector<uint32_t>().swap(around);
+
+      removed[from] = 1;
+      quadrics[to].add(quadrics[from]);
+      weights[to] += weights[from];
+
+      //drop what died from the list of to, it's the one that grows
+      std::vector<uint32_t>& list = vertex_tris[to];
+      size_t n = 0;
+      for(size_t i = 0; i < list.size(); ++i)
+        if(tri_alive[list[i]] && uses(list[i], to)) list[n++] = list[i];
+      list.resize(n);
+      std::sort(list.begin(), list.end());
+      list.erase(std::unique(list.begin(), list.end()), list.end());
+
+      //costs change for to and everybody around it
+      std::vector<uint32_t> ring;
+      neighbors(to, ring);
+      update(to);
+      for(size_t i = 0; i < ring.size(); ++i) update(ring[i]);
+    }
+
+  public:
+    Simplifier(const float* pos, const uint32_t* material, int n_vertices,
+               const uint32_t* indices, int n_triangles)
+      : pos(pos), material(material),
+        tris(indices, indices + 3*n_triangles), tri_alive(n_triangles, 1),
+        n_alive(n_triangles), vertex_tris(n_vertices), quadrics(n_vertices),
+        weights(n_vertices, 0.0), stamp(n_vertices, 0),
+        locked(n_vertices, 0), removed(n_vertices, 0), max_error(0.0f)
+    {
+      //plane quadrics, weighted by the area of the triangles
+      for(int t = 0; t < n_triangles; ++t)
+      {
+        const uint32_t* v = &tris[3*t];
+        for(int k = 0; k < 3; ++k) vertex_tris[v[k]].push_back(t);
+
+        float n[3];
+        normal(&pos[3*v[0]], &pos[3*v[1]], &pos[3*v[2]], n);
+        double l = sqrt((double)n[0]*n[0] + (double)n[1]*n[1] + (double)n[2]*n[2]);
+        if(l == 0.0) continue;
+
+        double a = n[0]/l, b = n[1]/l, c = n[2]/l;
+        double d = -(a*pos[3*v[0]] + b*pos[3*v[0]+1] + c*pos[3*v[0]+2]);
+        for(int k = 0; k < 3; ++k)
+        {
+          quadrics[v[k]].add_plane(a, b, c, d, 0.5*l);
+          weights[v[k]] += 0.5*l;
+        }
+      }
+
+      //edges used by a single triangle are borders, and edges used by
+      //more than two make the surface non-manifold. their vertices stay
+      std::vector<uint64_t> edges(3*n_triangles);
+      for(int t = 0; t < n_triangles; ++t)
+        for(int k = 0; k < 3; ++k)
+        {
+          uint64_t a = tris[3*t+k], b = tris[3*t+(k+1)%3];
+          edges[3*t+k] = a < b ? (a << 32) | b : (b << 32) | a;
+        }
+      std::sort(edges.begin(), edges.end());
+      for(size_t i = 0, j; i < edges.size(); i = j)
+      {
+        for(j = i+1; j < edges.size() && edges[j] == edges[i]; ++j);
+        if(j - i != 2)
+        {
+          locked[edges[i] >> 32] = 1;
+          locked[edges[i] & 0xffffffffu] = 1;
+        }
+      }
+
+      for(int v = 0; v < n_vertices; ++v) update(v);
+    }
+
+    //collapses the cheapest edges until there are at
+    //most target triangles left or nothing can collapse
+    void run(int target)
+    {
+      std::vector<uint32_t> n_from, n_to;
+      while(n_alive > target && !heap.empty())
+      {
+        Collapse c = heap.top();
+        heap.pop();
+        if(removed[c.from] || removed[c.to] || c.stamp != stamp[c.from]) continue;
+
+        //it may not have been valid when queued, or not be anymore
+        if(!valid(c.from, c.to, n_from, n_to))
+        {
+          update(c.from, true);
+          continue;
+        }
+
+        max_error = std::max(max_error, sqrtf(c.cost));
+        collapse(c.from, c.to);
+      }
+    }
+
+    int triangles() const { return n_alive; }
+    float error() const { return max_error; }
+
+    void result(std::vector<uint32_t>& out) const
+    {
+      out.clear();
+      for(size_t t = 0; t < tri_alive.size(); ++t)
+        if(tri_alive[t]) out.insert(out.end(), &tris[3*t], &tris[3*t+3]);
+    }
+  };
+}
+
+void LOD::build_chain(const float* pos, const uint32_t* material, int n_vertices,
+                      const uint32_t* indices, int n_triangles,
+                      std::vector< std::vector<uint32_t> >& levels,
+                      std::vector<float>& errors)
+{
+  levels.clear(); errors.clear();
+  if(n_triangles / 2 < LOD_MIN_TRIANGLES) return;
+
+  //a single run of collapses, taking a snapshot every time the
+  //triangle count halves. a level that doesn't get much smaller
+  //than the previous one isn't worth it, and ends the chain
+  Simplifier simplifier(pos, material, n_vertices, indices, n_triangles);
+  int previous = n_triangles;
+  while((int)levels.size() < LOD_MAX_LEVELS-1 && previous / 2 >= LOD_MIN_TRIANGLES)
+  {
+    simplifier.run(previous / 2);
+    if(simplifier.triangles() > previous * 3 / 4) break;
+
+    levels.push_back(std::vector<uint32_t>());
+    simplifier.result(levels.back());
+    errors.push_back(simplifier.error());
+    previous = simplifier.triangles();
+  }
+}
+
+int LOD::select(const float* errors, int n_levels, const float* model,
+                const float* center, float radius, const float* eye,
+                float fovx, float fovy, int width, int height, float max_pixels)
+{
+  //model scales errors by the length of its longest axis at most
+  const float* m = model;
+  float scale = 0.0f;
+  for(int c = 0; c < 3; ++c)
+    scale = std::max(scale, sqrtf(m[4*c]*m[4*c] + m[4*c+1]*m[4*c+1] + m[4*c+2]*m[4*c+2]));
+
+  float d2 = 0.0f;
+  for(int k = 0; k < 3; ++k)
+  {
+    float c = m[k]*center[0] + m[4+k]*center[1] + m[8+k]*center[2] + m[12+k];
+    d2 += (c - eye[k])*(c - eye[k]);
+  }
+
+  //nearest the mesh can be. from inside its bounding sphere
+  //anything may be right in front of the eye
+  float distance = sqrtf(d2) - radius*scale;
+  if(distance <= 0.0f) return 0;
+
+  //pixels a unit long segment covers at that distance, facing the eye
+  float pixels = std::max(width / (2.0f*tanf(0.5f*fovx*3.14159265f/180.0f)),
+                          height / (2.0f*tanf(0.5f*fovy*3.14159265f/180.0f))) / distance;
+
+  for(int i = n_levels-1; i > 0; --i)
+    if(errors[i]*scale*pixels <= max_pixels) return i;
+  return 0;
+}
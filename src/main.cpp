@@ -4,6 +4,7 @@
 #include <glm/gtx/string_cast.hpp>
 
 #include <ctime>
+#include <chrono>
 #include <iostream>
 
 #include <nanogui/opengl.h>
@@ -22,6 +23,14 @@
 #include "../include/ogl.h"
 #include "../include/param.h"
 #include "../include/matrix.h"
+#include "../include/almostgl.h"
+#include "../include/profiler.h"
+#include "../include/renderthread.h"
+#include "../include/frameupload.h"
+#include "../include/resolution.h"
+
+//frames averaged in the timing breakdown
+#define PROFILE_FRAMES 30
 
 #define THETA 0.0174533f
 #define COSTHETA float(cos(THETA))
@@ -38,17 +47,26 @@ private:
   nanogui::Label *framerate_almost;
   nanogui::Label *window_dimension;
 
-  GlobalParameters param;
+  //per stage timings and counters of the OpenGL canvas and
+  //of the display of AlmostGL frames (the render thread has a
+  //profiler of its own). the breakdown lines are created as new
+  //entries show up
+  Profiler profiler;
+  nanogui::Widget *profile_panel;
+  std::vector<nanogui::Label*> profile_lines;
 
-  //vertex buffers
-  int n_vertices, vertex_sz;
-  float *vbuffer, *clipped, *culled, *projected;
+  GlobalParameters param;
 
-  //pixel buffers
-  int buffer_height, buffer_width;
-  GLubyte *color; float *depth;
+  //software pipeline, running on a thread of its own,
+  //and what takes its frames to the GPU
+  RenderThread *mRenderer;
+  FrameUpload *mUpload;
 
-  GLuint color_gpu;
+  //resolution AlmostGL renders at, lower while the camera moves.
+  //motion shows as a camera other than the one of the last redraw
+  ResolutionScale resolution;
+  Camera last_cam;
+  uint64_t last_frame;
 
 public:
   ExampleApp(const char* path) : nanogui::Screen(Eigen::Vector2i(960, 540), "NanoGUI Test")
@@ -107,6 +125,21 @@ public:
     draw_cw->setTooltip("Uncheck this box for drawing triangles in CCW order");
     draw_cw->setCallback([&](bool cw) { param.front_face = cw ? GL_CW : GL_CCW; });
 
+    CheckBox *frustum_culling = new CheckBox(window, "Frustum culling");
+    frustum_culling->setTooltip("Skip the parts of the model outside the view frustum, using a BVH built when loading it");
+    frustum_culling->setChecked(true);
+    frustum_culling->setCallback([&](bool on) { param.frustum_culling = on; });
+
+    CheckBox *cluster_culling = new CheckBox(window, "Cluster backface culling");
+    cluster_culling->setTooltip("Skip whole clusters of triangles facing away from the eye, using their normal cones");
+    cluster_culling->setChecked(true);
+    cluster_culling->setCallback([&](bool on) { param.cluster_culling = on; });
+
+    CheckBox *lod = new CheckBox(window, "Level of detail");
+    lod->setTooltip("Draw simplified versions of the model when it's far enough that nobody would notice");
+    lod->setChecked(true);
+    lod->setCallback([&](bool on) { param.lod = on; });
+
     CheckBox *lock_view = new CheckBox(window, "Lock view on the model");
     lock_view->setTooltip("Lock view point at the point where the model is centered. This will disable camera rotation.");
     lock_view->setCallback([&](bool lock) { param.cam.lock_view = lock;
@@ -122,6 +155,7 @@ public:
                               case 1: param.draw_mode = GL_LINE; break;
                               case 2: param.draw_mode = GL_FILL; break;
                             } });
+    draw_mode->setSelectedIndex(2);
 
     ComboBox *shading_model = new ComboBox(window, {"GouraudAD", "GouraudADS", "PhongADS", "No shading"});
     shading_model->setCallback([&](int opt) {
@@ -133,11 +167,55 @@ public:
                                   case 3: param.shading = 3; break;
                                 } });
 
+    CheckBox *multithreading = new CheckBox(window, "Multithreaded AlmostGL");
+    multithreading->setTooltip("Uncheck this box for running the whole AlmostGL pipeline in a single thread");
+    multithreading->setChecked(true);
+    multithreading->setCallback([&](bool mt) { param.multithreading = mt; });
+
+    ComboBox *rasterizer = new ComboBox(window, {"Scanline", "Half-space"});
+    rasterizer->setTooltip("Rasterization algorithm used by AlmostGL");
+    rasterizer->setCallback([&](int opt) { param.rasterizer = opt; });
+
+    CheckBox *hiz = new CheckBox(window, "Hierarchical Z");
+    hiz->setTooltip("Reject occluded triangles and tiles before rasterizing them");
+    hiz->setChecked(true);
+    hiz->setCallback([&](bool on) { param.hiz = on; });
+
+    CheckBox *streaming = new CheckBox(window, "Streaming pipeline");
+    streaming->setTooltip("Push small batches of triangles through clipping, culling and rasterization instead of whole-frame buffers");
+    streaming->setChecked(true);
+    streaming->setCallback([&](bool on) { param.streaming = on; });
+
     //display framerates
     window_dimension = new Label(window, "dim");
     framerate_open = new Label(window, "framerate");
     framerate_almost = new Label(window, "framerate");
 
+    CheckBox *dynamic_resolution = new CheckBox(window, "Dynamic resolution");
+    dynamic_resolution->setTooltip("Render AlmostGL frames at a lower resolution while the camera moves, to keep up with the frame time below");
+    dynamic_resolution->setChecked(true);
+    dynamic_resolution->setCallback([&](bool on) { resolution.set_enabled(on); });
+
+    new Label(window, "Frame time target (ms)", "sans-bold");
+
+    Slider *frame_target = new Slider(window);
+    frame_target->setFixedWidth(100);
+    frame_target->setTooltip("Set the AlmostGL frame time aimed at while moving to any value between 8 and 100 ms");
+    frame_target->setValue((resolution.target() - 8.0f) / (100.0f - 8.0f));
+    frame_target->setCallback( [this](float val) { resolution.set_target(8.0f + val * (100.0f - 8.0f)); } );
+
+    Button *export_trace = new Button(window, "Export trace");
+    export_trace->setTooltip("Write the last recorded frames to almostgl_trace.json and opengl_trace.json (open them in chrome://tracing)");
+    export_trace->setCallback( [this] {
+      mRenderer->export_trace("almostgl_trace.json");
+      if(profiler.export_chrome_trace("opengl_trace.json"))
+        std::cout<<"Trace written to opengl_trace.json"<<std::endl;
+      else std::cout<<"Could not write opengl_trace.json"<<std::endl;
+    });
+
+    new Label(window, "Breakdown (avg. of " + std::to_string(PROFILE_FRAMES) + " frames)", "sans-bold");
+    profile_panel = window;
+
     Window *winOpenGL = new Window(this, "OpenGL");
     winOpenGL->setSize({480, 270});
     winOpenGL->setPosition(Eigen::Vector2i(50,50));
@@ -145,6 +223,7 @@ public:
 
     mOGL = new OGL(param, path, winOpenGL);
     mOGL->setSize({480, 270});
+    mOGL->set_profiler(&profiler);
 
     performLayout();
 
@@ -173,10 +252,28 @@ public:
     param.front_face = GL_CCW;
 
     //draw as filled polygons
-    param.draw_mode = GL_POINTS;
+    param.draw_mode = GL_FILL;
 
     param.shading = 0;
 
+    //only draw what the BVH says may be in the view
+    //frustum and facing the eye
+    param.frustum_culling = true;
+    param.cluster_culling = true;
+
+    //draw coarser levels of detail when the model is far
+    param.lod = true;
+
+    //rasterize screen tiles in parallel using the
+    //scanline rasterizer and hierarchical z culling,
+    //streaming triangles through the pipeline in batches
+    param.multithreading = true;
+    param.rasterizer = 0;
+    param.hiz = true;
+    param.streaming = true;
+    last_cam = param.cam;
+    last_frame = 0;
+
     //--------------------------------------
     //----------- Shader options -----------
     //--------------------------------------
@@ -208,47 +305,23 @@ public:
     mShader.uploadAttrib<Eigen::MatrixXf>("quad_pos", quad);
     mShader.uploadAttrib<Eigen::MatrixXf>("quad_uv", texcoord);
 
-    //we need 8 floats per vertex (4 -> XYZW, 3 -> RGB, 1 -> 1.0)
-    //Normals won't be forwarded out of vertex processing
-    //stage, so we don't need to store them in the vertex
-    //buffer.
-    //The 1.0 attribute is used for storing the 1/w value
-    //we need to compute a perspectively correct interpolation
-    //of the fragments
-    vertex_sz = 4 + 4;
-    n_vertices = mMesh.mPos.cols();
-
-    //preallocate buffers where we'll store the transformed,
-    //clipped and culled vertices (triangles) before copying them to the GPU.
-    //Buffers size are extremely conservative so we don't need to manage
-    //memory in anyway, just allocate once and use it (no need for resizing)
-    vbuffer = new float[n_vertices*vertex_sz];
-    clipped = new float[n_vertices*vertex_sz];
-    projected = new float[n_vertices*vertex_sz];
-    culled = new float[n_vertices*vertex_sz];
-
-    //preallocate color and depth buffers with the
-    //initial window size. this will once we resize the window!
-    buffer_height = this->height(); buffer_width = this->width();
-    int n_pixels = buffer_width * buffer_height;
-
-    //AlmostGL buffers
-    color = new GLubyte[4*n_pixels];
-    for(int i = 0; i < n_pixels*4; i += 4) color[i] = 0;
-    for(int i = 1; i < n_pixels*4; i += 4) color[i] = 0;
-    for(int i = 2; i < n_pixels*4; i += 4) color[i] = 30;
-    for(int i = 3; i < n_pixels*4; i += 4) color[i] = 255;
-
-    depth = new float[n_pixels];
-
-    //GPU target color buffer
-    glGenTextures(1, &color_gpu);
-    glBindTexture(GL_TEXTURE_2D, color_gpu);
-    glTexStorage2D(GL_TEXTURE_2D,
-                    1,
-                    GL_RGBA8,
-                    buffer_width,
-                    buffer_height);
+    //AlmostGL buffers. color and depth buffers are
+    //preallocated with the initial window size. every
+    //finished frame wakes the event loop up to show it
+    mRenderer = new RenderThread(mMesh, this->width(), this->height(), PROFILE_FRAMES);
+    mRenderer->set_frame_callback([] { glfwPostEmptyEvent(); });
+
+    //frames reach the GPU through pixel buffers
+    //the render thread draws straight into
+    mUpload = new FrameUpload(*mRenderer);
+  }
+
+  ~ExampleApp()
+  {
+    //the render thread reads the mesh, so it goes first
+    //(after what it may be rendering into)
+    delete mUpload;
+    delete mRenderer;
   }
 
   virtual void draw(NVGcontext *ctx)
@@ -370,470 +443,75 @@ public:
     return false;
   }
 
-  virtual bool resizeEvent(const Eigen::Vector2i &size) override
-  {
-    buffer_height = this->height(); buffer_width = this->width();
-    int n_pixels = buffer_width * buffer_height;
-
-    //delete previous texture and allocate a new one with the new size
-    glDeleteTextures(1, &color_gpu);
-    glGenTextures(1, &color_gpu);
-    glBindTexture(GL_TEXTURE_2D, color_gpu);
-    glTexStorage2D(GL_TEXTURE_2D,
-                    1,
-                    GL_RGBA8,
-                    buffer_width,
-                    buffer_height);
-
-    //TODO: this is EXTREMELY slow! the best workaround would be
-    //to use std::vector which is able to do some smart resizing,
-    //so it doesn't need to copy data around in the case where
-    //we can just extend or shrink memory
-    delete[] color;
-    color = new GLubyte[4*n_pixels];
-
-    delete[] depth;
-    depth = new float[n_pixels];
-  }
-
   virtual void drawContents()
   {
     using namespace nanogui;
-    clock_t start = clock();
-
-    //convert params to use internal library
-    //TODO: we could precompute most of these calls
-    vec3 eye = vec3(param.cam.eye[0], param.cam.eye[1], param.cam.eye[2]);
-    vec3 up = vec3(param.cam.up[0], param.cam.up[1], param.cam.up[2]);
-    vec3 right = vec3(param.cam.right[0], param.cam.right[1], param.cam.right[2]);
-    vec3 look_dir = vec3(param.cam.look_dir[0],
-                          param.cam.look_dir[1],
-                          param.cam.look_dir[2]);
-    vec3 model_color = vec3(param.model_color(0),
-                            param.model_color(1),
-                            param.model_color(2));
-    vec4 light = vec4(param.light(0),
-                      param.light(1),
-                      param.light(2),
-                      1.0f);
-
-    mat4 model2world;
-    for(int i = 0; i < 4; ++i)
-      for(int j = 0; j < 4; ++j)
-        model2world(i,j) = param.model2world[j][i];
+    profiler.begin_frame();
+
+    if(param.cam != last_cam) resolution.motion();
+    last_cam = param.cam;
+
+    //the render thread takes it from here, with a copy of the
+    //parameters as they are now. resizes reach it the same way
+    int render_width, render_height;
+    resolution.render_size(this->width(), this->height(), render_width, render_height);
+    mRenderer->submit(param, render_width, render_height);
 
     //-------------------------------------------------------
-    //------------------ GRAPHICAL PIPELINE -----------------
+    //---------------------- DISPLAY ------------------------
     //-------------------------------------------------------
-    //important matrices.
-    //proj and viewport could be precomputed!
-    mat4 view = mat4::view(eye, eye+look_dir, up);
-    mat4 proj = mat4::perspective(param.cam.FoVy, param.cam.FoVx,
-                                  param.cam.near, param.cam.far);
-    mat4 viewport = mat4::viewport(buffer_width, buffer_height);
-    mat4 vp = proj * view;
-
-    //vertex processing stage
-    for(int v_id = 0; v_id < n_vertices; ++v_id)
+    // send to GPU in texture unit 0
+    Profiler::clock::time_point upload_start = Profiler::clock::now();
+    const RenderedFrame* frame = mUpload->update(this->width(), this->height());
+    if(frame && frame->number != last_frame)
     {
-      Eigen::Vector3f v = mMesh.mPos.col(v_id);
-      Eigen::Vector3f n = mMesh.mNormal.col(v_id);
-
-      //transform vertices using model view proj.
-      //notice that this is akin to what we do in
-      //vertex shader.
-      vec4 v_world = model2world * vec4(v(0),v(1),v(2),1.0f);
-      vec4 n_world = vec4(n(0),n(1),n(2),0.0f); //TODO: use inv(trans(model2world))!
-      vec4 v_out = vp * v_world;
-
-      //compute color of this vertex using phong lighting model
-      vec4 v2l = (light - v_world).unit();
-      vec4 v2e = (vec4(eye, 1.0f) - v_world).unit();
-      vec4 h = (v2l+v2e).unit();
-
-      float diff = std::max(0.0f, v2l.dot(-n_world));
-      float spec = std::max(0.0f, (float)pow(h.dot(-n_world), 15.0f));
-      float amb = 0.2f;
-
-      vec3 v_color;
-      switch(param.shading)
-      {
-        case 0:
-          v_color = model_color * (amb + diff);
-          break;
-        case 1:
-          v_color = model_color * (amb + diff) + vec3(1.0f, 1.0f, 1.0f) * spec;
-          break;
-        case 3:
-          v_color = model_color;
-          break;
-        default:
-          v_color = model_color * (amb + diff) + vec3(1.0f, 1.0f, 1.0f) * spec;
-          break;
-      }
-
-      //copy to vbuffer -> forward to next stage
-      for(int i = 0; i < 4; ++i) vbuffer[vertex_sz*v_id+i] = v_out(i);
-      for(int i = 0; i < 3; ++i) vbuffer[vertex_sz*v_id+(4+i)] = v_color(i);
-      vbuffer[vertex_sz*v_id+7] = 1.0f;
+      resolution.frame_done(frame->width, this->width(), frame->ms);
+      last_frame = frame->number;
     }
 
-    //primitive "clipping"
-    //Loop over vbuffer taking the vertices three by three,
-    //then we test if x/y/z coordinates are greater than w. If they are,
-    //then this vertex is outside the view frustum. Although the correct
-    //way of handling this would be to clip the triangle, we'll just
-    //discard it entirely.
-    //Notice that, at this moment, we're implicitly doing some sort of
-    //primitive assembly when we take vertices 3 by 3 to build a triangle
-    //TODO: To better reflect OpenGL architecture, clipping must happen
-    //after perspective division
-    memset(clipped, 0, sizeof(float)*n_vertices*vertex_sz);
-    int clipped_last = 0;
-    for(int p_id = 0; p_id < n_vertices*vertex_sz; p_id += 3*vertex_sz)
+    if(mUpload->has_frame())
     {
-      bool discard_tri = false;
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, mUpload->color_texture());
 
-      //loop over vertices of this triangle. if any of them
-      //is outside the view frustum, discard it
-      for(int v_id = 0; v_id < 3; ++v_id)
-      {
-        //triangle with index p_id (0, 3, 6, ...) starts at the position
-        //vertex_sz * p_id in the vbuffer. each vertex v_id of p_id starts
-        //at positions p_id+0, p_id+vertex_sz, p_id+2vertex_sz.
-        //XYZW in v_id are in +0, +1, +2, +3, RGB in +4,+5,+6
-        int v = p_id + vertex_sz*v_id;
-        float w = vbuffer[v+3];
-
-        //near plane clipping
-        if( w <= 0 )
-        {
-          discard_tri = true;
-          break;
-        }
-
-        //clip primitives outside frustum
-        if(std::fabs(vbuffer[v+0]) > w ||
-            std::fabs(vbuffer[v+1]) > w ||
-            std::fabs(vbuffer[v+2]) > w)
-        {
-          discard_tri = true;
-          break;
-        }
-      }
-
-      if(!discard_tri)
-      {
-        //Here we learn that it is always better name the constants vertex_sz
-        //and blablabla instead of just throwing 12's, 7's, 4's around =)
-        memcpy(&clipped[clipped_last], &vbuffer[p_id], 3*vertex_sz*sizeof(float));
-        clipped_last += 3*vertex_sz;
-      }
-    }
+      //the blit scales the frame up to the window
+      mShader.bind();
+      mShader.setUniform("frame", 0);
+      mShader.setUniform("frame_size", Vector2f((float)mUpload->width(), (float)mUpload->height()));
 
-    //perspective division
-    int projected_last = 0;
-    for(int v_id = 0; v_id < clipped_last; v_id += vertex_sz)
-    {
-      float w = clipped[v_id+3];
-
-      projected[projected_last+0] = clipped[v_id+0]/w;
-      projected[projected_last+1] = clipped[v_id+1]/w;
-      projected[projected_last+2] = clipped[v_id+2]/w;
-      projected[projected_last+3] = 1.0f;
-      projected[projected_last+4] = clipped[v_id+4]/w;
-      projected[projected_last+5] = clipped[v_id+5]/w;
-      projected[projected_last+6] = clipped[v_id+6]/w;
-      projected[projected_last+7] = 1.0f/w;
-
-      //we'll still keep all the 8 floats for simplicity!
-      projected_last += vertex_sz;
+      //draw stuff
+      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+      mShader.drawArray(GL_TRIANGLES, 0, 6);
     }
-
-    //triangle culling
-    //TODO: In OpenGL architecture, culling happens in the primitive
-    //assembly stage, which is the first part of rasterization
-    int culled_last = 0;
-    for(int p_id = 0; p_id < projected_last; p_id += 3*vertex_sz)
+    profiler.record("upload and display", upload_start, Profiler::clock::now());
+
+    //framerate of the render thread, which no longer
+    //has anything to do with the one of the window
+    float elapsed = frame ? frame->ms / 1000.0f : 0.0f;
+    framerate_almost->setCaption( "AlmostGL: " + std::to_string(elapsed > 0.0f ? 1.0f/elapsed : 0.0f) );
+    framerate_open->setCaption( "OpenGL: " + std::to_string(mOGL->framerate) +
+                                " (GPU " + std::to_string(mOGL->gpu_time) + " ms)" );
+    window_dimension->setCaption(std::to_string(this->width())
+                                  + "x" + std::to_string(this->height())
+                                  + " (AlmostGL " + std::to_string(mUpload->width())
+                                  + "x" + std::to_string(mUpload->height()) + ")");
+
+    //live breakdown, AlmostGL's first
+    std::vector<Profiler::Entry> entries = profiler.summary(PROFILE_FRAMES);
+    if(frame) entries.insert(entries.begin(), frame->breakdown.begin(), frame->breakdown.end());
+    bool new_lines = profile_lines.size() < entries.size();
+    while(profile_lines.size() < entries.size())
+      profile_lines.push_back(new nanogui::Label(profile_panel, ""));
+    for(size_t i = 0; i < entries.size(); ++i)
     {
-      //Data layout per vertex inside _projected_ is:
-      //... X1 Y1 Z1 W1 R1 G1 B1 X2 Y2 Z2 W2 R2 G2 B2 X3 Y3 Z3 W3 R3 G3 B3 ...
-      //
-      //TODO: we could guarantee optimization by using an incrementer instead of
-      //computing products vertex_sz*i, but maybe the compiler already does this
-      vec3 v0(projected[p_id+vertex_sz*0+0], projected[p_id+vertex_sz*0+1], 1.0f);
-      vec3 v1(projected[p_id+vertex_sz*1+0], projected[p_id+vertex_sz*1+1], 1.0f);
-      vec3 v2(projected[p_id+vertex_sz*2+0], projected[p_id+vertex_sz*2+1], 1.0f);
-
-      //compute cross product p = v0v1 X v0v2;
-      //if p is pointing outside the screen, v0v1v2 are defined
-      //in counter-clockwise order. then, reject or accept this
-      //triangle based on the param.front_face flag.
-      vec3 c = (v1-v0).cross(v2-v0);
-
-      //cull clockwise triangles
-      if(param.front_face == GL_CCW && c(2) < 0 ||
-          param.front_face == GL_CW && c(2) > 0) continue;
-
-      //copy to final buffer
-      memcpy(&culled[culled_last], &projected[p_id], 3*vertex_sz*sizeof(float));
-      culled_last += 3*vertex_sz;
+      char line[128];
+      if(entries[i].is_counter)
+        snprintf(line, sizeof(line), "%s: %.2f", entries[i].name.c_str(), entries[i].value);
+      else
+        snprintf(line, sizeof(line), "%s: %.3f ms", entries[i].name.c_str(), entries[i].value);
+      profile_lines[i]->setCaption(line);
     }
-
-    //rasterization
-    #define PIXEL(i,j) (4*(i*buffer_width+j))
-    #define SET_PIXEL(i,j,r,g,b) { color[PIXEL(i,j)+0] = r; \
-                                   color[PIXEL(i,j)+1] = g; \
-                                   color[PIXEL(i,j)+2] = b; \
-                                   color[PIXEL(i,j)+3] = 255;}
-
-     //clear color and depth buffers
-     memset((void*)color, 0, (4*buffer_width*buffer_height)*sizeof(GLubyte));
-     for(int i = 0; i < buffer_width*buffer_height; ++i) depth[i] = 2.0f;
-
-     for(int p_id = 0; p_id < culled_last; p_id += 3*vertex_sz)
-     {
-       #define ROUND(x) ((int)(x + 0.5f))
-       struct Vertex
-       {
-         float x, y;
-         vec3 color;
-         float z, w;
-
-         Vertex() {}
-
-         Vertex(const float* v_packed, const mat4& vp)
-         {
-           //we need x and y positions mapped to the viewport and
-           //with integer coordinates, otherwise we'll have displacements
-           //for start and end which are huge when because of 0 < dy < 1;
-           //these cases must be treated as straight, horizontal lines.
-           vec4 pos = vp*vec4(v_packed[0], v_packed[1], 1.0f, 1.0f);
-           x = ROUND(pos(0)); y = ROUND(pos(1));
-           color = vec3(v_packed[4], v_packed[5], v_packed[6]);
-           z = v_packed[2]; w = v_packed[7];
-         }
-
-         Vertex operator-(const Vertex& rhs)
-         {
-           Vertex out;
-           out.x = x - rhs.x;
-           out.y = y - rhs.y;
-           out.color = color - rhs.color;
-           out.z = z - rhs.z;
-           out.w = w - rhs.w; //TODO: not sure if I should do this
-           return out;
-         }
-
-         void operator+=(const Vertex& rhs)
-         {
-           x += rhs.x;
-           y += rhs.y;
-           color = color + rhs.color;
-           z += rhs.z;
-           w += rhs.w; //TODO: not sure if I should do this neither
-         }
-
-         Vertex operator/(float k)
-         {
-           Vertex out;
-           out.x = x / k;
-           out.y = y / k;
-           out.color = color * (1.0f/k);
-           out.z = z / k;
-           out.w = w / k;
-           return out;
-         }
-       };
-
-       //unpack vertex data into structs so we can
-       //easily interpolate/operate them.
-       //TODO: To better reflect OpenGL structure, viewport
-       //transformation should be applied after perspective
-       //division and before triangle culling, which should
-       //happen in primitive assembly
-       Vertex v0(&culled[p_id+0*vertex_sz], viewport);
-       Vertex v1(&culled[p_id+1*vertex_sz], viewport);
-       Vertex v2(&culled[p_id+2*vertex_sz], viewport);
-
-       //order vertices by y coordinate
-       #define SWAP(a,b) { Vertex aux = b; b = a; a = aux; }
-       if( v0.y > v1.y ) SWAP(v0, v1);
-       if( v0.y > v2.y ) SWAP(v0, v2);
-       if( v1.y > v2.y ) SWAP(v1, v2);
-
-       //these dVdy_ variables define how much we must
-       //increment v when increasing one unit in y, so
-       //we can use this to compute the start and end
-       //boundaries for rasterization. Notice that not
-       //only this defines the actual x coordinate of the
-       //fragment in the scanline, but all the other
-       //attributes. Also, notice that y is integer and
-       //thus if we make dy0 = (v1.y-v0.y) steps in y, for intance,
-       //incrementing v0 with dVdy0 at each step, by the end of
-       //the dy steps we'll have:
-       //
-       // v0 + dy0 * dVdy0 = v0 + dy0*(v1-v0)/dy0 = v0 + v1 - v0 = v1
-       //
-       //which is exactly what we want, a linear interpolation
-       //between v0 and v1 with dy0 steps
-       Vertex dV_dy0 = (v1-v0)/(v1.y-v0.y);
-       Vertex dV_dy1 = (v2-v0)/(v2.y-v0.y);
-       Vertex dV_dy2 = (v2-v1)/(v2.y-v1.y);
-       Vertex start, end;
-       Vertex dStart_dy, dEnd_dy;
-
-       //this will tell us whether we should change dStart_dy
-       //or dEnd_dy to the next active edge (dV_dy2) when we
-       //reach halfway the triangle
-       Vertex *next_active_edge;
-
-       //decide start/end edges. If v1 is to the left
-       //side of the edge connecting v0 and v2, then v0v1
-       //is the starting edge and v0v2 is the ending edge;
-       //if v1 is to the right, it is the contrary.
-       //the v0v1 edge will be substituted by the v1v2 edge
-       //when we reach the v1 vertex while scanlining, so we
-       //store which of the start/end edges we should replace
-       //with v1v2.
-       vec3 right_side = vec3(v1.x-v0.x, v1.y-v0.y, 0.0f).cross(vec3(v2.x-v0.x, v2.y-v0.y, 0.0f));
-       if( right_side(2) > 0.0f )
-       {
-         dEnd_dy = dV_dy0;
-         dStart_dy = dV_dy1;
-         next_active_edge = &dEnd_dy;
-       }
-       else
-       {
-         dEnd_dy = dV_dy1;
-         dStart_dy = dV_dy0;
-         next_active_edge = &dStart_dy;
-       }
-
-       //handle flat top triangles
-       if( v0.y == v1.y )
-       {
-         //switch active edge and update
-         //starting and ending points
-         if( v0.x < v1.x )
-         {
-           dEnd_dy = dV_dy2;
-           start = v0; end = v1;
-         }
-         else
-         {
-           dStart_dy = dV_dy2;
-           start = v1; end = v0;
-         }
-       }
-       else start = end = v0;
-
-       //loop over scanlines
-       for(int y = v0.y; y <= v2.y; ++y)
-       {
-         //rasterize scanline
-         int s = ROUND(start.x), e = ROUND(end.x);
-         Vertex dV_dx = (end - start)/(e - s);
-         Vertex f = start;
-
-         for(int x = s; x <= e; ++x)
-         {
-           //in order to draw only the edges, we skip this
-           //the scanline rasterization in all points but
-           //the extremities
-           if(param.draw_mode == GL_LINE && (x != s && x != e)) continue;
-
-           // To better represent what the pipeline does, we should, in the
-           // following order:
-           //
-           // 1) perform early fragment tests at this point (which include
-           // depth buffering, scissor testing and stencil buffering, for
-           // for example), which decide whether this fragment will live
-           // or not. Notice that at this point, a fragment is the set of
-           // attributes interpolated by the rasterizer;
-           //
-           // 2) evaluate fragment shader to compute a pixel sample from the
-           // fragment's attributes;
-           //
-           // 3) perform per-sample operations like alpha
-           // blending using the sample computed in the previous stage;
-           //
-           // It is interesting to notice that, as of version 4.6, the OpenGL
-           // specification calls "per-fragment
-           // operations" both early fragment tests (which MAY be performed
-           // before or after fragment shader evaluation, but executing before
-           // allows us to discard fragments without evaluating them) and
-           // per-sample operations (like like alpha blending, dithering and
-           // sRGB conversions), which MUST be performed after fragment shader
-           // evaluation because we need a pixel sample.
-
-           // Here we mixed things in the same code for simplicity
-           if( f.z < depth[y*buffer_width+x] )  // early fragment tests
-           {
-             depth[y*buffer_width+x] = f.z;     // early fragment tests
-
-             vec3 c = f.color * (1.0f / f.w);   // output of the rasterizer
-
-                                                // fragment shader comes here
-
-             int R = std::min(255, (int)(c(0)*255.0f)); // framebuffer writing
-             int G = std::min(255, (int)(c(1)*255.0f));
-             int B = std::min(255, (int)(c(2)*255.0f));
-
-             SET_PIXEL(y, x, R, G, B);
-           }
-
-           f += dV_dx;
-         }
-
-         //switch active edges if halfway through the triangle
-         //This MUST be done before incrementing, otherwise
-         //once we reached v1 we would pass through it and
-         //start coming back only in the next step, causing
-         //the big "leaking" triangles!
-         if( y == (int)v1.y ) *next_active_edge = dV_dy2;
-
-         //increment bounds
-         start += dStart_dy; end += dEnd_dy;
-       }
-     }
-
-    //-------------------------------------------------------
-    //---------------------- DISPLAY ------------------------
-    //-------------------------------------------------------
-    // send to GPU in texture unit 0
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, color_gpu);
-
-    //WARNING: be careful with RGB pixel data
-    //as OpenGL expects 4-byte aligned data
-    //https://www.khronos.org/opengl/wiki/Common_Mistakes#Texture_upload_and_pixel_reads
-    glPixelStorei(GL_UNPACK_LSB_FIRST, 0);
-    glTexSubImage2D(GL_TEXTURE_2D,
-                    0, 0, 0,
-                    buffer_width,
-                    buffer_height,
-                    GL_RGBA,
-                    GL_UNSIGNED_BYTE,
-                    color);
-
-    //WARNING: IF WE DON'T SET THIS IT WON'T WORK!
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-    mShader.bind();
-    mShader.setUniform("frame", 0);
-
-    //draw stuff
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    mShader.drawArray(GL_TRIANGLES, 0, 6);
-
-    //framerate
-    start = clock() - start;
-    framerate_almost->setCaption( "AlmostGL: " + std::to_string(CLOCKS_PER_SEC/(float)start) );
-    framerate_open->setCaption( "OpenGL: " + std::to_string(mOGL->framerate) );
-    window_dimension->setCaption(std::to_string(this->width())
-                                  + "x" + std::to_string(this->height()));
+    if(new_lines) performLayout();
   }
 };
 
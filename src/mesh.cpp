@@ -1,8 +1,103 @@
 #include "../include/mesh.h"
 #include <cstdio>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <unordered_map>
 #include <glm/gtx/string_cast.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <sys/stat.h>
+
+Mesh::Mesh() : mapping(nullptr), mapping_size(0), reorder(true), radius(0.0f),
+                mPos(nullptr, 3, 0), mNormal(nullptr, 3, 0),
+                mMaterial(nullptr, 1, 0), mIndices(nullptr, 3, 0)
+{
+}
+
+Mesh::Mesh(const std::string& path) : Mesh()
+{
+  load_file(path);
+}
+
+Mesh::~Mesh()
+{
+  release();
+}
+
+void Mesh::bind_views(float* vertices, uint32_t* materials, uint32_t* indices, int n_vertices,
+                      const BVHNode* nodes, const NormalCone* cones,
+                      const LevelSize* levels, int n_levels)
+{
+  lods.clear(); lod_errors.clear();
+  uint32_t first_triangle = 0, first_node = 0;
+  for(int i = 0; i < n_levels; ++i)
+  {
+    MeshLOD l = { indices + 3*first_triangle, (int)levels[i].n_triangles,
+                  nodes + first_node, cones + first_node, (int)levels[i].n_nodes,
+                  levels[i].error, first_triangle, first_node };
+    lods.push_back(l);
+    lod_errors.push_back(l.error);
+    first_triangle += l.n_triangles;
+    first_node += l.n_nodes;
+  }
+
+  //Eigen::Map can't be reassigned, so we build
+  //the new ones over the old ones (as Eigen's docs suggest)
+  new (&mPos) MatrixView(vertices + 0*n_vertices, 3, n_vertices);
+  new (&mNormal) MatrixView(vertices + 3*n_vertices, 3, n_vertices);
+  new (&mMaterial) IndexView(materials, 1, n_vertices);
+  new (&mIndices) IndexView(indices, 3, n_levels > 0 ? lods[0].n_triangles : 0);
+
+  //the root of the full resolution BVH bounds the mesh
+  center[0] = center[1] = center[2] = radius = 0.0f;
+  if(n_levels > 0 && lods[0].n_nodes > 0)
+  {
+    const BVHNode& root = lods[0].nodes[0];
+    float r2 = 0.0f;
+    for(int k = 0; k < 3; ++k)
+    {
+      center[k] = 0.5f*(root.min[k] + root.max[k]);
+      r2 += 0.25f*(root.max[k] - root.min[k])*(root.max[k] - root.min[k]);
+    }
+    radius = sqrtf(r2);
+  }
+}
+
+int Mesh::total_triangles() const
+{
+  return lods.empty() ? 0 : lods.back().first_triangle + lods.back().n_triangles;
+}
+
+int Mesh::select_level(const float* model, const float* eye, float fovx, float fovy,
+                       int width, int height, float max_pixels) const
+{
+  if(lods.size() < 2) return 0;
+  return LOD::select(lod_errors.data(), lods.size(), model, center, radius,
+                     eye, fovx, fovy, width, height, max_pixels);
+}
+
+void Mesh::load_file(const std::string& path)
+{
+  //the cache is only valid if it was written after the last time the
+  //text file was modified. times are compared to the nanosecond, and
+  //equal ones don't count as after: a model exported again within the
+  //second the cache was written in must be parsed again
+  std::string cache = cache_path(path);
+  struct stat text_stat, cache_stat;
+  auto newer = [](const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec != b.tv_sec ? a.tv_sec > b.tv_sec : a.tv_nsec > b.tv_nsec;
+  };
+  if( stat(cache.c_str(), &cache_stat) == 0 &&
+      (stat(path.c_str(), &text_stat) != 0 || newer(cache_stat.st_mtim, text_stat.st_mtim)) &&
+      load_cache(cache) ) return;
+
+  //nothing worth caching if the model couldn't be read
+  load_text(path);
+  if(mIndices.cols() == 0) return;
+
+  if(!write_cache(cache))
+    std::cout<<"Could not write mesh cache "<<cache<<std::endl;
+}
 
 void Mesh::transform_to_center(glm::mat4& M)
 {
@@ -50,10 +145,12 @@ void Mesh::transform_to_center(glm::mat4& M)
   M = from_origin * scale * to_origin;
 }
 
-void Mesh::load_file(const std::string& path)
+void Mesh::load_text_scanf(const std::string& path)
 {
+  release();
   tris.clear(); mats.clear();
   FILE *file = fopen( path.c_str(), "r");
+  if(!file) return;
 
   //1. name
   char obj_name[100];
@@ -62,12 +159,10 @@ void Mesh::load_file(const std::string& path)
   //2. triangle count
   int n_tris;
   fscanf(file, "# triangles = %d\n", &n_tris);
-  mPos = Eigen::MatrixXf(3, 3*n_tris);
-  mNormal = Eigen::MatrixXf(3, 3*n_tris);
-  mAmb = Eigen::MatrixXf(3, 3*n_tris);
-  mDiff = Eigen::MatrixXf(3, 3*n_tris);
-  mSpec = Eigen::MatrixXf(3, 3*n_tris);
-  mShininess = Eigen::MatrixXf(1, 3*n_tris);
+  //per-corner data, merged into unique vertices after reading
+  Eigen::MatrixXf mPos(3, 3*n_tris);
+  Eigen::MatrixXf mNormal(3, 3*n_tris);
+  std::vector<uint32_t> mMaterial(3*n_tris);
 
   //3. material count
   int n_mats;
@@ -96,34 +191,19 @@ void Mesh::load_file(const std::string& path)
     fscanf(file, "v0 %f %f %f %f %f %f %d\n", &mPos(0, tri_index+0), &mPos(1, tri_index+0), &mPos(2, tri_index+0),
                                               &mNormal(0, tri_index+0), &mNormal(1, tri_index+0), &mNormal(2, tri_index+0),
                                               &m_index_v0);
-
-    Material mv0 = mats_buffer[m_index_v0];
-    mAmb.col(tri_index)<<mv0.a[0], mv0.a[1], mv0.a[2];
-    mDiff.col(tri_index)<<mv0.d[0], mv0.d[1], mv0.d[2];
-    mSpec.col(tri_index)<<mv0.s[0], mv0.s[1], mv0.s[2];
-    mShininess.col(tri_index)<<mv0.shininess;
+    mMaterial[tri_index] = m_index_v0;
 
     int m_index_v1;
     fscanf(file, "v1 %f %f %f %f %f %f %d\n", &mPos(0, tri_index+1), &mPos(1, tri_index+1), &mPos(2, tri_index+1),
                                               &mNormal(0, tri_index+1), &mNormal(1, tri_index+1), &mNormal(2, tri_index+1),
                                               &m_index_v1);
-
-    Material mv1 = mats_buffer[m_index_v1];
-    mAmb.col(tri_index+1)<<mv1.a[0], mv1.a[1], mv1.a[2];
-    mDiff.col(tri_index+1)<<mv1.d[0], mv1.d[1], mv1.d[2];
-    mSpec.col(tri_index+1)<<mv1.s[0], mv1.s[1], mv1.s[2];
-    mShininess.col(tri_index+1)<<mv1.shininess;
+    mMaterial[tri_index+1] = m_index_v1;
 
     int m_index_v2;
     fscanf(file, "v2 %f %f %f %f %f %f %d\n", &mPos(0, tri_index+2), &mPos(1, tri_index+2), &mPos(2, tri_index+2),
                                               &mNormal(0, tri_index+2), &mNormal(1, tri_index+2), &mNormal(2, tri_index+2),
                                               &m_index_v2);
-
-    Material mv2 = mats_buffer[m_index_v2];
-    mAmb.col(tri_index+2)<<mv2.a[0], mv2.a[1], mv2.a[2];
-    mDiff.col(tri_index+2)<<mv2.d[0], mv2.d[1], mv2.d[2];
-    mSpec.col(tri_index+2)<<mv2.s[0], mv2.s[1], mv2.s[2];
-    mShininess.col(tri_index+2)<<mv2.shininess;
+    mMaterial[tri_index+2] = m_index_v2;
 
     float fn1, fn2, fn3;
     fscanf(file, "face normal %f %f %f\n", &fn1, &fn2, &fn3);
@@ -132,4 +212,147 @@ void Mesh::load_file(const std::string& path)
   }
 
   fclose(file);
+
+  mats = mats_buffer;
+  index_vertices(mPos, mNormal, mMaterial);
+}
+
+namespace
+{
+  //all the data of a vertex (position, normal and
+  //material index), compared bitwise
+  struct VertexKey
+  {
+    float e[7];
+
+    bool operator==(const VertexKey& rhs) const
+    {
+      return memcmp(e, rhs.e, sizeof(e)) == 0;
+    }
+  };
+
+  struct VertexKeyHash
+  {
+    size_t operator()(const VertexKey& k) const
+    {
+      //FNV-1a over the raw bytes
+      const unsigned char* b = (const unsigned char*)k.e;
+      size_t h = 14695981039346656037ULL;
+      for(size_t i = 0; i < sizeof(k.e); ++i) { h ^= b[i]; h *= 1099511628211ULL; }
+      return h;
+    }
+  };
+}
+
+void Mesh::index_vertices(const Eigen::MatrixXf& pos, const Eigen::MatrixXf& normal,
+                          const std::vector<uint32_t>& material)
+{
+  int n_corners = pos.cols();
+  index_storage.resize(n_corners);
+  uint32_t* indices = index_storage.data();
+
+  //sort the triangles by the BVH first, so that every node covers a
+  //range of them. numbering vertices in the order the sorted triangles
+  //use them keeps the vertices of a node close together as well
+  std::vector<uint32_t> corners(n_corners);
+  for(int c = 0; c < n_corners; ++c) corners[c] = c;
+  BVH::build(pos.data(), corners.data(), n_corners/3, bvh_storage, cone_storage);
+
+  //first pass: find the unique vertices and index them
+  //in the order they first appear in the sorted triangles
+  std::unordered_map<VertexKey, uint32_t, VertexKeyHash> unique;
+  unique.reserve(n_corners);
+  std::vector<int> first_corner;
+  first_corner.reserve(n_corners);
+
+  for(int c = 0; c < n_corners; ++c)
+  {
+    int src = corners[c];
+    VertexKey k;
+    for(int i = 0; i < 3; ++i)
+    {
+      k.e[0+i] = pos(i,src);  k.e[3+i] = normal(i,src);
+    }
+    memcpy(&k.e[6], &material[src], sizeof(uint32_t));
+
+    auto it = unique.insert( std::make_pair(k, (uint32_t)first_corner.size()) );
+    if(it.second) first_corner.push_back(src);
+    indices[c] = it.first->second;
+  }
+
+  //second pass: keep only the columns of the unique vertices
+  int n_unique = first_corner.size();
+  vertex_storage.resize(6*n_unique);
+  material_storage.resize(n_unique);
+  for(int v = 0; v < n_unique; ++v)
+  {
+    int c = first_corner[v];
+    for(int i = 0; i < 3; ++i)
+    {
+      vertex_storage[3*v+i] = pos(i,c);
+      vertex_storage[3*(n_unique+v)+i] = normal(i,c);
+    }
+    material_storage[v] = material[c];
+  }
+
+  //subtrees are swapped for less overdraw, the triangles of each leaf
+  //sorted for the vertex cache and vertices numbered again in the
+  //order those use them (see reorder.h)
+  int n_tris = n_corners/3;
+  if(reorder)
+  {
+    Reorder::overdraw(vertex_storage.data(), index_storage.data(), n_tris, bvh_storage, cone_storage);
+    Reorder::vertex_cache(index_storage.data(), n_tris, n_unique, bvh_storage.data(), bvh_storage.size());
+
+    std::vector<uint32_t> remap;
+    Reorder::vertex_fetch(index_storage.data(), n_corners, n_tris, n_unique, remap);
+    std::vector<float> vertices(6*n_unique);
+    std::vector<uint32_t> materials(n_unique);
+    for(int v = 0; v < n_unique; ++v)
+    {
+      for(int i = 0; i < 3; ++i)
+      {
+        vertices[3*remap[v]+i] = vertex_storage[3*v+i];
+        vertices[3*(n_unique+remap[v])+i] = vertex_storage[3*(n_unique+v)+i];
+      }
+      materials[remap[v]] = material_storage[v];
+    }
+    vertex_storage.swap(vertices);
+    material_storage.swap(materials);
+  }
+
+  //coarser levels go after the full resolution one,
+  //each with its triangles sorted by its own BVH
+  std::vector< std::vector<uint32_t> > simplified;
+  std::vector<float> errors;
+  LOD::build_chain(vertex_storage.data(), material_storage.data(), n_unique,
+                   index_storage.data(), n_tris, simplified, errors);
+
+  std::vector<LevelSize> levels(1);
+  levels[0].n_triangles = n_tris;
+  levels[0].n_nodes = bvh_storage.size();
+  levels[0].error = 0.0f;
+  levels[0].reordered = reorder;
+  for(size_t l = 0; l < simplified.size(); ++l)
+  {
+    std::vector<BVHNode> nodes;
+    std::vector<NormalCone> cones;
+    std::vector<uint32_t>& level = simplified[l];
+    int n = level.size()/3;
+    BVH::build(vertex_storage.data(), level.data(), n, nodes, cones);
+    if(reorder)
+    {
+      Reorder::overdraw(vertex_storage.data(), level.data(), n, nodes, cones);
+      Reorder::vertex_cache(level.data(), n, n_unique, nodes.data(), nodes.size());
+    }
+
+    LevelSize size = { (uint32_t)n, (uint32_t)nodes.size(), errors[l], (uint32_t)reorder };
+    levels.push_back(size);
+    index_storage.insert(index_storage.end(), level.begin(), level.end());
+    bvh_storage.insert(bvh_storage.end(), nodes.begin(), nodes.end());
+    cone_storage.insert(cone_storage.end(), cones.begin(), cones.end());
+  }
+
+  bind_views(vertex_storage.data(), material_storage.data(), index_storage.data(), n_unique,
+              bvh_storage.data(), cone_storage.data(), levels.data(), levels.size());
 }
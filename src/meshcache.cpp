@@ -0,0 +1,239 @@
+#include "../include/mesh.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Binary mesh cache. The file is laid out so that it can be
+//mmap'ed and used as is, with no parsing nor copies:
+//
+//  header                        (64 bytes)
+//  material table                (n_materials * 10 floats: a, d, s, shininess)
+//  level table                   (n_levels * Mesh::LevelSize, 16 bytes each)
+//  vertex block, 64-byte aligned (6 * n_vertices floats, see Mesh::bind_views)
+//  vertex materials, aligned     (n_vertices uint32, indices into the table)
+//  index block, 64-byte aligned  (3 * n_triangles uint32, all levels)
+//  BVH nodes, 64-byte aligned    (BVHNode, as many as the levels add up to)
+//  BVH normal cones              (NormalCone, one per node, up to the end of the file)
+//
+//Everything is stored in the native byte order. The byte_order
+//field lets us refuse files written by a machine with another one.
+#define CACHE_MAGIC "AGLMESH"
+#define CACHE_VERSION 5
+#define CACHE_ALIGN 64
+
+namespace
+{
+  struct CacheHeader
+  {
+    char magic[8];
+    uint32_t version, byte_order;
+    uint32_t n_vertices, n_triangles, n_materials;
+    uint32_t n_levels;
+    uint64_t vertices_offset, vertex_materials_offset;
+    uint64_t indices_offset, file_size;
+  };
+
+  static_assert(sizeof(CacheHeader) <= CACHE_ALIGN, "cache header must fit in 64 bytes");
+
+  uint64_t align(uint64_t offset)
+  {
+    return (offset + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+  }
+
+  //the level table follows the material table, and the BVH nodes
+  //and their cones end the file, so their offsets don't need fields
+  //of their own. the number of nodes comes from the level table
+  uint64_t levels_offset(const CacheHeader& h)
+  {
+    return CACHE_ALIGN + 10*sizeof(float)*(uint64_t)h.n_materials;
+  }
+
+  uint64_t cones_offset(const CacheHeader& h, uint64_t n_nodes)
+  {
+    return h.file_size - sizeof(NormalCone)*n_nodes;
+  }
+
+  uint64_t bvh_offset(const CacheHeader& h, uint64_t n_nodes)
+  {
+    return cones_offset(h, n_nodes) - sizeof(BVHNode)*n_nodes;
+  }
+
+  //fills the counts and computes where each block goes
+  void layout(CacheHeader& h, uint32_t n_vertices, uint32_t n_triangles,
+              uint32_t n_materials, uint32_t n_levels, uint64_t n_nodes)
+  {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    h.version = CACHE_VERSION;
+    h.byte_order = 0x01020304;
+    h.n_vertices = n_vertices;
+    h.n_triangles = n_triangles;
+    h.n_materials = n_materials;
+    h.n_levels = n_levels;
+
+    //the material table always starts right after the header
+    h.vertices_offset = align(levels_offset(h) + 16*(uint64_t)n_levels);
+    h.vertex_materials_offset = align(h.vertices_offset + 6*sizeof(float)*(uint64_t)n_vertices);
+    h.indices_offset = align(h.vertex_materials_offset + sizeof(uint32_t)*(uint64_t)n_vertices);
+    uint64_t bvh = align(h.indices_offset + 3*sizeof(uint32_t)*(uint64_t)n_triangles);
+    h.file_size = bvh + (sizeof(BVHNode) + sizeof(NormalCone))*n_nodes;
+  }
+}
+
+std::string Mesh::cache_path(const std::string& path)
+{
+  return path + ".cache";
+}
+
+void Mesh::release()
+{
+  if(mapping) munmap(mapping, mapping_size);
+  mapping = nullptr; mapping_size = 0;
+
+  std::vector<float>().swap(vertex_storage);
+  std::vector<uint32_t>().swap(material_storage);
+  std::vector<uint32_t>().swap(index_storage);
+  std::vector<BVHNode>().swap(bvh_storage);
+  std::vector<NormalCone>().swap(cone_storage);
+  bind_views(nullptr, nullptr, nullptr, 0, nullptr, nullptr, nullptr, 0);
+}
+
+bool Mesh::load_cache(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader))
+  {
+    close(fd);
+    return false;
+  }
+
+  //the mapping stays valid after the descriptor is closed
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return false;
+
+  //the level table tells how many nodes there are, so it's
+  //read (if it's inside the file at all) before the header is
+  //validated against what we would have written
+  static_assert(sizeof(LevelSize) == 16, "layout() takes levels to be 16 bytes");
+  CacheHeader h, expected;
+  memcpy(&h, data, sizeof(h));
+  const LevelSize* levels = (const LevelSize*)((char*)data + levels_offset(h));
+  bool ok = levels_offset(h) + sizeof(LevelSize)*(uint64_t)h.n_levels <= (uint64_t)st.st_size;
+
+  uint64_t n_nodes = 0, n_triangles = 0;
+  for(uint32_t i = 0; ok && i < h.n_levels; ++i)
+  {
+    n_nodes += levels[i].n_nodes;
+    n_triangles += levels[i].n_triangles;
+    ok = levels[i].reordered == (uint32_t)reorder;
+  }
+
+  if(ok) layout(expected, h.n_vertices, h.n_triangles, h.n_materials, h.n_levels, n_nodes);
+  if( !ok || memcmp(&h, &expected, sizeof(h)) != 0 || h.file_size != (uint64_t)st.st_size ||
+      n_triangles != h.n_triangles || h.n_levels == 0 )
+  {
+    munmap(data, st.st_size);
+    return false;
+  }
+
+  release();
+  tris.clear();
+  mapping = data; mapping_size = st.st_size;
+
+  //the material table is tiny, so this one we copy
+  const float* m = (const float*)((char*)data + CACHE_ALIGN);
+  mats.resize(h.n_materials);
+  for(uint32_t i = 0; i < h.n_materials; ++i, m += 10)
+  {
+    mats[i].a = RGB(m[0], m[1], m[2]);
+    mats[i].d = RGB(m[3], m[4], m[5]);
+    mats[i].s = RGB(m[6], m[7], m[8]);
+    mats[i].shininess = m[9];
+  }
+
+  //the views point straight into the read-only mapping;
+  //writing to them would crash, but nobody should
+  bind_views((float*)((char*)data + h.vertices_offset),
+              (uint32_t*)((char*)data + h.vertex_materials_offset),
+              (uint32_t*)((char*)data + h.indices_offset), h.n_vertices,
+              (const BVHNode*)((char*)data + bvh_offset(h, n_nodes)),
+              (const NormalCone*)((char*)data + cones_offset(h, n_nodes)),
+              levels, h.n_levels);
+
+  return true;
+}
+
+bool Mesh::write_cache(const std::string& path) const
+{
+  //levels are contiguous, one after the other
+  std::vector<LevelSize> levels;
+  for(size_t i = 0; i < lods.size(); ++i)
+  {
+    LevelSize size = { (uint32_t)lods[i].n_triangles, (uint32_t)lods[i].n_nodes,
+                       lods[i].error, (uint32_t)reorder };
+    levels.push_back(size);
+  }
+  int n_triangles = total_triangles();
+  uint64_t n_nodes = lods.empty() ? 0 : lods.back().first_node + lods.back().n_nodes;
+
+  CacheHeader h;
+  layout(h, mPos.cols(), n_triangles, mats.size(), levels.size(), n_nodes);
+
+  //write to a temporary file and rename it afterwards, so that
+  //a crash never leaves a half written cache behind
+  std::string tmp = path + ".tmp";
+  FILE* file = fopen(tmp.c_str(), "wb");
+  if(!file) return false;
+
+  //blocks are written in order, padding the gaps with zeros
+  static const char zeros[CACHE_ALIGN] = {0};
+  bool ok = fwrite(&h, sizeof(h), 1, file) == 1;
+  uint64_t end = sizeof(h);
+  ok = ok && fwrite(zeros, 1, CACHE_ALIGN - end, file) == CACHE_ALIGN - end;
+
+  for(size_t i = 0; i < mats.size(); ++i)
+  {
+    const Material& cur = mats[i];
+    float packed[10] = { cur.a[0], cur.a[1], cur.a[2],
+                         cur.d[0], cur.d[1], cur.d[2],
+                         cur.s[0], cur.s[1], cur.s[2],
+                         cur.shininess };
+    ok = ok && fwrite(packed, sizeof(packed), 1, file) == 1;
+  }
+  ok = ok && fwrite(levels.data(), sizeof(LevelSize), levels.size(), file) == levels.size();
+  end = levels_offset(h) + sizeof(LevelSize)*levels.size();
+  ok = ok && fwrite(zeros, 1, h.vertices_offset - end, file) == h.vertices_offset - end;
+
+  //views are contiguous in the same order as the vertex block
+  int n = mPos.cols();
+  ok = ok && fwrite(mPos.data(), sizeof(float), 3*n, file) == (size_t)3*n;
+  ok = ok && fwrite(mNormal.data(), sizeof(float), 3*n, file) == (size_t)3*n;
+  end = h.vertices_offset + 6*sizeof(float)*(uint64_t)n;
+  ok = ok && fwrite(zeros, 1, h.vertex_materials_offset - end, file) == h.vertex_materials_offset - end;
+
+  ok = ok && fwrite(mMaterial.data(), sizeof(uint32_t), n, file) == (size_t)n;
+  end = h.vertex_materials_offset + sizeof(uint32_t)*(uint64_t)n;
+  ok = ok && fwrite(zeros, 1, h.indices_offset - end, file) == h.indices_offset - end;
+
+  ok = ok && fwrite(mIndices.data(), sizeof(uint32_t), 3*n_triangles, file) == (size_t)3*n_triangles;
+  end = h.indices_offset + 3*sizeof(uint32_t)*(uint64_t)n_triangles;
+  ok = ok && fwrite(zeros, 1, bvh_offset(h, n_nodes) - end, file) == bvh_offset(h, n_nodes) - end;
+
+  const BVHNode* nodes = lods.empty() ? nullptr : lods[0].nodes;
+  const NormalCone* cones = lods.empty() ? nullptr : lods[0].cones;
+  ok = ok && fwrite(nodes, sizeof(BVHNode), n_nodes, file) == n_nodes;
+  ok = ok && fwrite(cones, sizeof(NormalCone), n_nodes, file) == n_nodes;
+  ok = (fclose(file) == 0) && ok;
+  if(ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+  if(!ok) remove(tmp.c_str());
+
+  return ok;
+}
@@ -0,0 +1,295 @@
+#include "../include/mesh.h"
+#include "../include/threadpool.h"
+#include <cmath>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Fast parser for the text model format. The file is mmap'ed,
+//the triangle section is split into chunks that start at "v0"
+//lines and each chunk is parsed by a different thread straight
+//into the per-corner matrices. Numbers are parsed by hand, which
+//is a lot faster than going through fscanf and the locale.
+
+namespace
+{
+  //read-only position inside the mapped file
+  struct Cursor
+  {
+    const char *p, *end;
+
+    void skip_ws()
+    {
+      while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+    }
+
+    //matches a word after optional whitespace, like a
+    //literal in a fscanf format string would
+    bool expect(const char* word)
+    {
+      skip_ws();
+      size_t n = strlen(word);
+      if((size_t)(end - p) < n || memcmp(p, word, n) != 0) return false;
+      p += n;
+      return true;
+    }
+
+    bool skip_token()
+    {
+      skip_ws();
+      const char* start = p;
+      while(p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') ++p;
+      return p != start;
+    }
+
+    void skip_line()
+    {
+      const char* nl = (const char*)memchr(p, '\n', end - p);
+      p = nl ? nl + 1 : end;
+    }
+
+    bool parse_int(int& out)
+    {
+      skip_ws();
+      bool neg = false;
+      if(p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+
+      const char* start = p;
+      long long v = 0;
+      while(p < end && *p >= '0' && *p <= '9') v = v*10 + (*p++ - '0');
+      if(p == start) return false;
+
+      out = (int)(neg ? -v : v);
+      return true;
+    }
+
+    //decimal floats with optional sign, fraction and exponent.
+    //up to 19 significant digits are accumulated in an integer
+    //and scaled by a power of 10 in double precision, which is
+    //exact for the short numbers models are written with
+    bool parse_float(float& out)
+    {
+      static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                      1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                      1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+      skip_ws();
+      bool neg = false;
+      if(p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+
+      unsigned long long mantissa = 0;
+      int digits = 0, exp10 = 0;
+      bool any = false;
+
+      for(; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+      {
+        if(digits < 19) { mantissa = mantissa*10 + (*p - '0'); if(mantissa) ++digits; }
+        else ++exp10;
+      }
+
+      if(p < end && *p == '.')
+      {
+        for(++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+        {
+          if(digits < 19) { mantissa = mantissa*10 + (*p - '0'); if(mantissa) ++digits; --exp10; }
+        }
+      }
+      if(!any) return false;
+
+      if(p < end && (*p == 'e' || *p == 'E'))
+      {
+        int e;
+        ++p;
+        if(!parse_int(e)) return false;
+        exp10 += e;
+      }
+
+      double v = (double)mantissa;
+      if(exp10 < 0) v = (exp10 >= -22) ? v / pow10[-exp10] : v * pow(10.0, exp10);
+      else if(exp10 > 0) v = (exp10 <= 22) ? v * pow10[exp10] : v * pow(10.0, exp10);
+
+      out = (float)(neg ? -v : v);
+      return true;
+    }
+  };
+
+  //first line starting with "v0" at or after p
+  const char* next_triangle(const char* begin, const char* p, const char* end)
+  {
+    if(p == begin) return p;
+
+    //start one byte early, so that a line starting right at p counts
+    for(const char* q = p - 1; q < end; )
+    {
+      const char* nl = (const char*)memchr(q, '\n', end - q);
+      if(!nl) return end;
+      q = nl + 1;
+      if(end - q >= 2 && q[0] == 'v' && q[1] == '0') return q;
+    }
+    return end;
+  }
+
+  int count_triangles(const char* p, const char* end)
+  {
+    int count = 0;
+    while(p < end)
+    {
+      if(end - p >= 2 && p[0] == 'v' && p[1] == '0') ++count;
+      const char* nl = (const char*)memchr(p, '\n', end - p);
+      if(!nl) break;
+      p = nl + 1;
+    }
+    return count;
+  }
+}
+
+void Mesh::load_text(const std::string& path, int n_threads)
+{
+  //a file that can't be opened leaves an empty
+  //mesh, which is what callers check for
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+  {
+    release();
+    tris.clear(); mats.clear();
+    return;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    load_text_scanf(path);
+    return;
+  }
+
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    load_text_scanf(path);
+    return;
+  }
+
+  //we'll read it from start to end once
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  Cursor c = { (const char*)data, (const char*)data + st.st_size };
+  bool ok = true;
+
+  //1. name
+  ok = ok && c.expect("Object") && c.expect("name") && c.expect("=") && c.skip_token();
+
+  //2. triangle count
+  int n_tris = 0;
+  ok = ok && c.expect("#") && c.expect("triangles") && c.expect("=") && c.parse_int(n_tris);
+
+  //3. material count
+  int n_mats = 0;
+  ok = ok && c.expect("Material") && c.expect("count") && c.expect("=") && c.parse_int(n_mats);
+  ok = ok && n_tris >= 0 && n_mats >= 0;
+
+  //4. materials (groups of 4 lines describing amb, diff, spec and shininess)
+  std::vector<Material> mats_buffer(ok ? n_mats : 0);
+  for(int i = 0; ok && i < n_mats; ++i)
+  {
+    Material& cur = mats_buffer[i];
+    ok = c.expect("ambient") && c.expect("color") &&
+          c.parse_float(cur.a[0]) && c.parse_float(cur.a[1]) && c.parse_float(cur.a[2]) &&
+          c.expect("diffuse") && c.expect("color") &&
+          c.parse_float(cur.d[0]) && c.parse_float(cur.d[1]) && c.parse_float(cur.d[2]) &&
+          c.expect("specular") && c.expect("color") &&
+          c.parse_float(cur.s[0]) && c.parse_float(cur.s[1]) && c.parse_float(cur.s[2]) &&
+          c.expect("material") && c.expect("shine") && c.parse_float(cur.shininess);
+  }
+
+  //5. spurious line
+  ok = ok && c.expect("--");
+  c.skip_line();
+  c.skip_ws();
+
+  if(!ok)
+  {
+    munmap(data, st.st_size);
+    load_text_scanf(path);
+    return;
+  }
+
+  //6. triangles. split the section in a few chunks per thread
+  //(so that a slow chunk doesn't hold everybody back) starting
+  //at "v0" lines, then count the triangles in each chunk so we
+  //know at which column each one starts writing
+  ThreadPool pool(n_threads);
+  const char *body = c.p, *end = c.end;
+  int n_chunks = std::max(1, std::min(4*pool.size(), (int)((end - body) >> 16)));
+
+  std::vector<const char*> bounds(n_chunks+1);
+  for(int i = 0; i < n_chunks; ++i)
+    bounds[i] = next_triangle(body, body + (end - body) / n_chunks * i, end);
+  bounds[n_chunks] = end;
+
+  std::vector<int> first_tri(n_chunks+1, 0);
+  pool.parallel_for(n_chunks, [&](int i) {
+    first_tri[i+1] = count_triangles(bounds[i], bounds[i+1]);
+  });
+  for(int i = 0; i < n_chunks; ++i) first_tri[i+1] += first_tri[i];
+
+  if(first_tri[n_chunks] != n_tris)
+  {
+    munmap(data, st.st_size);
+    load_text_scanf(path);
+    return;
+  }
+
+  //per-corner data, merged into unique vertices after reading
+  Eigen::MatrixXf pos(3, 3*n_tris), normal(3, 3*n_tris);
+  std::vector<uint32_t> material(3*n_tris);
+
+  std::atomic<bool> failed(false);
+  pool.parallel_for(n_chunks, [&](int i) {
+    static const char* labels[] = { "v0", "v1", "v2" };
+    Cursor cur = { bounds[i], bounds[i+1] };
+
+    for(int t = first_tri[i]; t < first_tri[i+1]; ++t)
+    {
+      for(int k = 0; k < 3; ++k)
+      {
+        int col = 3*t + k, m;
+        float *p = &pos(0, col), *n = &normal(0, col);
+        if( !cur.expect(labels[k]) ||
+            !cur.parse_float(p[0]) || !cur.parse_float(p[1]) || !cur.parse_float(p[2]) ||
+            !cur.parse_float(n[0]) || !cur.parse_float(n[1]) || !cur.parse_float(n[2]) ||
+            !cur.parse_int(m) || m < 0 || m >= n_mats )
+        {
+          failed = true;
+          return;
+        }
+        material[col] = m;
+      }
+
+      float fn;
+      if( !cur.expect("face") || !cur.expect("normal") ||
+          !cur.parse_float(fn) || !cur.parse_float(fn) || !cur.parse_float(fn) )
+      {
+        failed = true;
+        return;
+      }
+    }
+  });
+
+  munmap(data, st.st_size);
+
+  if(failed)
+  {
+    load_text_scanf(path);
+    return;
+  }
+
+  release();
+  tris.clear();
+  mats = mats_buffer;
+  index_vertices(pos, normal, material);
+}
@@ -2,7 +2,8 @@
 
 OGL::OGL(GlobalParameters& param,
           const char* path,
-          Widget *parent) : nanogui::GLCanvas(parent), param(param), framerate(0.0f)
+          Widget *parent) : nanogui::GLCanvas(parent), param(param),
+                            query_id(0), profiler(nullptr), framerate(0.0f), gpu_time(0.0f)
 {
   this->model.load_file(path);
 
@@ -15,18 +16,53 @@ OGL::OGL(GlobalParameters& param,
                               "../shaders/phong.fs");
 
   this->shader.bind();
-  this->shader.uploadAttrib<Eigen::MatrixXf>("pos", model.mPos);
-  this->shader.uploadAttrib<Eigen::MatrixXf>("normal", model.mNormal);
-  this->shader.uploadAttrib<Eigen::MatrixXf>("amb", model.mAmb);
-  this->shader.uploadAttrib<Eigen::MatrixXf>("diff", model.mDiff);
-  this->shader.uploadAttrib<Eigen::MatrixXf>("spec", model.mSpec);
-  this->shader.uploadAttrib<Eigen::MatrixXf>("shininess", model.mShininess);
+  this->shader.uploadAttrib("pos", model.mPos);
+  this->shader.uploadAttrib("normal", model.mNormal);
+
+  //indices of all the levels of detail, one after the other
+  IndexView indices(model.mIndices.data(), 3, model.total_triangles());
+  this->shader.uploadIndices(indices);
+
+  //vertices only carry the index of their material (as a float,
+  //which holds any index we'll ever see exactly). the table itself
+  //goes to a texture with one column per material and three rows:
+  //ambient color plus shininess, diffuse color and specular color
+  Eigen::MatrixXf material = model.mMaterial.cast<float>();
+  this->shader.uploadAttrib("material", material);
+
+  const std::vector<Material>& mats = model.materials();
+  int n_mats = std::max<int>(1, mats.size());
+  std::vector<float> table(4*3*n_mats, 0.0f);
+  for(size_t i = 0; i < mats.size(); ++i)
+  {
+    float* amb = &table[4*i], *diff = &table[4*(n_mats+i)], *spec = &table[4*(2*n_mats+i)];
+    for(int c = 0; c < 3; ++c)
+    {
+      amb[c] = mats[i].a[c]; diff[c] = mats[i].d[c]; spec[c] = mats[i].s[c];
+    }
+    amb[3] = mats[i].shininess;
+  }
+
+  glGenTextures(1, &material_texture);
+  glBindTexture(GL_TEXTURE_2D, material_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, n_mats, 3, 0, GL_RGBA, GL_FLOAT, table.data());
+
+  glGenQueries(2, queries);
+  query_pending[0] = query_pending[1] = false;
 }
 
 void OGL::drawGL()
 {
   using namespace nanogui;
-  clock_t delta = clock();
+
+  //no levels when the model failed to load or has no triangles.
+  //nothing to draw, and no query or GL state to set up and undo
+  if(model.levels().empty()) return;
+
+  Profiler::clock::time_point start = Profiler::clock::now();
+  glBeginQuery(GL_TIME_ELAPSED, queries[query_id]);
 
   //uniform uploading
   glm::mat4 view = glm::lookAt(param.cam.eye,
@@ -53,6 +89,10 @@ void OGL::drawGL()
   this->shader.setUniform("model_color", param.model_color);
   this->shader.setUniform("shadeId", param.shading);
 
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, material_texture);
+  this->shader.setUniform("materials", 0);
+
   //Z buffering
   glEnable(GL_DEPTH_TEST);
 
@@ -64,13 +104,60 @@ void OGL::drawGL()
   //draw mode
   glPolygonMode(GL_FRONT_AND_BACK, param.draw_mode);
 
-  this->shader.drawArray(GL_TRIANGLES, 0, model.mPos.cols());
+  //the coarsest level of detail that stays within
+  //a pixel of the full resolution model on screen
+  int lod = 0;
+  if(param.lod)
+    lod = model.select_level(glm::value_ptr(param.model2world), glm::value_ptr(param.cam.eye),
+                             param.cam.FoVx, param.cam.FoVy, width(), height(), LOD_PIXEL_ERROR);
+  const MeshLOD& level = model.levels()[lod];
+
+  //one draw per run of visible clusters. the mesh sorts triangles
+  //by the leaves of its BVH, so each run is a range of the indices.
+  //clusters facing away never reach the GPU
+  if((param.frustum_culling || param.cluster_culling) && level.n_nodes > 0)
+  {
+    glm::mat4 mvp = proj * view * param.model2world;
+    float model_eye[3], front;
+    BVH::to_model_space(glm::value_ptr(param.model2world), glm::value_ptr(param.cam.eye),
+                        param.front_face == GL_CCW, model_eye, front);
+    BVH::cull(level.nodes, param.cluster_culling ? level.cones : nullptr,
+              level.n_nodes, level.n_triangles,
+              param.frustum_culling ? glm::value_ptr(mvp) : nullptr,
+              model_eye, front, visible);
+    for(size_t i = 0; i < visible.size(); ++i)
+      this->shader.drawIndexed(GL_TRIANGLES, level.first_triangle + visible[i].first, visible[i].count);
+  }
+  else this->shader.drawIndexed(GL_TRIANGLES, level.first_triangle, level.n_triangles);
 
   //disable options
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
   glDisable(GL_DEPTH_TEST);
 
+  glEndQuery(GL_TIME_ELAPSED);
+  query_pending[query_id] = true;
+
+  //collect the GPU time of the previous frame, if it's ready
+  Profiler::clock::time_point end = Profiler::clock::now();
+  int previous = 1 - query_id;
+  GLint available = 0;
+  if(query_pending[previous])
+    glGetQueryObjectiv(queries[previous], GL_QUERY_RESULT_AVAILABLE, &available);
+  if(available)
+  {
+    GLuint64 ns;
+    glGetQueryObjectui64v(queries[previous], GL_QUERY_RESULT, &ns);
+    query_pending[previous] = false;
+    gpu_time = ns / 1e6f;
+
+    //we don't know when it ran, only for how long, so it
+    //shows up in the trace as if it had just finished
+    if(profiler) profiler->record("OpenGL GPU", end - std::chrono::nanoseconds(ns), end,
+                                  Profiler::GPU_TRACK);
+  }
+  query_id = previous;
+
   //compute time
-  delta = clock() - delta;
-  this->framerate = CLOCKS_PER_SEC/(float)delta;
+  if(profiler) profiler->record("OpenGL draw", start, end);
+  this->framerate = 1.0f / std::chrono::duration<float>(end - start).count();
 }
@@ -0,0 +1,103 @@
+#include "../include/profiler.h"
+#include <cstdio>
+#include <algorithm>
+
+Profiler::Profiler(int capacity)
+  : ring(capacity), next(0), frame(0), origin(clock::now())
+{
+}
+
+int Profiler::thread_track()
+{
+  //small ids, in the order threads first record something
+  static std::atomic<int> n_threads(0);
+  thread_local int track = n_threads++;
+  return track;
+}
+
+void Profiler::record(const char* name, clock::time_point start, clock::time_point end,
+                      int track)
+{
+  Event& e = slot();
+  e.name = name;
+  e.is_counter = false;
+  e.track = track < 0 ? thread_track() : track;
+  e.frame = frame;
+  e.start_us = std::chrono::duration<double, std::micro>(start - origin).count();
+  e.value = std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+void Profiler::counter(const char* name, double value)
+{
+  Event& e = slot();
+  e.name = name;
+  e.is_counter = true;
+  e.track = thread_track();
+  e.frame = frame;
+  e.start_us = std::chrono::duration<double, std::micro>(clock::now() - origin).count();
+  e.value = value;
+}
+
+std::vector<Profiler::Entry> Profiler::summary(int n_frames) const
+{
+  //the frame being recorded is incomplete, so look at the ones before it
+  uint64_t n = std::min<uint64_t>(next, ring.size());
+  uint32_t last = frame, first = last > (uint32_t)n_frames ? last - n_frames : 0;
+
+  std::vector<Entry> entries;
+  std::vector<int> samples;
+  for(uint64_t i = next - n; i < next; ++i)
+  {
+    const Event& e = ring[i % ring.size()];
+    if(e.frame < first || e.frame >= last) continue;
+
+    size_t k = 0;
+    while(k < entries.size() && (entries[k].name != e.name || entries[k].is_counter != e.is_counter)) ++k;
+    if(k == entries.size())
+    {
+      Entry entry = { e.name, e.is_counter, 0.0 };
+      entries.push_back(entry);
+      samples.push_back(0);
+    }
+
+    //intervals add up within a frame (e.g. one per tile), counters
+    //are averaged over the values recorded
+    if(e.is_counter) { entries[k].value += e.value; ++samples[k]; }
+    else entries[k].value += e.value / 1000.0;
+  }
+
+  int frames = std::max(1, (int)(last - first));
+  for(size_t k = 0; k < entries.size(); ++k)
+    entries[k].value /= entries[k].is_counter ? std::max(1, samples[k]) : frames;
+
+  return entries;
+}
+
+bool Profiler::export_chrome_trace(const std::string& path) const
+{
+  FILE* file = fopen(path.c_str(), "w");
+  if(!file) return false;
+
+  //trace event format: complete events ("X") for intervals
+  //and counter events ("C"), timestamps in microseconds
+  fprintf(file, "{\"traceEvents\": [\n");
+  fprintf(file, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": \"GPU\"}}", GPU_TRACK);
+
+  uint64_t n = std::min<uint64_t>(next, ring.size());
+  for(uint64_t i = next - n; i < next; ++i)
+  {
+    const Event& e = ring[i % ring.size()];
+    if(e.is_counter)
+      fprintf(file, ",\n  {\"name\": \"%s\", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"args\": {\"value\": %.6g}}",
+              e.name, e.track, e.start_us, e.value);
+    else
+      fprintf(file, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %u}}",
+              e.name, e.track, e.start_us, e.value, e.frame);
+  }
+
+  fprintf(file, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+  return fclose(file) == 0;
+}
@@ -0,0 +1,176 @@
+#include "../include/renderthread.h"
+#include <chrono>
+#include <iostream>
+
+RenderThread::RenderThread(const Mesh& mesh, int width, int height,
+                           int profile_frames, int n_threads)
+  : almostgl(mesh, width, height, n_threads), profile_frames(profile_frames),
+    pending_width(width), pending_height(height), has_pending(false), quit(false),
+    submitted_width(0), submitted_height(0), has_submitted(false),
+    back(0), ready(1), front(2), fresh(false), n_frames(0),
+    memory_size(0), rendering(false)
+{
+  for(int i = 0; i < 3; ++i)
+  {
+    frames[i].color = nullptr;
+    frames[i].slot = -1;
+    frames[i].width = frames[i].height = 0;
+    frames[i].number = 0;
+    frames[i].ms = 0.0;
+    memory[i] = nullptr;
+  }
+  almostgl.set_profiler(&profiler);
+  thread = std::thread(&RenderThread::run, this);
+}
+
+RenderThread::~RenderThread()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  wake.notify_one();
+  thread.join();
+}
+
+void RenderThread::submit(const GlobalParameters& param, int width, int height)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(has_submitted && width == submitted_width && height == submitted_height &&
+       param == submitted)
+      return;
+
+    pending = submitted = param;
+    pending_width = submitted_width = width;
+    pending_height = submitted_height = height;
+    has_pending = has_submitted = true;
+  }
+  wake.notify_one();
+}
+
+const RenderedFrame* RenderThread::latest()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if(fresh)
+  {
+    std::swap(front, ready);
+    fresh = false;
+  }
+  return frames[front].width > 0 ? &frames[front] : nullptr;
+}
+
+void RenderThread::set_frame_memory(GLubyte* const memory[3], size_t memory_size)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this] { return !rendering; });
+
+  for(int i = 0; i < 3; ++i)
+  {
+    this->memory[i] = memory ? memory[i] : nullptr;
+    frames[i].color = nullptr;
+    frames[i].width = frames[i].height = 0;
+  }
+  this->memory_size = memory ? memory_size : 0;
+  fresh = false;
+
+  //the frames are gone, so the next submit renders again
+  has_submitted = false;
+}
+
+void RenderThread::set_frame_callback(const std::function<void()>& f)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  on_frame = f;
+}
+
+void RenderThread::export_trace(const std::string& path)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    trace_path = path;
+  }
+  wake.notify_one();
+}
+
+void RenderThread::run()
+{
+  typedef std::chrono::steady_clock clock;
+
+  for(;;)
+  {
+    GlobalParameters param;
+    int width, height;
+    std::string trace;
+    GLubyte* target = nullptr;
+    bool render;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this] { return has_pending || quit || !trace_path.empty(); });
+      if(quit) return;
+
+      render = has_pending;
+      param = pending;
+      width = pending_width; height = pending_height;
+      has_pending = false;
+      trace.swap(trace_path);
+
+      //memory can't be taken away while we render into it
+      if(render)
+      {
+        target = 4*(size_t)width*height <= memory_size ? memory[back] : nullptr;
+        rendering = true;
+      }
+    }
+
+    //between two frames nobody records in the profiler
+    if(!trace.empty())
+    {
+      if(profiler.export_chrome_trace(trace))
+        std::cout<<"Trace written to "<<trace<<std::endl;
+      else std::cout<<"Could not write "<<trace<<std::endl;
+    }
+    if(!render) continue;
+
+    if(width != almostgl.width() || height != almostgl.height())
+      almostgl.resize(width, height);
+
+    //back is only ever touched by this thread, and
+    //AlmostGL renders straight into its memory
+    RenderedFrame& frame = frames[back];
+    if(target)
+    {
+      frame.slot = back;
+      frame.storage.clear();
+      frame.storage.shrink_to_fit();
+    }
+    else
+    {
+      frame.slot = -1;
+      frame.storage.resize(4*(size_t)width*height);
+      target = frame.storage.data();
+    }
+    almostgl.set_color_target(target);
+
+    clock::time_point start = clock::now();
+    profiler.begin_frame();
+    almostgl.render(param);
+
+    frame.color = target;
+    frame.width = width; frame.height = height;
+    frame.number = ++n_frames;
+    frame.ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    frame.breakdown = profiler.summary(profile_frames);
+
+    std::function<void()> callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      rendering = false;
+      std::swap(back, ready);
+      fresh = true;
+      callback = on_frame;
+    }
+    idle.notify_all();
+    if(callback) callback();
+  }
+}
@@ -0,0 +1,264 @@
+#include "../include/reorder.h"
+#include <cmath>
+#include <algorithm>
+
+namespace
+{
+  //score of a vertex in Forsyth's scheme: vertices in the cache are
+  //worth more the more recently they were used (except the last three,
+  //which the last triangle just used and the next one can't use all of)
+  //and vertices with few triangles left to draw are worth more, so that
+  //they are done with and don't leave lonely triangles behind
+  float vertex_score(int cache_pos, uint32_t valence)
+  {
+    if(valence == 0) return -1.0f;
+
+    float score = 0.0f;
+    if(cache_pos >= 0)
+    {
+      if(cache_pos < 3) score = 0.75f;
+      else score = powf(1.0f - (float)(cache_pos - 3) / (REORDER_CACHE_SIZE - 3), 1.5f);
+    }
+    return score + 2.0f / sqrtf((float)valence);
+  }
+
+  //what a subtree looks like from afar, to decide the
+  //order of the children of a node for Reorder::overdraw
+  struct Cluster
+  {
+    double normal[3];   //sum of area weighted normals
+    double center[3];   //sum of area weighted centroids
+    double area;
+
+    void add(const Cluster& c)
+    {
+      for(int k = 0; k < 3; ++k) { normal[k] += c.normal[k]; center[k] += c.center[k]; }
+      area += c.area;
+    }
+  };
+}
+
+void Reorder::overdraw(const float* pos, uint32_t* indices, int n_triangles,
+                       std::vector<BVHNode>& nodes, std::vector<NormalCone>& cones)
+{
+  int n_nodes = nodes.size();
+  if(n_nodes < 2) return;
+
+  //clusters of the leaves go through their triangles, the ones of
+  //interior nodes add up those of their children, which come after
+  std::vector<Cluster> clusters(n_nodes);
+  for(int i = n_nodes-1; i >= 0; --i)
+  {
+    Cluster& c = clusters[i];
+    if(nodes[i].skip != (uint32_t)i+1)
+    {
+      c = clusters[i+1];
+      c.add(clusters[nodes[i+1].skip]);
+      continue;
+    }
+
+    c = Cluster();
+    int end = i+1 < n_nodes ? nodes[i+1].first : n_triangles;
+    for(int t = nodes[i].first; t < end; ++t)
+    {
+      const float *a = &pos[3*indices[3*t]], *b = &pos[3*indices[3*t+1]], *d = &pos[3*indices[3*t+2]];
+      double u[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+      double v[3] = { d[0]-a[0], d[1]-a[1], d[2]-a[2] };
+      double n[3] = { u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2], u[0]*v[1] - u[1]*v[0] };
+      double area = 0.5*sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      for(int k = 0; k < 3; ++k)
+      {
+        c.normal[k] += 0.5*n[k];
+        c.center[k] += area*(a[k] + b[k] + d[k])/3.0;
+      }
+      c.area += area;
+    }
+  }
+
+  //how much a cluster faces away from the center of its parent
+  auto outwards = [&](int i, int parent) {
+    const Cluster &c = clusters[i], &p = clusters[parent];
+    double l = sqrt(c.normal[0]*c.normal[0] + c.normal[1]*c.normal[1] + c.normal[2]*c.normal[2]);
+    if(c.area <= 0.0 || l <= 0.0 || p.area <= 0.0) return 0.0;
+
+    double d = 0.0;
+    for(int k = 0; k < 3; ++k) d += (c.center[k]/c.area - p.center[k]/p.area) * c.normal[k]/l;
+    return d;
+  };
+
+  //lay the tree out again depth first, taking the children of each
+  //node in the order chosen. subtrees keep their triangles together,
+  //so they are copied as the leaves come out
+  std::vector<BVHNode> new_nodes;
+  std::vector<NormalCone> new_cones;
+  std::vector<uint32_t> new_indices;
+  std::vector<bool> leaf;
+  new_nodes.reserve(n_nodes); new_cones.reserve(n_nodes);
+  new_indices.reserve(3*n_triangles);
+
+  std::vector<int> stack(1, 0);
+  while(!stack.empty())
+  {
+    int i = stack.back();
+    stack.pop_back();
+
+    BVHNode node = nodes[i];
+    node.first = new_indices.size() / 3;
+    new_nodes.push_back(node);
+    new_cones.push_back(cones[i]);
+
+    bool is_leaf = nodes[i].skip == (uint32_t)i+1;
+    leaf.push_back(is_leaf);
+    if(is_leaf)
+    {
+      int end = i+1 < n_nodes ? nodes[i+1].first : n_triangles;
+      new_indices.insert(new_indices.end(), &indices[3*nodes[i].first], &indices[3*end]);
+      continue;
+    }
+
+    int a = i+1, b = nodes[i+1].skip;
+    if(outwards(a, i) < outwards(b, i)) std::swap(a, b);
+    stack.push_back(b);
+    stack.push_back(a);
+  }
+
+  //skips as BVH::build computes them
+  for(int i = n_nodes-1; i >= 0; --i)
+    new_nodes[i].skip = leaf[i] ? i+1 : new_nodes[new_nodes[i+1].skip].skip;
+
+  std::copy(new_indices.begin(), new_indices.end(), indices);
+  nodes.swap(new_nodes);
+  cones.swap(new_cones);
+}
+
+void Reorder::vertex_cache(uint32_t* indices, int n_triangles, int n_vertices,
+                           const BVHNode* nodes, int n_nodes)
+{
+  if(n_triangles == 0) return;
+
+  //triangles around each vertex, and how many
+  //of them are still waiting to be drawn
+  std::vector<uint32_t> offsets(n_vertices+1, 0), adjacency(3*n_triangles), valence(n_vertices, 0);
+  for(int i = 0; i < 3*n_triangles; ++i) ++offsets[indices[i]+1];
+  for(int v = 0; v < n_vertices; ++v) offsets[v+1] += offsets[v];
+  for(int i = 0; i < 3*n_triangles; ++i)
+  {
+    uint32_t v = indices[i];
+    adjacency[offsets[v] + valence[v]++] = i/3;
+  }
+
+  std::vector<float> score(n_vertices);
+  std::vector<int> cache_pos(n_vertices, -1);
+  for(int v = 0; v < n_vertices; ++v) score[v] = vertex_score(-1, valence[v]);
+
+  //most recently used first. it holds up to 3 vertices more than
+  //the cache, those of the triangle that just pushed them out
+  std::vector<uint32_t> cache, next_cache;
+  std::vector<unsigned char> done(n_triangles, 0);
+  std::vector<uint32_t> out(3*n_triangles);
+
+  auto tri_score = [&](uint32_t t) {
+    return score[indices[3*t]] + score[indices[3*t+1]] + score[indices[3*t+2]];
+  };
+
+  //a mesh with no hierarchy is one big leaf
+  int n_leaves = std::max(n_nodes, 1);
+  for(int i = 0; i < n_leaves; ++i)
+  {
+    if(n_nodes > 0 && nodes[i].skip != (uint32_t)i+1) continue;
+    uint32_t first = n_nodes > 0 ? nodes[i].first : 0;
+    uint32_t end = i+1 < n_nodes ? nodes[i+1].first : n_triangles;
+
+    for(uint32_t k = first; k < end; ++k)
+    {
+      //the best triangle of the leaf using a vertex in the cache.
+      //if there is none, the best of the leaf
+      int best = -1;
+      float best_score = -1e30f;
+      for(size_t c = 0; c < cache.size(); ++c)
+      {
+        uint32_t v = cache[c];
+        for(uint32_t j = offsets[v]; j < offsets[v+1]; ++j)
+        {
+          uint32_t t = adjacency[j];
+          if(done[t] || t < first || t >= end) continue;
+          float s = tri_score(t);
+          if(s > best_score) { best_score = s; best = t; }
+        }
+      }
+      if(best < 0)
+        for(uint32_t t = first; t < end; ++t)
+        {
+          if(done[t]) continue;
+          float s = tri_score(t);
+          if(s > best_score) { best_score = s; best = t; }
+        }
+
+      done[best] = 1;
+      const uint32_t* tri = &indices[3*best];
+      for(int v = 0; v < 3; ++v)
+      {
+        out[3*k+v] = tri[v];
+        --valence[tri[v]];
+      }
+
+      //the vertices of the triangle go to the front of the cache
+      next_cache.clear();
+      for(int v = 0; v < 3; ++v)
+        if(std::find(next_cache.begin(), next_cache.end(), tri[v]) == next_cache.end())
+          next_cache.push_back(tri[v]);
+      for(size_t c = 0; c < cache.size(); ++c)
+        if(cache[c] != tri[0] && cache[c] != tri[1] && cache[c] != tri[2])
+          next_cache.push_back(cache[c]);
+
+      //whatever falls off the end leaves the cache
+      for(size_t c = REORDER_CACHE_SIZE; c < next_cache.size(); ++c)
+      {
+        uint32_t v = next_cache[c];
+        cache_pos[v] = -1;
+        score[v] = vertex_score(-1, valence[v]);
+      }
+      if(next_cache.size() > REORDER_CACHE_SIZE) next_cache.resize(REORDER_CACHE_SIZE);
+
+      cache.swap(next_cache);
+      for(size_t c = 0; c < cache.size(); ++c)
+      {
+        cache_pos[cache[c]] = c;
+        score[cache[c]] = vertex_score(c, valence[cache[c]]);
+      }
+    }
+  }
+
+  std::copy(out.begin(), out.end(), indices);
+}
+
+void Reorder::vertex_fetch(uint32_t* indices, int n_indices, int n_triangles, int n_vertices,
+                           std::vector<uint32_t>& remap)
+{
+  remap.assign(n_vertices, UINT32_MAX);
+  uint32_t next = 0;
+  for(int i = 0; i < 3*n_triangles; ++i)
+    if(remap[indices[i]] == UINT32_MAX) remap[indices[i]] = next++;
+
+  //vertices no triangle uses go last
+  for(int v = 0; v < n_vertices; ++v)
+    if(remap[v] == UINT32_MAX) remap[v] = next++;
+
+  for(int i = 0; i < n_indices; ++i) indices[i] = remap[indices[i]];
+}
+
+float Reorder::acmr(const uint32_t* indices, int n_triangles, int n_vertices, int cache_size)
+{
+  if(n_triangles == 0) return 0.0f;
+
+  //a vertex is in the FIFO if fewer than cache_size
+  //misses happened since it was last put in
+  std::vector<int64_t> inserted(n_vertices, -1);
+  int64_t misses = 0;
+  for(int i = 0; i < 3*n_triangles; ++i)
+  {
+    uint32_t v = indices[i];
+    if(inserted[v] < 0 || misses - inserted[v] >= cache_size) inserted[v] = misses++;
+  }
+  return (float)misses / n_triangles;
+}
@@ -0,0 +1,50 @@
+#include "../include/resolution.h"
+#include <cmath>
+#include <algorithm>
+
+ResolutionScale::ResolutionScale(double target_ms, float min_scale)
+  : enabled(true), target_ms(target_ms), min_scale(min_scale),
+    estimate(1.0f), current(1.0f),
+    last_motion(clock::now() - std::chrono::milliseconds(RESOLUTION_REST_MS))
+{
+
+}
+
+void ResolutionScale::frame_done(int width, int window_width, double ms)
+{
+  if(width <= 0 || window_width <= 0 || ms <= 0.0) return;
+
+  //frames rendered at rest count too: the
+  //next motion then starts at the right scale
+  float rendered = std::min(1.0f, (float)width / window_width);
+  float wanted = rendered * (float)std::sqrt(target_ms / ms);
+
+  //halfway there, so a single slow frame doesn't make it jump
+  estimate += 0.5f * (wanted - estimate);
+  estimate = std::max(min_scale, std::min(1.0f, estimate));
+
+  //only move to another step once the estimate is a whole
+  //step away, otherwise it would go back and forth between two
+  if(std::fabs(estimate - current) >= RESOLUTION_STEP)
+  {
+    current = std::round(estimate / RESOLUTION_STEP) * RESOLUTION_STEP;
+    current = std::max(min_scale, std::min(1.0f, current));
+  }
+}
+
+void ResolutionScale::motion()
+{
+  last_motion = clock::now();
+}
+
+bool ResolutionScale::moving() const
+{
+  return clock::now() - last_motion < std::chrono::milliseconds(RESOLUTION_REST_MS);
+}
+
+void ResolutionScale::render_size(int window_width, int window_height, int& width, int& height) const
+{
+  float scale = enabled && moving() ? current : 1.0f;
+  width = std::max(1, (int)std::lround(window_width * scale));
+  height = std::max(1, (int)std::lround(window_height * scale));
+}
@@ -0,0 +1,77 @@
+#include "../include/threadpool.h"
+
+ThreadPool::ThreadPool(int n_threads)
+  : job(nullptr), n_jobs(0), pending(0), generation(0), next_job(0), quit(false)
+{
+  if(n_threads <= 0) n_threads = std::thread::hardware_concurrency();
+  if(n_threads <= 0) n_threads = 1;
+
+  //the calling thread counts as one of the threads
+  for(int i = 1; i < n_threads; ++i)
+    workers.push_back( std::thread(&ThreadPool::worker_loop, this) );
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  wake.notify_all();
+
+  for(auto& w : workers) w.join();
+}
+
+void ThreadPool::run_jobs()
+{
+  for(int i = next_job++; i < n_jobs; i = next_job++)
+    (*job)(i);
+}
+
+void ThreadPool::worker_loop()
+{
+  int seen_generation = 0;
+
+  while(true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return quit || generation != seen_generation; });
+      if(quit) return;
+      seen_generation = generation;
+    }
+
+    run_jobs();
+
+    //the last worker to run out of jobs wakes the caller
+    std::lock_guard<std::mutex> lock(mutex);
+    if(--pending == 0) done.notify_one();
+  }
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int)>& fn)
+{
+  if(n <= 0) return;
+
+  //not worth waking anybody up
+  if(workers.empty() || n == 1)
+  {
+    for(int i = 0; i < n; ++i) fn(i);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn; n_jobs = n; next_job = 0;
+    pending = (int)workers.size();
+    ++generation;
+  }
+  wake.notify_all();
+
+  run_jobs();
+
+  //every worker must check in before we return, otherwise
+  //a late one could still be reading fn after it is gone
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return pending == 0; });
+}
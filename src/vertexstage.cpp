@@ -0,0 +1,395 @@
+#include "../include/vertexstage.h"
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VERTEXSTAGE_X86
+#include <immintrin.h>
+#endif
+
+//ambient term used by the Gouraud shading models
+#define AMBIENT 0.2f
+
+//element (i,j) of a column-major 4x4 matrix
+#define M(m,i,j) (m[(i)+4*(j)])
+
+namespace
+{
+  //x^15 with four multiplications. it agrees with pow()
+  //for x >= 0, which is the only case we care about
+  inline float pow15(float x)
+  {
+    float x2 = x*x, x4 = x2*x2, x8 = x4*x4;
+    return x8*x4*x2*x;
+  }
+
+  //kernels are instantiated per shading model, so that the loops
+  //have no branches on it and compute only what the model uses:
+  //0 = Gouraud AD, 1 = Gouraud ADS, 2 = per-pixel (normals only),
+  //3 = no lighting
+
+  template<int SHADING>
+  void process_scalar(const VertexStreams& in,
+                      const VertexUniforms& u,
+                      int first, int last,
+                      float* out, int vertex_sz)
+  {
+    const float *m = u.model, *p = u.vp;
+
+    for(int i = first; i < last; ++i)
+    {
+      float x = in.px[i], y = in.py[i], z = in.pz[i];
+
+      //model space -> world space
+      float wx = M(m,0,0)*x + M(m,0,1)*y + M(m,0,2)*z + M(m,0,3);
+      float wy = M(m,1,0)*x + M(m,1,1)*y + M(m,1,2)*z + M(m,1,3);
+      float wz = M(m,2,0)*x + M(m,2,1)*y + M(m,2,2)*z + M(m,2,3);
+      float ww = M(m,3,0)*x + M(m,3,1)*y + M(m,3,2)*z + M(m,3,3);
+
+      //world space -> clip space
+      float* o = &out[vertex_sz*i];
+      for(int r = 0; r < 4; ++r)
+        o[r] = M(p,r,0)*wx + M(p,r,1)*wy + M(p,r,2)*wz + M(p,r,3)*ww;
+
+      o[7] = in.material[i];
+      if(SHADING == 3)
+      {
+        for(int c = 0; c < 3; ++c) o[4+c] = u.model_color[c];
+        continue;
+      }
+
+      //normals are flipped as in phong.vs
+      if(SHADING == 2)
+      {
+        o[4] = -in.nx[i]; o[5] = -in.ny[i]; o[6] = -in.nz[i];
+        continue;
+      }
+
+      //Blinn-Phong. normals are not transformed, just
+      //like in the OpenGL canvas (see phong.vs)
+      float lx = u.light[0]-wx, ly = u.light[1]-wy, lz = u.light[2]-wz, lw = u.light[3]-ww;
+      float l_inv = 1.0f / sqrtf(lx*lx + ly*ly + lz*lz + lw*lw);
+      lx *= l_inv; ly *= l_inv; lz *= l_inv; lw *= l_inv;
+
+      float nx = in.nx[i], ny = in.ny[i], nz = in.nz[i];
+      float diff = std::max(0.0f, -(lx*nx + ly*ny + lz*nz));
+
+      float spec = 0.0f;
+      if(SHADING == 1)
+      {
+        float ex = u.eye[0]-wx, ey = u.eye[1]-wy, ez = u.eye[2]-wz, ew = 1.0f-ww;
+        float e_inv = 1.0f / sqrtf(ex*ex + ey*ey + ez*ez + ew*ew);
+        ex *= e_inv; ey *= e_inv; ez *= e_inv; ew *= e_inv;
+
+        float hx = lx+ex, hy = ly+ey, hz = lz+ez, hw = lw+ew;
+        float h_inv = 1.0f / sqrtf(hx*hx + hy*hy + hz*hz + hw*hw);
+        hx *= h_inv; hy *= h_inv; hz *= h_inv;
+        spec = pow15(std::max(0.0f, -(hx*nx + hy*ny + hz*nz)));
+      }
+
+      for(int c = 0; c < 3; ++c)
+        o[4+c] = u.model_color[c] * (AMBIENT + diff) + spec;
+    }
+  }
+
+#ifdef VERTEXSTAGE_X86
+  //---------------------------------
+  //--------------- SSE -------------
+  //---------------------------------
+  //SSE2 is part of x86-64, so this needs no special target
+  inline __m128 sse_rcp_norm(__m128 x, __m128 y, __m128 z, __m128 w)
+  {
+    __m128 n2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x,x), _mm_mul_ps(y,y)),
+                            _mm_add_ps(_mm_mul_ps(z,z), _mm_mul_ps(w,w)));
+    return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(n2));
+  }
+
+  //dot product of a row of a column-major matrix and (x,y,z,w)
+  inline __m128 sse_row(const float* m, int r, __m128 x, __m128 y, __m128 z, __m128 w)
+  {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(M(m,r,0)), x),
+                                 _mm_mul_ps(_mm_set1_ps(M(m,r,1)), y)),
+                      _mm_add_ps(_mm_mul_ps(_mm_set1_ps(M(m,r,2)), z),
+                                 _mm_mul_ps(_mm_set1_ps(M(m,r,3)), w)));
+  }
+
+  template<int SHADING>
+  int process_sse(const VertexStreams& in,
+                  const VertexUniforms& u,
+                  int first, int last,
+                  float* out, int vertex_sz)
+  {
+    const float *m = u.model, *p = u.vp;
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+    int i = first;
+    for(; i + 4 <= last; i += 4)
+    {
+      __m128 x = _mm_loadu_ps(&in.px[i]);
+      __m128 y = _mm_loadu_ps(&in.py[i]);
+      __m128 z = _mm_loadu_ps(&in.pz[i]);
+
+      __m128 wx = sse_row(m, 0, x, y, z, one);
+      __m128 wy = sse_row(m, 1, x, y, z, one);
+      __m128 wz = sse_row(m, 2, x, y, z, one);
+      __m128 ww = sse_row(m, 3, x, y, z, one);
+
+      __m128 cx = sse_row(p, 0, wx, wy, wz, ww);
+      __m128 cy = sse_row(p, 1, wx, wy, wz, ww);
+      __m128 cz = sse_row(p, 2, wx, wy, wz, ww);
+      __m128 cw = sse_row(p, 3, wx, wy, wz, ww);
+
+      __m128 r, g, b;
+      if(SHADING == 3)
+      {
+        r = _mm_set1_ps(u.model_color[0]);
+        g = _mm_set1_ps(u.model_color[1]);
+        b = _mm_set1_ps(u.model_color[2]);
+      }
+      else if(SHADING == 2)
+      {
+        r = _mm_sub_ps(zero, _mm_loadu_ps(&in.nx[i]));
+        g = _mm_sub_ps(zero, _mm_loadu_ps(&in.ny[i]));
+        b = _mm_sub_ps(zero, _mm_loadu_ps(&in.nz[i]));
+      }
+      else
+      {
+        __m128 lx = _mm_sub_ps(_mm_set1_ps(u.light[0]), wx);
+        __m128 ly = _mm_sub_ps(_mm_set1_ps(u.light[1]), wy);
+        __m128 lz = _mm_sub_ps(_mm_set1_ps(u.light[2]), wz);
+        __m128 lw = _mm_sub_ps(_mm_set1_ps(u.light[3]), ww);
+        __m128 l_inv = sse_rcp_norm(lx, ly, lz, lw);
+        lx = _mm_mul_ps(lx, l_inv); ly = _mm_mul_ps(ly, l_inv);
+        lz = _mm_mul_ps(lz, l_inv); lw = _mm_mul_ps(lw, l_inv);
+
+        __m128 nx = _mm_loadu_ps(&in.nx[i]);
+        __m128 ny = _mm_loadu_ps(&in.ny[i]);
+        __m128 nz = _mm_loadu_ps(&in.nz[i]);
+
+        __m128 diff = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx,nx), _mm_mul_ps(ly,ny)), _mm_mul_ps(lz,nz));
+        diff = _mm_max_ps(zero, _mm_sub_ps(zero, diff));
+
+        __m128 spec = zero;
+        if(SHADING == 1)
+        {
+          __m128 ex = _mm_sub_ps(_mm_set1_ps(u.eye[0]), wx);
+          __m128 ey = _mm_sub_ps(_mm_set1_ps(u.eye[1]), wy);
+          __m128 ez = _mm_sub_ps(_mm_set1_ps(u.eye[2]), wz);
+          __m128 ew = _mm_sub_ps(one, ww);
+          __m128 e_inv = sse_rcp_norm(ex, ey, ez, ew);
+          ex = _mm_mul_ps(ex, e_inv); ey = _mm_mul_ps(ey, e_inv);
+          ez = _mm_mul_ps(ez, e_inv); ew = _mm_mul_ps(ew, e_inv);
+
+          __m128 hx = _mm_add_ps(lx, ex), hy = _mm_add_ps(ly, ey);
+          __m128 hz = _mm_add_ps(lz, ez), hw = _mm_add_ps(lw, ew);
+          __m128 h_inv = sse_rcp_norm(hx, hy, hz, hw);
+          hx = _mm_mul_ps(hx, h_inv); hy = _mm_mul_ps(hy, h_inv); hz = _mm_mul_ps(hz, h_inv);
+
+          __m128 s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(hx,nx), _mm_mul_ps(hy,ny)), _mm_mul_ps(hz,nz));
+          s = _mm_max_ps(zero, _mm_sub_ps(zero, s));
+          __m128 s2 = _mm_mul_ps(s, s), s4 = _mm_mul_ps(s2, s2), s8 = _mm_mul_ps(s4, s4);
+          spec = _mm_mul_ps(_mm_mul_ps(s8, s4), _mm_mul_ps(s2, s));
+        }
+
+        __m128 k = _mm_add_ps(_mm_set1_ps(AMBIENT), diff);
+        r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(u.model_color[0]), k), spec);
+        g = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(u.model_color[1]), k), spec);
+        b = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(u.model_color[2]), k), spec);
+      }
+
+      //back to one vertex per register before storing
+      __m128 a = _mm_loadu_ps(&in.material[i]);
+      _MM_TRANSPOSE4_PS(cx, cy, cz, cw);
+      _MM_TRANSPOSE4_PS(r, g, b, a);
+
+      float* o = &out[vertex_sz*i];
+      _mm_storeu_ps(o + 0*vertex_sz, cx); _mm_storeu_ps(o + 0*vertex_sz + 4, r);
+      _mm_storeu_ps(o + 1*vertex_sz, cy); _mm_storeu_ps(o + 1*vertex_sz + 4, g);
+      _mm_storeu_ps(o + 2*vertex_sz, cz); _mm_storeu_ps(o + 2*vertex_sz + 4, b);
+      _mm_storeu_ps(o + 3*vertex_sz, cw); _mm_storeu_ps(o + 3*vertex_sz + 4, a);
+    }
+
+    return i;
+  }
+
+  //---------------------------------
+  //-------------- AVX2 -------------
+  //---------------------------------
+  //compiled for AVX2+FMA regardless of the global flags,
+  //and only ever called if detect() says the CPU has them
+  #define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+  AVX2_TARGET inline __m256 avx_rcp_norm(__m256 x, __m256 y, __m256 z, __m256 w)
+  {
+    __m256 n2 = _mm256_fmadd_ps(x, x, _mm256_fmadd_ps(y, y, _mm256_fmadd_ps(z, z, _mm256_mul_ps(w, w))));
+    return _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(n2));
+  }
+
+  AVX2_TARGET inline __m256 avx_row(const float* m, int r, __m256 x, __m256 y, __m256 z, __m256 w)
+  {
+    return _mm256_fmadd_ps(_mm256_set1_ps(M(m,r,0)), x,
+           _mm256_fmadd_ps(_mm256_set1_ps(M(m,r,1)), y,
+           _mm256_fmadd_ps(_mm256_set1_ps(M(m,r,2)), z,
+                           _mm256_mul_ps(_mm256_set1_ps(M(m,r,3)), w))));
+  }
+
+  AVX2_TARGET inline void avx_store(float* o, int vertex_sz, __m128 v0, __m128 v1, __m128 v2, __m128 v3, int attr)
+  {
+    _MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+    _mm_storeu_ps(o + 0*vertex_sz + attr, v0);
+    _mm_storeu_ps(o + 1*vertex_sz + attr, v1);
+    _mm_storeu_ps(o + 2*vertex_sz + attr, v2);
+    _mm_storeu_ps(o + 3*vertex_sz + attr, v3);
+  }
+
+  template<int SHADING>
+  AVX2_TARGET int process_avx2(const VertexStreams& in,
+                               const VertexUniforms& u,
+                               int first, int last,
+                               float* out, int vertex_sz)
+  {
+    const float *m = u.model, *p = u.vp;
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+
+    int i = first;
+    for(; i + 8 <= last; i += 8)
+    {
+      __m256 x = _mm256_loadu_ps(&in.px[i]);
+      __m256 y = _mm256_loadu_ps(&in.py[i]);
+      __m256 z = _mm256_loadu_ps(&in.pz[i]);
+
+      __m256 wx = avx_row(m, 0, x, y, z, one);
+      __m256 wy = avx_row(m, 1, x, y, z, one);
+      __m256 wz = avx_row(m, 2, x, y, z, one);
+      __m256 ww = avx_row(m, 3, x, y, z, one);
+
+      __m256 c[4];
+      for(int r = 0; r < 4; ++r) c[r] = avx_row(p, r, wx, wy, wz, ww);
+
+      __m256 col[4];
+      col[3] = _mm256_loadu_ps(&in.material[i]);
+      if(SHADING == 3)
+      {
+        for(int k = 0; k < 3; ++k) col[k] = _mm256_set1_ps(u.model_color[k]);
+      }
+      else if(SHADING == 2)
+      {
+        col[0] = _mm256_sub_ps(zero, _mm256_loadu_ps(&in.nx[i]));
+        col[1] = _mm256_sub_ps(zero, _mm256_loadu_ps(&in.ny[i]));
+        col[2] = _mm256_sub_ps(zero, _mm256_loadu_ps(&in.nz[i]));
+      }
+      else
+      {
+        __m256 lx = _mm256_sub_ps(_mm256_set1_ps(u.light[0]), wx);
+        __m256 ly = _mm256_sub_ps(_mm256_set1_ps(u.light[1]), wy);
+        __m256 lz = _mm256_sub_ps(_mm256_set1_ps(u.light[2]), wz);
+        __m256 lw = _mm256_sub_ps(_mm256_set1_ps(u.light[3]), ww);
+        __m256 l_inv = avx_rcp_norm(lx, ly, lz, lw);
+        lx = _mm256_mul_ps(lx, l_inv); ly = _mm256_mul_ps(ly, l_inv);
+        lz = _mm256_mul_ps(lz, l_inv); lw = _mm256_mul_ps(lw, l_inv);
+
+        __m256 nx = _mm256_loadu_ps(&in.nx[i]);
+        __m256 ny = _mm256_loadu_ps(&in.ny[i]);
+        __m256 nz = _mm256_loadu_ps(&in.nz[i]);
+
+        __m256 diff = _mm256_fmadd_ps(lx, nx, _mm256_fmadd_ps(ly, ny, _mm256_mul_ps(lz, nz)));
+        diff = _mm256_max_ps(zero, _mm256_sub_ps(zero, diff));
+
+        __m256 spec = zero;
+        if(SHADING == 1)
+        {
+          __m256 ex = _mm256_sub_ps(_mm256_set1_ps(u.eye[0]), wx);
+          __m256 ey = _mm256_sub_ps(_mm256_set1_ps(u.eye[1]), wy);
+          __m256 ez = _mm256_sub_ps(_mm256_set1_ps(u.eye[2]), wz);
+          __m256 ew = _mm256_sub_ps(one, ww);
+          __m256 e_inv = avx_rcp_norm(ex, ey, ez, ew);
+          ex = _mm256_mul_ps(ex, e_inv); ey = _mm256_mul_ps(ey, e_inv);
+          ez = _mm256_mul_ps(ez, e_inv); ew = _mm256_mul_ps(ew, e_inv);
+
+          __m256 hx = _mm256_add_ps(lx, ex), hy = _mm256_add_ps(ly, ey);
+          __m256 hz = _mm256_add_ps(lz, ez), hw = _mm256_add_ps(lw, ew);
+          __m256 h_inv = avx_rcp_norm(hx, hy, hz, hw);
+          hx = _mm256_mul_ps(hx, h_inv); hy = _mm256_mul_ps(hy, h_inv); hz = _mm256_mul_ps(hz, h_inv);
+
+          __m256 s = _mm256_fmadd_ps(hx, nx, _mm256_fmadd_ps(hy, ny, _mm256_mul_ps(hz, nz)));
+          s = _mm256_max_ps(zero, _mm256_sub_ps(zero, s));
+          __m256 s2 = _mm256_mul_ps(s, s), s4 = _mm256_mul_ps(s2, s2), s8 = _mm256_mul_ps(s4, s4);
+          spec = _mm256_mul_ps(_mm256_mul_ps(s8, s4), _mm256_mul_ps(s2, s));
+        }
+
+        __m256 k = _mm256_add_ps(_mm256_set1_ps(AMBIENT), diff);
+        for(int j = 0; j < 3; ++j)
+          col[j] = _mm256_fmadd_ps(_mm256_set1_ps(u.model_color[j]), k, spec);
+      }
+
+      //transpose and store the lower and upper 4 vertices separately
+      float* o = &out[vertex_sz*i];
+      avx_store(o, vertex_sz, _mm256_castps256_ps128(c[0]), _mm256_castps256_ps128(c[1]),
+                _mm256_castps256_ps128(c[2]), _mm256_castps256_ps128(c[3]), 0);
+      avx_store(o, vertex_sz, _mm256_castps256_ps128(col[0]), _mm256_castps256_ps128(col[1]),
+                _mm256_castps256_ps128(col[2]), _mm256_castps256_ps128(col[3]), 4);
+      avx_store(o + 4*vertex_sz, vertex_sz, _mm256_extractf128_ps(c[0], 1), _mm256_extractf128_ps(c[1], 1),
+                _mm256_extractf128_ps(c[2], 1), _mm256_extractf128_ps(c[3], 1), 0);
+      avx_store(o + 4*vertex_sz, vertex_sz, _mm256_extractf128_ps(col[0], 1), _mm256_extractf128_ps(col[1], 1),
+                _mm256_extractf128_ps(col[2], 1), _mm256_extractf128_ps(col[3], 1), 4);
+    }
+
+    return i;
+  }
+#endif
+
+  template<int SHADING>
+  void process_kernel(VertexStage::Kernel k,
+                      const VertexStreams& in,
+                      const VertexUniforms& u,
+                      int first, int last,
+                      float* out, int vertex_sz)
+  {
+    //SIMD kernels return where they stopped, the
+    //scalar one takes care of the remaining vertices
+#ifdef VERTEXSTAGE_X86
+    if(k == VertexStage::AVX2) first = process_avx2<SHADING>(in, u, first, last, out, vertex_sz);
+    else if(k == VertexStage::SSE) first = process_sse<SHADING>(in, u, first, last, out, vertex_sz);
+#endif
+    process_scalar<SHADING>(in, u, first, last, out, vertex_sz);
+  }
+}
+
+namespace VertexStage
+{
+  Kernel detect()
+  {
+#ifdef VERTEXSTAGE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return AVX2;
+    return SSE;
+#else
+    return SCALAR;
+#endif
+  }
+
+  std::string name(Kernel k)
+  {
+    switch(k)
+    {
+      case AVX2: return "AVX2";
+      case SSE: return "SSE";
+      default: return "scalar";
+    }
+  }
+
+  void process(Kernel k,
+                const VertexStreams& in,
+                const VertexUniforms& u,
+                int first, int last,
+                float* out, int vertex_sz)
+  {
+    switch(u.shading)
+    {
+      case 0: process_kernel<0>(k, in, u, first, last, out, vertex_sz); break;
+      case 2: process_kernel<2>(k, in, u, first, last, out, vertex_sz); break;
+      case 3: process_kernel<3>(k, in, u, first, last, out, vertex_sz); break;
+      default: process_kernel<1>(k, in, u, first, last, out, vertex_sz); break;
+    }
+  }
+}